@@ -1,6 +1,8 @@
 #ifndef TAC08_CONFIG_H
 #define TAC08_CONFIG_H
 
+#include <stddef.h>
+
 namespace config {
 	const int INIT_SCREEN_WIDTH = 128;
 	const int INIT_SCREEN_HEIGHT = 128;
@@ -8,10 +10,42 @@ namespace config {
 	const int MIN_SCREEN_HEIGHT = 64;
 	const int MAX_SCREEN_WIDTH = 512;
 	const int MAX_SCREEN_HEIGHT = 512;
+	// defaults for the audio device, --audio-freq, --audio-channels and --audio-buffer set them
 	const int AUDIO_FREQ = 22050;
-	const int AUDIO_BUFFER_SIZE = 2048;
+	const int AUDIO_OUTPUT_CHANNELS = 2;
+	// samples per callback, about 23ms at 22050hz
+	const int AUDIO_BUFFER_SIZE = 512;
+	// the buffer is doubled up to this size when the device refuses it or keeps underrunning
+	const int AUDIO_MAX_BUFFER_SIZE = 8192;
 	const int AUDIO_CHANNELS = 4;
+	// channels mixed by the audio device, the first AUDIO_CHANNELS are the pico-8 channels and
+	// the rest can only be played with wavplay()
+	const int AUDIO_MIX_CHANNELS = 16;
+	// bytes of decoded wav samples kept cached, --wav-cache sets it in MB
+	const size_t WAV_CACHE_SIZE = 64 * 1024 * 1024;
+	// samples read ahead for each streamed wav, a power of 2
+	const int STREAM_BUFFER_SIZE = 8192;
+	// samples a cart can queue with pcmpush(), a power of 2
+	const int PCM_BUFFER_SIZE = 8192;
+	// frames in a row that can skip _draw to catch up when a cart runs slow
+	const int MAX_DRAW_SKIP = 1;
+	// frames recorded in a timeline requested with ctrl-e
+	const int TIMELINE_FRAMES = 300;
+	// frames the screen stays the same before the frame loop sleeps until input or the next frame
+	const int IDLE_FRAMES = 30;
 	const int PALETTE_SIZE = 16;
+	// number of lua instructions cart top level code / _init can run before yielding to the frame
+	// loop, so long running init code does not block the window. 0 = never yield.
+	const int BOOT_INSTRUCTION_BUDGET = 2000000;
+	// the virtual cpu stat(1) reports on, so carts see the same load on every machine. pico-8
+	// runs 8M cycles a second. a lua vm instruction costs a cycle, pixel costs are in 1/16ths of
+	// a cycle.
+	const int CPU_CYCLES_PER_SECOND = 8000000;
+	const int CPU_INSTRUCTION_CYCLES = 1;
+	const int CPU_FILL_COST = 2;
+	const int CPU_BLIT_COST = 8;
+	// lua instructions between calls of the count hook, the granularity they are counted in
+	const int CPU_HOOK_INSTRUCTIONS = 1024;
 }  // namespace config
 
 #endif /* CONFIG_H */
@@ -90,9 +90,6 @@ function menuitem(idx, label, func)
 	__tac08__.menu:menuitem(idx, label, func)
 end
 
-function flip() 
-end
-
 
 function __tac08__.make_api_list ()
 	__tac08__.api = {}
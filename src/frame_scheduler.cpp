@@ -0,0 +1,72 @@
+#include "frame_scheduler.h"
+
+#include <algorithm>
+
+#include "hal_core.h"
+#include "timeline.h"
+
+void FrameScheduler::setRate(uint32_t rate) {
+	if (rate != fps) {
+		fps = rate;
+		last = TIME_GetTime_us();
+		// the first tick is due straight away
+		accumulator = TICK;
+	}
+}
+
+void FrameScheduler::advance(uint64_t now) {
+	accumulator += (now - last) * fps;
+	last = now;
+}
+
+bool FrameScheduler::wait(bool idle) {
+	timeline::Scope scope("wait");
+	bool woken = false;
+	advance(TIME_GetTime_us());
+	if (accumulator < TICK) {
+		uint64_t due = last + (TICK - accumulator + fps - 1) / fps;
+		if (idle) {
+			// sleeps without spinning. an event starts the tick straight away, the schedule
+			// carries on from there
+			woken = EVT_WaitUntil_us(due);
+			advance(TIME_GetTime_us());
+			if (woken) {
+				accumulator = std::max(accumulator, TICK);
+			}
+		} else {
+			TIME_WaitUntil_us(due);
+			advance(TIME_GetTime_us());
+		}
+	} else {
+		// already due, but the display can still be given a frame that has gone unshown too long
+		TIME_WaitUntil_us(last);
+	}
+	if (accumulator >= TICK * (MAX_LAG + 1)) {
+		uint64_t behind = accumulator / TICK - 1;
+		stats.dropped += (uint32_t)behind;
+		accumulator -= behind * TICK;
+	}
+	accumulator -= TICK;
+
+	// what is left over is how long ago the tick was due
+	uint64_t late = accumulator / fps;
+	jitterTotalUs += late;
+	jitterMaxUs = std::max(jitterMaxUs, late);
+	stats.ticks++;
+	return woken;
+}
+
+uint32_t FrameScheduler::behind() {
+	advance(TIME_GetTime_us());
+	return (uint32_t)(accumulator / TICK);
+}
+
+FrameScheduler::Stats FrameScheduler::takeStats() {
+	Stats s = stats;
+	s.jitterAvgUs = s.ticks ? (float)jitterTotalUs / s.ticks : 0;
+	s.jitterMaxUs = (float)jitterMaxUs;
+	stats = Stats();
+	jitterTotalUs = 0;
+	jitterMaxUs = 0;
+	return s;
+}
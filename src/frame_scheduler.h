@@ -0,0 +1,53 @@
+#ifndef FRAME_SCHEDULER_H
+#define FRAME_SCHEDULER_H
+
+#include <stdint.h>
+
+// runs logic ticks at an exact rate whatever the display refreshes at. the time since the last
+// tick is added to an accumulator and a tick is due for each whole tick period in it, so ticks
+// land on average exactly 1/fps apart. waiting sleeps and then spins for the last moments, except
+// when idle.
+class FrameScheduler {
+   public:
+	struct Stats {
+		uint32_t ticks = 0;
+		uint32_t dropped = 0;   // ticks given up after falling too far behind
+		float jitterAvgUs = 0;  // how late ticks started after they were due
+		float jitterMaxUs = 0;
+	};
+
+	// ticks per second, a change restarts the schedule from now
+	void setRate(uint32_t fps);
+	uint32_t rate() const {
+		return fps;
+	}
+
+	// waits until a tick is due and takes it. if the schedule is more than MAX_LAG ticks behind
+	// the rest are dropped, so a slow cart slows down rather than running ticks back to back.
+	// when idle it sleeps until the tick or an input event instead of spinning, and the tick can
+	// start a little late. an event starts the tick early and returns true, the event is left
+	// to be processed.
+	bool wait(bool idle = false);
+	// whole ticks that are due now and have not been taken
+	uint32_t behind();
+
+	// stats since the last call
+	Stats takeStats();
+
+   private:
+	static const uint32_t MAX_LAG = 4;
+	// one tick in the accumulator's units, microseconds * fps
+	static const uint64_t TICK = 1000000;
+
+	uint32_t fps = 0;
+	uint64_t last = 0;
+	uint64_t accumulator = 0;
+
+	Stats stats;
+	uint64_t jitterTotalUs = 0;
+	uint64_t jitterMaxUs = 0;
+
+	void advance(uint64_t now);
+};
+
+#endif /* FRAME_SCHEDULER_H */
@@ -0,0 +1,84 @@
+#include "frame_timings.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <vector>
+
+#include "log.h"
+
+namespace {
+	const char* PHASE_NAMES[frame_timings::NUM_PHASES] = {
+	    "events", "update", "draw", "gc", "copy", "present", "audio", "total"};
+
+	std::array<frame_timings::Frame, frame_timings::HISTORY> ring;
+	int next = 0;
+	int filled = 0;
+
+	// sorted copies of each phase, rebuilt when a frame has been added since
+	std::array<std::vector<uint32_t>, frame_timings::NUM_PHASES> sorted;
+	bool sortedValid = false;
+}  // namespace
+
+namespace frame_timings {
+
+	void add(const Frame& f) {
+		ring[next] = f;
+		next = (next + 1) % HISTORY;
+		filled = std::min(filled + 1, HISTORY);
+		sortedValid = false;
+	}
+
+	int count() {
+		return filled;
+	}
+
+	const Frame& get(int n) {
+		return ring[(next - 1 - n + HISTORY * 2) % HISTORY];
+	}
+
+	float percentile(Phase phase, float p) {
+		if (filled == 0 || phase < 0 || phase >= NUM_PHASES) {
+			return 0;
+		}
+		if (!sortedValid) {
+			for (int n = 0; n < NUM_PHASES; n++) {
+				sorted[n].resize(filled);
+				for (int i = 0; i < filled; i++) {
+					sorted[n][i] = ring[i].us[n];
+				}
+				std::sort(sorted[n].begin(), sorted[n].end());
+			}
+			sortedValid = true;
+		}
+		// nearest rank
+		int rank = (int)std::ceil(std::max(0.0f, std::min(p, 100.0f)) / 100.0f * filled);
+		return (float)sorted[phase][std::max(rank, 1) - 1];
+	}
+
+	bool write_csv(const std::string& path) {
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file) {
+			logr << LogLevel::err << "could not write frame timings: " << path;
+			return false;
+		}
+		fprintf(file, "frame,skipped");
+		for (const char* name : PHASE_NAMES) {
+			fprintf(file, ",%s_us", name);
+		}
+		fprintf(file, "\n");
+		for (int n = filled - 1; n >= 0; n--) {
+			const Frame& f = get(n);
+			fprintf(file, "%u,%d", f.frame, f.drawSkipped ? 1 : 0);
+			for (uint32_t us : f.us) {
+				fprintf(file, ",%u", us);
+			}
+			fprintf(file, "\n");
+		}
+		fclose(file);
+		logr << "frame timings written: " << path << " " << filled << " frames";
+		return true;
+	}
+
+}  // namespace frame_timings
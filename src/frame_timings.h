@@ -0,0 +1,34 @@
+#ifndef FRAME_TIMINGS_H
+#define FRAME_TIMINGS_H
+
+#include <stdint.h>
+#include <string>
+
+// how long each phase of the last frames took, kept in a ring so spikes are not averaged away
+namespace frame_timings {
+	enum Phase { EVENTS, UPDATE, DRAW, GC, COPY, PRESENT, AUDIO, TOTAL, NUM_PHASES };
+
+	// frames kept
+	const int HISTORY = 512;
+
+	struct Frame {
+		uint32_t frame = 0;
+		bool drawSkipped = false;
+		// microseconds. present is the last frame presented and audio the last buffer mixed, as
+		// they happen on their own threads.
+		uint32_t us[NUM_PHASES] = {0};
+	};
+
+	void add(const Frame& f);
+	int count();
+	// the frame n frames ago, 0 is the last one added
+	const Frame& get(int n);
+
+	// the percentile (0 to 100) of a phase over the frames kept, 100 is the longest
+	float percentile(Phase phase, float p);
+
+	// the frames kept, oldest first. false if the file could not be written.
+	bool write_csv(const std::string& path);
+}  // namespace frame_timings
+
+#endif /* FRAME_TIMINGS_H */
@@ -0,0 +1,111 @@
+#include "hal_adpcm.h"
+
+#include <algorithm>
+
+static const int16_t STEPS[89] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,
+    25,    28,    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,
+    88,    97,    107,   118,   130,   143,   157,   173,   190,   209,   230,   253,   279,
+    307,   337,   371,   408,   449,   494,   544,   598,   658,   724,   796,   876,   963,
+    1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,  2272,  2499,  2749,  3024,  3327,
+    3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,  9493,  10442, 11487,
+    12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+static const int INDEX_STEPS[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+// applies a 4 bit code to the predictor and step index, returns the new sample
+static inline int16_t step(int code, int32_t& predictor, int& index) {
+	int s = STEPS[index];
+	int diff = s >> 3;
+	if (code & 4)
+		diff += s;
+	if (code & 2)
+		diff += s >> 1;
+	if (code & 1)
+		diff += s >> 2;
+	predictor += (code & 8) ? -diff : diff;
+	predictor = std::max(-32768, std::min(32767, predictor));
+	index = std::max(0, std::min(88, index + INDEX_STEPS[code]));
+	return (int16_t)predictor;
+}
+
+// the code that brings the predictor closest to sample
+static inline int encode_sample(int32_t sample, int32_t predictor, int index) {
+	int s = STEPS[index];
+	int diff = sample - predictor;
+	int code = 0;
+	if (diff < 0) {
+		code = 8;
+		diff = -diff;
+	}
+	if (diff >= s) {
+		code |= 4;
+		diff -= s;
+	}
+	if (diff >= s >> 1) {
+		code |= 2;
+		diff -= s >> 1;
+	}
+	if (diff >= s >> 2) {
+		code |= 1;
+	}
+	return code;
+}
+
+// decodes the sample at the decoder's position and moves on
+static inline int16_t next_sample(const uint8_t* blocks, int blockSize, uint32_t perBlock,
+                                  hal_adpcm::Decoder& d) {
+	const uint8_t* block = blocks + (d.pos / perBlock) * blockSize;
+	uint32_t k = d.pos++ % perBlock;
+	if (k == 0) {
+		d.predictor = (int16_t)(block[0] | (block[1] << 8));
+		d.index = std::min<int>(block[2], 88);
+		return (int16_t)d.predictor;
+	}
+	uint8_t b = block[4 + (k - 1) / 2];
+	return step(((k - 1) & 1) ? b >> 4 : b & 15, d.predictor, d.index);
+}
+
+namespace hal_adpcm {
+
+	std::vector<uint8_t> encode(const int16_t* samples, uint32_t count, int blockSize) {
+		uint32_t perBlock = block_samples(blockSize);
+		uint32_t blocks = (count + perBlock - 1) / perBlock;
+		std::vector<uint8_t> out(blocks * blockSize, 0);
+
+		int index = 0;
+		for (uint32_t b = 0; b < blocks; b++) {
+			const int16_t* in = samples + b * perBlock;
+			uint32_t n = std::min(perBlock, count - b * perBlock);
+			uint8_t* block = &out[b * blockSize];
+
+			int32_t predictor = in[0];
+			block[0] = (uint8_t)(predictor & 0xff);
+			block[1] = (uint8_t)((predictor >> 8) & 0xff);
+			block[2] = (uint8_t)index;
+			for (uint32_t i = 1; i < perBlock; i++) {
+				int32_t sample = i < n ? in[i] : 0;
+				int code = encode_sample(sample, predictor, index);
+				step(code, predictor, index);
+				block[4 + (i - 1) / 2] |= (uint8_t)(((i - 1) & 1) ? code << 4 : code);
+			}
+		}
+		return out;
+	}
+
+	void decode(const uint8_t* blocks, int blockSize, Decoder& d, uint32_t pos, int16_t* out,
+	            int count) {
+		uint32_t perBlock = block_samples(blockSize);
+		if (d.pos != pos) {
+			// the block header gives the state at its first sample
+			d.pos = pos - pos % perBlock;
+			while (d.pos < pos) {
+				next_sample(blocks, blockSize, perBlock, d);
+			}
+		}
+		for (int n = 0; n < count; n++) {
+			out[n] = next_sample(blocks, blockSize, perBlock, d);
+		}
+	}
+
+}  // namespace hal_adpcm
@@ -0,0 +1,32 @@
+#ifndef HAL_ADPCM_H
+#define HAL_ADPCM_H
+
+#include <stdint.h>
+#include <vector>
+
+// mono ima-adpcm in the blocks used by wav files: the first sample (16 bit le), the step index and
+// a padding byte, then 4 bit codes for the rest of the samples, low nibble first. each block can
+// be decoded on its own, so playback can start anywhere by decoding from the start of its block.
+namespace hal_adpcm {
+	const int BLOCK_SIZE = 256;
+
+	inline uint32_t block_samples(int blockSize) {
+		return (blockSize - 4) * 2 + 1;
+	}
+
+	// where a decoder is in the stream, the state is for the sample before pos
+	struct Decoder {
+		uint32_t pos = UINT32_MAX;  // not positioned
+		int32_t predictor = 0;
+		int index = 0;
+	};
+
+	// 4 bits per sample, the last block is padded with silence
+	std::vector<uint8_t> encode(const int16_t* samples, uint32_t count, int blockSize = BLOCK_SIZE);
+	// decodes count samples from pos. carries on from where the decoder is if it is at pos,
+	// otherwise decodes from the start of the block pos is in.
+	void decode(const uint8_t* blocks, int blockSize, Decoder& decoder, uint32_t pos, int16_t* out,
+	            int count);
+}  // namespace hal_adpcm
+
+#endif /* HAL_ADPCM_H */
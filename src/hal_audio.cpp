@@ -1,26 +1,52 @@
+#ifndef TAC08_HEADLESS
 #include <SDL2/SDL.h>
+#endif
 #include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_timer.h>
 
 #include <stdint.h>
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <mutex>
 #include <vector>
 
 #include "hal_audio.h"
 
 #include "config.h"
+#include "hal_adpcm.h"
+#include "hal_stream.h"
+#include "hal_wav.h"
 #include "log.h"
+#include "timeline.h"
 
-static const int NUM_CHANNELS = config::AUDIO_CHANNELS;
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define MIX_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIX_NEON
+#endif
 
+static const int NUM_CHANNELS = config::AUDIO_MIX_CHANNELS;
+
+// channel gains are Q14 fixed point, so a gain can go up to just under 2.0
+static const int GAIN_SHIFT = 14;
+// the gain of a channel at volume 1, leaves headroom for the pico-8 channels playing together
+static const float MIX_GAIN = 0.5f;
+
+// the samples of a wav being played, kept alive by the holds of the channels
 struct Wav {
-	SDL_AudioSpec spec;
-	int16_t* sampleData = 0;
+	const int16_t* sampleData = 0;
+	const uint8_t* adpcm = 0;  // decoded as it is played instead of sampleData
+	int adpcmBlockSize = 0;
 	uint32_t numSamples = 0;
 };
 
 struct Channel {
+	AudioSource* source = nullptr;  // generated samples instead of the wav
 	Wav wav;
+	hal_adpcm::Decoder decoder;
 	uint32_t current = 0;
 	bool loop = false;
 	bool playing = false;
@@ -30,125 +56,755 @@ struct Channel {
 	uint32_t loop_end = 0;
 };
 
-std::vector<Wav> loadedWavs;
-SDL_AudioDeviceID audioDevice = 0;
-std::array<Channel, NUM_CHANNELS> channels;
+struct ChannelGain {
+	int16_t left = (int16_t)(MIX_GAIN * (1 << GAIN_SHIFT));
+	int16_t right = (int16_t)(MIX_GAIN * (1 << GAIN_SHIFT));
+};
+
+// a change to a channel made by the game thread, applied by the audio thread at the sample
+// matching the time it was made.
+struct Command {
+	enum Type { PLAY, STOP, STOP_LOOP, SET_GAIN };
+	Type type = PLAY;
+	int chan = 0;
+	uint32_t seq = 0;
+	uint64_t time = 0;  // SDL_GetPerformanceCounter() when issued
+	Channel channel;
+	ChannelGain gain;
+};
+
+// single producer (the thread the channels are bound to), single consumer (the audio thread)
+class CommandQueue {
+   public:
+	static const uint32_t SIZE = 256;
+
+	bool push(const Command& cmd) {
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		if (tail - m_head.load(std::memory_order_acquire) == SIZE) {
+			return false;
+		}
+		m_commands[tail % SIZE] = cmd;
+		m_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+	// oldest command, nullptr if empty. stays valid until pop()
+	const Command* peek() const {
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		if (head == m_tail.load(std::memory_order_acquire)) {
+			return nullptr;
+		}
+		return &m_commands[head % SIZE];
+	}
+	void pop() {
+		m_head.store(m_head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+	// commands waiting, consumer side
+	uint32_t size() const {
+		return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_relaxed);
+	}
+	// calls f for each command not yet popped, producer side only
+	template <typename F>
+	void forEachPending(F f) const {
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		for (uint32_t n = m_head.load(std::memory_order_acquire); n != tail; n++) {
+			f(m_commands[n % SIZE]);
+		}
+	}
+
+   private:
+	Command m_commands[SIZE];
+	std::atomic<uint32_t> m_head{0};
+	std::atomic<uint32_t> m_tail{0};
+};
+
+// published by the audio thread after each run of samples
+struct ChannelStatus {
+	std::atomic<bool> playing{false};
+	std::atomic<AudioSource*> source{nullptr};  // source being rendered, nullptr if none
+	std::atomic<uint32_t> applied{0};  // seq of the last command applied to the channel
+};
+
+// what the game thread last asked of a channel, may not have reached the audio thread yet
+struct ChannelIssued {
+	uint32_t seq = 0;
+	bool playing = false;
+	uint32_t started = 0;  // order the channel was last started in, to find the oldest
+};
+
+// samples (or a stream) a play or stop command leaves on a channel, released once a later
+// command has been applied, so they are never freed on or under the audio thread.
+struct WavHold {
+	uint32_t seq;
+	std::shared_ptr<const void> data;
+};
+
+struct AudioChannels {
+	// audio thread
+	std::array<Channel, NUM_CHANNELS> channels;
+	// kept apart from the channels as playing a sound replaces the channel
+	std::array<ChannelGain, NUM_CHANNELS> gains;
+	AudioSequencer* sequencer = nullptr;
+
+	CommandQueue commands;
+	std::array<ChannelStatus, NUM_CHANNELS> status;
+	// the output channels and those mixed by AUDIO_RenderChannels(). changed under the device lock
+	std::atomic<bool> mixed{false};
+
+	// bound thread
+	std::array<ChannelIssued, NUM_CHANNELS> issued;
+	std::array<std::vector<WavHold>, NUM_CHANNELS> holds;
+	uint32_t nextSeq = 1;
+	uint32_t startCount = 0;
+};
+
+static SDL_AudioDeviceID audioDevice = 0;
+static thread_local AudioChannels* boundChannels = nullptr;
+static AudioChannels* outputChannels = nullptr;
+
+// set while the device is closed
+static int mixFreq = config::AUDIO_FREQ;
+static int outputChannelCount = config::AUDIO_OUTPUT_CHANNELS;
+// a gap between callbacks longer than this means the device ran dry
+static uint64_t underrunTicks = 0;
+
+// underruns in a period that make the device reopen with a larger buffer
+static const uint32_t GROW_UNDERRUNS = 3;
+// set when a larger buffer could not be opened, the buffer is not grown again
+static bool bufferFixed = false;
+
+// gathered by the audio thread, taken by AUDIO_UpdateStats()
+struct CallbackStats {
+	std::atomic<uint32_t> callbacks{0};
+	std::atomic<uint32_t> underruns{0};
+	std::atomic<uint64_t> mixTicks{0};
+	std::atomic<uint64_t> maxMixTicks{0};
+	std::atomic<uint32_t> maxQueueDepth{0};
+	std::atomic<uint64_t> lastMixTicks{0};
+};
+static CallbackStats callbackStats;
+static AudioStats stats;
 
 static void throw_error(std::string msg) {
 	msg += SDL_GetError();
 	throw(audio_exception(msg));
 }
 
-inline int16_t getNextSample(Channel& c) {
-	if (!c.playing)
-		return 0;
+inline int16_t clamp(int32_t s) {
+	if (s < INT16_MIN)
+		return INT16_MIN;
+	if (s > INT16_MAX)
+		return INT16_MAX;
+	return (int16_t)s;
+}
+
+static bool valid_chan(int chan) {
+	return chan >= 0 && chan < NUM_CHANNELS;
+}
 
-	if (c.current >= (c.loop ? c.loop_end : c.end)) {
-		if (c.loop) {
-			c.current = c.loop_start;
+static const int MIX_BLOCK = 256;
+
+// copies up to count samples of the wav to buffer, returns the number copied. less than count
+// means the wav has finished. adpcm is decoded from where the last run ended, or from the start
+// of the block after a jump back to the loop start.
+static int render_wav(Channel& c, int16_t* buffer, int count) {
+	int done = 0;
+	while (done < count) {
+		uint32_t end = c.loop ? c.loop_end : c.end;
+		if (c.current >= end) {
+			if (c.loop && c.loop_end > c.loop_start) {
+				c.current = c.loop_start;
+				continue;
+			}
+			c.playing = false;
+			break;
+		}
+		int n = (int)std::min<uint32_t>(count - done, end - c.current);
+		if (c.wav.adpcm) {
+			hal_adpcm::decode(c.wav.adpcm, c.wav.adpcmBlockSize, c.decoder, c.current, buffer + done,
+			                  n);
 		} else {
+			std::copy(c.wav.sampleData + c.current, c.wav.sampleData + c.current + n,
+			          buffer + done);
+		}
+		c.current += n;
+		done += n;
+	}
+	return done;
+}
+
+// adds count mono samples, scaled by the channel gains, to the interleaved stereo mix.
+static void mix_block(const int16_t* block, int count, ChannelGain gain, int32_t* mix) {
+	int n = 0;
+#if defined(MIX_SSE2)
+	const __m128i gains = _mm_set_epi16(gain.right, gain.left, gain.right, gain.left, gain.right,
+	                                    gain.left, gain.right, gain.left);
+	auto accumulate = [&](__m128i samples, int32_t* out) {
+		__m128i lo = _mm_mullo_epi16(samples, gains);
+		__m128i hi = _mm_mulhi_epi16(samples, gains);
+		__m128i p0 = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), GAIN_SHIFT);
+		__m128i p1 = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), GAIN_SHIFT);
+		__m128i* dst = (__m128i*)out;
+		_mm_storeu_si128(dst, _mm_add_epi32(_mm_loadu_si128(dst), p0));
+		_mm_storeu_si128(dst + 1, _mm_add_epi32(_mm_loadu_si128(dst + 1), p1));
+	};
+	for (; n + 8 <= count; n += 8) {
+		__m128i s = _mm_loadu_si128((const __m128i*)(block + n));
+		accumulate(_mm_unpacklo_epi16(s, s), mix + n * 2);
+		accumulate(_mm_unpackhi_epi16(s, s), mix + n * 2 + 8);
+	}
+#elif defined(MIX_NEON)
+	const int16_t g[4] = {gain.left, gain.right, gain.left, gain.right};
+	const int16x4_t gains = vld1_s16(g);
+	for (; n + 4 <= count; n += 4) {
+		int16x4_t s = vld1_s16(block + n);
+		int16x4x2_t lr = vzip_s16(s, s);
+		int32_t* out = mix + n * 2;
+		vst1q_s32(out, vaddq_s32(vld1q_s32(out), vshrq_n_s32(vmull_s16(lr.val[0], gains), GAIN_SHIFT)));
+		vst1q_s32(out + 4,
+		          vaddq_s32(vld1q_s32(out + 4), vshrq_n_s32(vmull_s16(lr.val[1], gains), GAIN_SHIFT)));
+	}
+#endif
+	for (; n < count; n++) {
+		mix[n * 2] += (block[n] * gain.left) >> GAIN_SHIFT;
+		mix[n * 2 + 1] += (block[n] * gain.right) >> GAIN_SHIFT;
+	}
+}
+
+// saturates the 32 bit mix to the 16 bit output. the channels are summed at full precision, so
+// the output only clips once, however many channels are playing.
+static void write_mix(const int32_t* mix, int count, int16_t* out) {
+	int n = 0;
+#if defined(MIX_SSE2)
+	for (; n + 8 <= count; n += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i*)(mix + n));
+		__m128i b = _mm_loadu_si128((const __m128i*)(mix + n + 4));
+		_mm_storeu_si128((__m128i*)(out + n), _mm_packs_epi32(a, b));
+	}
+#elif defined(MIX_NEON)
+	for (; n + 8 <= count; n += 8) {
+		int16x8_t s = vcombine_s16(vqmovn_s32(vld1q_s32(mix + n)), vqmovn_s32(vld1q_s32(mix + n + 4)));
+		vst1q_s16(out + n, s);
+	}
+#endif
+	for (; n < count; n++) {
+		out[n] = clamp(mix[n]);
+	}
+}
+
+static void mix_channel(Channel& c, const ChannelGain& gain, int chan, AudioSequencer* sequencer,
+                        int32_t* mix, int count) {
+	int16_t block[MIX_BLOCK];
+	bool background = sequencer && sequencer->render(chan, block, count);
+
+	int rendered = 0;
+	if (c.playing && c.source) {
+		rendered = c.source->render(block, count);
+		if (rendered < count) {
+			c.playing = false;
+		}
+	} else if (c.playing) {
+		rendered = render_wav(c, block, count);
+	} else if (background) {
+		rendered = count;
+	}
+	if (rendered > 0 && (gain.left || gain.right)) {
+		mix_block(block, rendered, gain, mix);
+	}
+}
+
+static void apply_command(AudioChannels* ac, const Command& cmd) {
+	Channel& c = ac->channels[cmd.chan];
+	switch (cmd.type) {
+		case Command::PLAY:
+			c = cmd.channel;
+			break;
+		case Command::STOP:
 			c.playing = false;
+			break;
+		case Command::STOP_LOOP:
+			if (c.playing && c.source) {
+				c.source->release();
+			}
+			c.loop = false;
+			break;
+		case Command::SET_GAIN:
+			ac->gains[cmd.chan] = cmd.gain;
+			break;
+	}
+	ChannelStatus& status = ac->status[cmd.chan];
+	status.playing.store(c.playing, std::memory_order_relaxed);
+	status.source.store(c.playing ? c.source : nullptr, std::memory_order_relaxed);
+	status.applied.store(cmd.seq, std::memory_order_release);
+}
+
+static void publish_status(AudioChannels* ac) {
+	for (int n = 0; n < NUM_CHANNELS; n++) {
+		const Channel& c = ac->channels[n];
+		ac->status[n].playing.store(c.playing, std::memory_order_relaxed);
+		ac->status[n].source.store(c.playing ? c.source : nullptr, std::memory_order_release);
+	}
+}
+
+static void apply_queued(AudioChannels* ac) {
+	while (const Command* cmd = ac->commands.peek()) {
+		apply_command(ac, *cmd);
+		ac->commands.pop();
+	}
+}
+
+// applies every queued command now, used when the audio thread is not draining the queue fast
+// enough. takes the device lock so the callback is not running.
+static void flush_commands(AudioChannels* ac) {
+	SDL_LockAudioDevice(audioDevice);
+	apply_queued(ac);
+	SDL_UnlockAudioDevice(audioDevice);
+}
+
+// channels that are not mixed would never finish a sound, so the channels would never be free.
+// their commands are applied as they are sent and the sounds they start are dropped.
+static void drop_unmixed(AudioChannels* ac) {
+	SDL_LockAudioDevice(audioDevice);
+	if (!ac->mixed.load(std::memory_order_relaxed)) {
+		apply_queued(ac);
+		for (auto& c : ac->channels) {
+			c.playing = false;
+		}
+		publish_status(ac);
+	}
+	SDL_UnlockAudioDevice(audioDevice);
+}
+
+// mixes samples frames of the channels to stereo, or mono if outChannels is 1. commands issued
+// up to now are applied at the sample matching when they were issued in the window from
+// windowStart to now, later ones are left queued.
+static void mix_channels(AudioChannels* ac, int16_t* stream16, int samples, int outChannels,
+                         uint64_t now, uint64_t windowStart) {
+	auto& channels = ac->channels;
+	auto& gains = ac->gains;
+	auto& commands = ac->commands;
+	AudioSequencer* sequencer = ac->sequencer;
+
+	// commands issued since the last callback are spread over this buffer as they were spread
+	// over the period between the callbacks, a buffer later. -1 for commands issued after the
+	// callback started, they are left for the next one.
+	auto offset_of = [&](const Command& cmd) -> int {
+		if (cmd.time > now) {
+			return -1;
+		}
+		if (windowStart == 0 || cmd.time <= windowStart || now == windowStart) {
 			return 0;
 		}
+		uint64_t offset = (cmd.time - windowStart) * samples / (now - windowStart);
+		return (int)std::min<uint64_t>(offset, samples - 1);
+	};
+
+	int pos = 0;
+	while (pos < samples) {
+		int next = samples;
+		while (const Command* cmd = commands.peek()) {
+			int offset = offset_of(*cmd);
+			if (offset < 0) {
+				break;
+			}
+			if (offset > pos) {
+				next = offset;
+				break;
+			}
+			apply_command(ac, *cmd);
+			commands.pop();
+		}
+
+		int count = std::min(next - pos, MIX_BLOCK);
+		if (sequencer) {
+			count = std::max(1, std::min(sequencer->step(count), count));
+		}
+		int32_t mix[MIX_BLOCK * 2] = {0};
+		for (int c = 0; c < NUM_CHANNELS; c++) {
+			mix_channel(channels[c], gains[c], c, sequencer, mix, count);
+		}
+		if (outChannels == 1) {
+			for (int n = 0; n < count; n++) {
+				mix[n] = (mix[n * 2] + mix[n * 2 + 1]) >> 1;
+			}
+		}
+		write_mix(mix, count * outChannels, stream16);
+		stream16 += count * outChannels;
+		pos += count;
 	}
-	return c.wav.sampleData[c.current++];
+	publish_status(ac);
 }
 
-inline int16_t clamp(int32_t s) {
-	if (s < INT16_MIN)
-		return INT16_MIN;
-	if (s > INT16_MAX)
-		return INT16_MAX;
-	return (int16_t)s;
+// start of the period the commands applied in this callback were issued in
+static uint64_t lastCallbackTime = 0;
+
+template <typename T>
+static void store_max(std::atomic<T>& max, T value) {
+	if (value > max.load(std::memory_order_relaxed)) {
+		max.store(value, std::memory_order_relaxed);
+	}
 }
 
 static void callback(void* userdata, uint8_t* stream, int len) {
-	int16_t* stream16 = (int16_t*)stream;
-	for (int n = 0; n < len / 2; n++) {
-		// bad mixing...
-		int32_t sum = 0;
-		for (int n = 0; n < NUM_CHANNELS; n++) {
-			sum += getNextSample(channels[n]) / 2;
+	timeline::thread_name("audio");
+	timeline::Scope scope("audio callback");
+	uint64_t now = SDL_GetPerformanceCounter();
+	uint64_t windowStart = lastCallbackTime;
+	lastCallbackTime = now;
+
+	// sdl does not report underruns, but if the device asks for a buffer more than a buffer
+	// after it last asked it has played out everything it had
+	if (windowStart != 0 && now - windowStart > underrunTicks) {
+		callbackStats.underruns.fetch_add(1, std::memory_order_relaxed);
+	}
+	callbackStats.callbacks.fetch_add(1, std::memory_order_relaxed);
+
+	if (!outputChannels) {
+		SDL_memset(stream, 0, len);
+		return;
+	}
+	store_max(callbackStats.maxQueueDepth, outputChannels->commands.size());
+	int frames = len / (outputChannelCount * sizeof(int16_t));
+	mix_channels(outputChannels, (int16_t*)stream, frames, outputChannelCount, now, windowStart);
+
+	uint64_t ticks = SDL_GetPerformanceCounter() - now;
+	callbackStats.mixTicks.fetch_add(ticks, std::memory_order_relaxed);
+	callbackStats.lastMixTicks.store(ticks, std::memory_order_relaxed);
+	store_max(callbackStats.maxMixTicks, ticks);
+}
+
+// opens the device paused with the smallest buffer from buffer up that it accepts, 0 if it refuses
+// them all
+static SDL_AudioDeviceID open_device(int freq, int channels, int buffer, int& gotSamples) {
+	SDL_AudioSpec spec, gotspec;
+	for (int samples = buffer; samples <= config::AUDIO_MAX_BUFFER_SIZE; samples *= 2) {
+		SDL_zero(spec);
+		spec.freq = freq;
+		spec.format = AUDIO_S16SYS;
+		spec.channels = channels;
+		spec.samples = samples;
+		spec.callback = callback;
+		// sdl converts to the format and rate of the hardware, but the callback may be asked for a
+		// different number of samples
+		SDL_AudioDeviceID device =
+		    SDL_OpenAudioDevice(nullptr, 0, &spec, &gotspec, SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+		if (device != 0) {
+			gotSamples = gotspec.samples;
+			return device;
 		}
-		*stream16++ = clamp(sum);
+		logr << "audio device refused buffer of " << samples << ": " << SDL_GetError();
 	}
+	return 0;
+}
+
+// makes an opened device the output and starts it playing
+static void start_device(SDL_AudioDeviceID device, int freq, int channels, int samples) {
+	audioDevice = device;
+	mixFreq = freq;
+	outputChannelCount = channels;
+	lastCallbackTime = 0;
+	stats.freq = freq;
+	stats.channels = channels;
+	stats.buffer = samples;
+	underrunTicks = 2 * SDL_GetPerformanceFrequency() * samples / freq;
+	logr << "audio device: " << freq << "hz channels: " << channels << " buffer: " << samples
+	     << " (" << samples * 1000 / freq << "ms)";
+	SDL_PauseAudioDevice(device, 0);
 }
 
-void AUDIO_Init() {
+void AUDIO_Init(int freq, int channels, int buffer) {
 	TraceFunction();
 
+	freq = freq > 0 ? freq : config::AUDIO_FREQ;
+	channels = channels == 1 ? 1 : config::AUDIO_OUTPUT_CHANNELS;
+#ifdef TAC08_HEADLESS
+	// no device, the output channels are mixed by AUDIO_Advance()
+	mixFreq = freq;
+	outputChannelCount = channels;
+	stats.freq = freq;
+	stats.channels = channels;
+	logr << "audio: no device " << freq << "hz";
+#else
 	if (SDL_InitSubSystem(SDL_INIT_AUDIO) != 0) {
 		throw_error("SDL_Init Error: ");
 	}
 
-	SDL_AudioSpec spec, gotspec;
-	SDL_zero(spec);
-	spec.freq = config::AUDIO_FREQ;
-	spec.format = AUDIO_S16LSB;
-	spec.channels = 1;
-	spec.samples = config::AUDIO_BUFFER_SIZE;
-	spec.callback = callback;
-	audioDevice = SDL_OpenAudioDevice(nullptr, 0, &spec, &gotspec, 0);
-	if (audioDevice == 0) {
+	// sdl wants a power of 2
+	int samples = 64;
+	while (samples < buffer && samples < config::AUDIO_MAX_BUFFER_SIZE) {
+		samples *= 2;
+	}
+	int gotSamples;
+	SDL_AudioDeviceID device =
+	    open_device(freq, channels, buffer > 0 ? samples : config::AUDIO_BUFFER_SIZE, gotSamples);
+	if (device == 0) {
 		throw_error("SDL_OpenAudioDevice error: ");
 	}
-	SDL_PauseAudioDevice(audioDevice, 0);
+	start_device(device, freq, channels, gotSamples);
+#endif
+}
+
+int AUDIO_Frequency() {
+	return mixFreq;
+}
+
+void AUDIO_UpdateStats() {
+	uint32_t underruns = callbackStats.underruns.load(std::memory_order_relaxed);
+	uint32_t periodUnderruns = underruns - stats.underruns;
+	stats.underruns = underruns;
+	stats.callbacks = callbackStats.callbacks.exchange(0, std::memory_order_relaxed);
+
+	double usPerTick = 1000000.0 / SDL_GetPerformanceFrequency();
+	uint64_t ticks = callbackStats.mixTicks.exchange(0, std::memory_order_relaxed);
+	stats.callbackAvgUs = stats.callbacks ? (float)(ticks * usPerTick / stats.callbacks) : 0;
+	stats.callbackMaxUs =
+	    (float)(callbackStats.maxMixTicks.exchange(0, std::memory_order_relaxed) * usPerTick);
+	stats.queueDepth = callbackStats.maxQueueDepth.exchange(0, std::memory_order_relaxed);
+
+	if (audioDevice != 0 && !bufferFixed && periodUnderruns >= GROW_UNDERRUNS &&
+	    stats.buffer < config::AUDIO_MAX_BUFFER_SIZE) {
+		logr << "audio underruns: " << periodUnderruns << " growing buffer from " << stats.buffer;
+		// the larger device is opened before the old one is closed, so sound carries on with the
+		// old buffer if it cannot be
+		int gotSamples;
+		SDL_AudioDeviceID device =
+		    open_device(stats.freq, stats.channels, stats.buffer * 2, gotSamples);
+		if (device == 0) {
+			logr << LogLevel::err << "keeping audio buffer of " << stats.buffer;
+			bufferFixed = true;
+			return;
+		}
+		SDL_PauseAudioDevice(audioDevice, 1);
+		SDL_CloseAudioDevice(audioDevice);
+		start_device(device, stats.freq, stats.channels, gotSamples);
+	}
+}
+
+const AudioStats& AUDIO_GetStats() {
+	return stats;
+}
+
+uint32_t AUDIO_GetLastMixTime_us() {
+	uint64_t ticks = callbackStats.lastMixTicks.load(std::memory_order_relaxed);
+	return (uint32_t)(ticks * 1000000 / SDL_GetPerformanceFrequency());
 }
 
 void AUDIO_Shutdown() {
 	TraceFunction();
+#ifndef TAC08_HEADLESS
 	SDL_PauseAudioDevice(audioDevice, 1);
 	SDL_CloseAudioDevice(audioDevice);
+	audioDevice = 0;
+#endif
 
-	for (auto& wav : loadedWavs) {
-		SDL_FreeWAV((uint8_t*)(wav.sampleData));
-	}
-	loadedWavs.clear();
+	hal_stream::shutdown();
+	hal_wav::shutdown();
+#ifndef TAC08_HEADLESS
 	SDL_QuitSubSystem(SDL_INIT_AUDIO);
+#endif
 }
 
-static uint32_t trim_sample(int16_t* sampleData, uint32_t numSamples) {
-	for (uint32_t n = numSamples; n > 0; n--) {
-		if (sampleData[n - 1] != 0) {
-			return n;
-		}
+void AUDIO_Advance(int frames) {
+	if (audioDevice != 0 || !outputChannels) {
+		return;
 	}
-	return 0;
+	uint64_t now = SDL_GetPerformanceCounter();
+	int16_t buffer[MIX_BLOCK * 2];
+	while (frames > 0) {
+		int count = std::min(frames, MIX_BLOCK);
+		mix_channels(outputChannels, buffer, count, outputChannelCount, UINT64_MAX, 0);
+		frames -= count;
+	}
+	uint64_t ticks = SDL_GetPerformanceCounter() - now;
+	callbackStats.callbacks.fetch_add(1, std::memory_order_relaxed);
+	callbackStats.mixTicks.fetch_add(ticks, std::memory_order_relaxed);
+	callbackStats.lastMixTicks.store(ticks, std::memory_order_relaxed);
 }
 
-int AUDIO_LoadWav(const char* name, bool trim) {
-	Wav wav;
-	SDL_zero(wav);
+void AUDIO_RenderChannels(AudioChannels* channels, int16_t* buffer, int frames) {
+	// every queued command is applied before the first sample
+	mix_channels(channels, buffer, frames, 2, UINT64_MAX, 0);
+}
+
+AudioChannels* AUDIO_CreateChannels(bool rendered) {
+	AudioChannels* channels = new AudioChannels();
+	channels->mixed = rendered;
+	return channels;
+}
 
-	if (SDL_LoadWAV(name, &wav.spec, (uint8_t**)&wav.sampleData, &wav.numSamples) == nullptr) {
-		throw_error("SDL_LoadWav error: ");
+void AUDIO_DestroyChannels(AudioChannels* channels) {
+	if (channels == outputChannels) {
+		AUDIO_SetOutputChannels(nullptr);
 	}
+	if (channels == boundChannels) {
+		boundChannels = nullptr;
+	}
+	delete channels;
+}
 
-	wav.numSamples /= 2;
+void AUDIO_BindChannels(AudioChannels* channels) {
+	boundChannels = channels;
+}
 
-	if (trim) {
-		wav.numSamples = trim_sample(wav.sampleData, wav.numSamples);
+void AUDIO_SetOutputChannels(AudioChannels* channels) {
+	SDL_LockAudioDevice(audioDevice);
+	if (outputChannels) {
+		outputChannels->mixed = false;
+	}
+	outputChannels = channels;
+	if (channels) {
+		channels->mixed = true;
 	}
+	SDL_UnlockAudioDevice(audioDevice);
+}
 
+void AUDIO_SetSequencer(AudioSequencer* sequencer) {
 	SDL_LockAudioDevice(audioDevice);
-	loadedWavs.push_back(wav);
+	boundChannels->sequencer = sequencer;
 	SDL_UnlockAudioDevice(audioDevice);
+}
 
-	int id = loadedWavs.size() - 1;
+// the samples of a wav and a view of them for the audio thread. false if the wav could not be
+// loaded or is still loading in the background, the play is skipped rather than waiting on it.
+static bool get_wav(int id, Wav& wav, WavDataPtr& data) {
+	data = hal_wav::get_loaded(id);
+	if (!data) {
+		return false;
+	}
+	wav.sampleData = data->samples.data();
+	wav.adpcm = data->adpcm.empty() ? nullptr : data->adpcm.data();
+	wav.adpcmBlockSize = data->adpcmBlockSize;
+	wav.numSamples = data->numSamples;
+	return true;
+}
 
-	logr << "loaded wav: " << name << " id: " << id << " freq: " << wav.spec.freq
-	     << " samples: " << wav.numSamples
-	     << " duration: " << (double)wav.numSamples / (double)wav.spec.freq;
+int AUDIO_LoadWav(const char* name, bool trim) {
+	int id = hal_wav::acquire(name, trim);
+	std::string error;
+	if (!hal_wav::get(id, &error)) {
+		hal_wav::release(id);
+		throw(audio_exception(error));
+	}
+	return id;
+}
 
+int AUDIO_RegisterWav(const char* name, bool trim) {
+	int id = hal_wav::acquire(name, trim);
+	hal_wav::prefetch(id);
 	return id;
 }
 
-void AUDIO_Play(int id, int chan, bool loop) {
-	if (id >= (int)loadedWavs.size())
+int AUDIO_OpenStream(const char* name) {
+	return hal_stream::open(name);
+}
+
+bool AUDIO_WavAvailable(int id) {
+	return hal_stream::is_stream(id) || hal_wav::get_loaded(id) != nullptr;
+}
+
+void AUDIO_ReleaseWav(int id) {
+	if (hal_stream::is_stream(id)) {
+		hal_stream::close(id);
+	} else {
+		hal_wav::release(id);
+	}
+}
+
+void AUDIO_SetWavCacheSize(size_t bytes) {
+	hal_wav::set_budget(bytes);
+}
+
+void AUDIO_SetWavAdpcm(bool enable) {
+	hal_wav::set_adpcm(enable);
+}
+
+// queues a command for the audio thread, the channel status seen by the bound thread changes
+// straight away.
+static void send_command(Command& cmd, std::shared_ptr<const void> data = nullptr) {
+	AudioChannels* ac = boundChannels;
+	cmd.seq = ac->nextSeq++;
+	cmd.time = SDL_GetPerformanceCounter();
+
+	ChannelIssued& issued = ac->issued[cmd.chan];
+	if (cmd.type == Command::PLAY || cmd.type == Command::STOP) {
+		issued.seq = cmd.seq;
+		issued.playing = cmd.type == Command::PLAY;
+
+		// only the hold of the last applied command and those still queued are needed
+		auto& holds = ac->holds[cmd.chan];
+		uint32_t applied = ac->status[cmd.chan].applied.load(std::memory_order_acquire);
+		size_t current = 0;
+		for (size_t n = 0; n < holds.size(); n++) {
+			if ((int32_t)(holds[n].seq - applied) <= 0) {
+				current = n;
+			}
+		}
+		holds.erase(holds.begin(), holds.begin() + current);
+		holds.push_back({cmd.seq, std::move(data)});
+	}
+	if (cmd.type == Command::PLAY) {
+		issued.started = ++ac->startCount;
+	}
+
+	if (!ac->commands.push(cmd)) {
+		flush_commands(ac);
+		ac->commands.push(cmd);
+	}
+	if (!ac->mixed.load(std::memory_order_acquire)) {
+		drop_unmixed(ac);
+	}
+}
+
+// replaces what is playing on a channel of the bound channels
+static void set_channel(int chan, const Channel& ci, std::shared_ptr<const void> data = nullptr) {
+	if (!valid_chan(chan)) {
+		return;
+	}
+	Command cmd;
+	cmd.type = Command::PLAY;
+	cmd.chan = chan;
+	cmd.channel = ci;
+	send_command(cmd, std::move(data));
+}
+
+static void channel_command(Command::Type type, int chan) {
+	if (!valid_chan(chan)) {
 		return;
+	}
+	Command cmd;
+	cmd.type = type;
+	cmd.chan = chan;
+	send_command(cmd);
+}
 
+// plays a stream on a channel, positions are samples. the channel's hold keeps the stream open
+// until it has been replaced.
+static void play_stream(int id, int chan, uint32_t start, uint32_t end, bool loop,
+                        uint32_t loop_start, uint32_t loop_end) {
+	if (!valid_chan(chan)) {
+		return;
+	}
+	std::shared_ptr<AudioSource> source =
+	    hal_stream::play(id, start, end, loop, loop_start, loop_end);
+	if (!source) {
+		return;
+	}
 	Channel ci;
-	ci.wav = loadedWavs[id];
+	ci.source = source.get();
+	ci.playing = true;
+
+	set_channel(chan, ci, source);
+}
+
+void AUDIO_Play(int id, int chan, bool loop) {
+	if (hal_stream::is_stream(id)) {
+		play_stream(id, chan, 0, UINT32_MAX, loop, 0, UINT32_MAX);
+		return;
+	}
+	Channel ci;
+	WavDataPtr data;
+	if (!get_wav(id, ci.wav, data))
+		return;
+
 	ci.loop = loop;
 	ci.playing = true;
 
@@ -158,91 +814,156 @@ void AUDIO_Play(int id, int chan, bool loop) {
 	ci.loop_end = ci.end;
 	ci.current = ci.start;
 
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
-	SDL_UnlockAudioDevice(audioDevice);
+	set_channel(chan, ci, data);
 }
 
 // convert a position in a sample (128th of a second) to a sample index
-static uint32_t pos2sample(int pos, int frequency) {
-	return (uint32_t)(pos * ((double)frequency / 128.0));
+static uint32_t pos2sample(int pos) {
+	return (uint32_t)(pos * ((double)mixFreq / 128.0));
 }
 
 void AUDIO_Play(int id, int chan, int start, int end, bool loop) {
-	if (id >= (int)loadedWavs.size())
+	if (hal_stream::is_stream(id)) {
+		uint32_t first = pos2sample(start);
+		uint32_t last = pos2sample(end);
+		play_stream(id, chan, first, last, loop, first, last);
 		return;
-
+	}
 	Channel ci;
-	ci.wav = loadedWavs[id];
+	WavDataPtr data;
+	if (!get_wav(id, ci.wav, data))
+		return;
+
 	ci.loop = loop;
 	ci.playing = true;
 
-	ci.start = std::min(pos2sample(start, ci.wav.spec.freq), ci.wav.numSamples);
-	ci.end = std::min(pos2sample(end, ci.wav.spec.freq), ci.wav.numSamples);
+	ci.start = std::min(pos2sample(start), ci.wav.numSamples);
+	ci.end = std::min(pos2sample(end), ci.wav.numSamples);
 	ci.loop_start = ci.start;
 	ci.loop_end = ci.end;
 	ci.current = ci.start;
 
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
-	SDL_UnlockAudioDevice(audioDevice);
+	set_channel(chan, ci, data);
 }
 
 void AUDIO_Play(int id, int chan, int loop_start, int loop_end) {
-	if (id >= (int)loadedWavs.size())
+	if (hal_stream::is_stream(id)) {
+		play_stream(id, chan, 0, UINT32_MAX, true, pos2sample(loop_start), pos2sample(loop_end));
 		return;
-
+	}
 	Channel ci;
-	ci.wav = loadedWavs[id];
+	WavDataPtr data;
+	if (!get_wav(id, ci.wav, data))
+		return;
+
 	ci.loop = true;
 	ci.playing = true;
 
 	ci.start = 0;
 	ci.end = ci.wav.numSamples;
-	ci.loop_start = std::min(pos2sample(loop_start, ci.wav.spec.freq), ci.end);
-	ci.loop_end = std::min(pos2sample(loop_end, ci.wav.spec.freq), ci.end);
+	ci.loop_start = std::min(pos2sample(loop_start), ci.end);
+	ci.loop_end = std::min(pos2sample(loop_end), ci.end);
 	ci.current = ci.start;
 
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan] = ci;
-	SDL_UnlockAudioDevice(audioDevice);
+	set_channel(chan, ci, data);
+}
+
+void AUDIO_PlaySource(AudioSource* source, int chan) {
+	Channel ci;
+	ci.source = source;
+	ci.playing = true;
+
+	set_channel(chan, ci);
 }
 
 void AUDIO_StopAll() {
-	for (size_t c = 0; c < channels.size(); c++) {
+	for (size_t c = 0; c < boundChannels->channels.size(); c++) {
 		AUDIO_Stop(c);
 	}
 }
 
 void AUDIO_Stop(int chan) {
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan].playing = false;
-	SDL_UnlockAudioDevice(audioDevice);
+	channel_command(Command::STOP, chan);
 }
 
 void AUDIO_StopLoop(int chan) {
-	SDL_LockAudioDevice(audioDevice);
-	channels[chan].loop = false;
-	SDL_UnlockAudioDevice(audioDevice);
+	channel_command(Command::STOP_LOOP, chan);
 }
 
 bool AUDIO_isPlaying(int chan) {
-	SDL_LockAudioDevice(audioDevice);
-	bool playing = channels[chan].playing;
-	SDL_UnlockAudioDevice(audioDevice);
-	return playing;
+	if (!valid_chan(chan)) {
+		return false;
+	}
+	const ChannelStatus& status = boundChannels->status[chan];
+	const ChannelIssued& issued = boundChannels->issued[chan];
+	// a play or stop still in the queue decides what the channel will be doing
+	if ((int32_t)(status.applied.load(std::memory_order_acquire) - issued.seq) < 0) {
+		return issued.playing;
+	}
+	return status.playing.load(std::memory_order_relaxed);
+}
+
+bool AUDIO_SourceInUse(AudioSource* source) {
+	bool queued = false;
+	// the queue is checked first, a command is published as the channel's source before it
+	// leaves the queue
+	boundChannels->commands.forEachPending([&](const Command& cmd) {
+		if (cmd.type == Command::PLAY && cmd.channel.source == source) {
+			queued = true;
+		}
+	});
+	if (queued) {
+		return true;
+	}
+	for (auto& status : boundChannels->status) {
+		if (status.source.load(std::memory_order_acquire) == source) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void AUDIO_Flush() {
+	flush_commands(boundChannels);
+}
+
+void AUDIO_SetVolume(int chan, float volume, float pan) {
+	if (!valid_chan(chan)) {
+		return;
+	}
+	volume = std::max(0.0f, volume) * MIX_GAIN;
+	pan = std::max(-1.0f, std::min(pan, 1.0f));
+	auto to_gain = [](float g) {
+		return (int16_t)std::min(g * (1 << GAIN_SHIFT), (float)INT16_MAX);
+	};
+	Command cmd;
+	cmd.type = Command::SET_GAIN;
+	cmd.chan = chan;
+	cmd.gain.left = to_gain(volume * std::min(1.0f, 1.0f - pan));
+	cmd.gain.right = to_gain(volume * std::min(1.0f, 1.0f + pan));
+	send_command(cmd);
 }
 
-int AUDIO_AvailableChan(bool force) {
-	for (int c = 0; c < (int)channels.size(); c++) {
-		if (!AUDIO_isPlaying(c)) {
+int AUDIO_AvailableChan(bool force, int reserved_mask) {
+	// only the pico-8 channels are handed out, the others are left to wavplay()
+	for (int c = 0; c < config::AUDIO_CHANNELS; c++) {
+		if (!((reserved_mask >> c) & 1) && !AUDIO_isPlaying(c)) {
 			return c;
 		}
 	}
-	// no free channels - use the oldest playing
-	if (force) {
-		return 0;  // TODO: look for oldest playing chan
-	} else {
+	if (!force) {
 		return -1;
 	}
-}
\ No newline at end of file
+	// no free channels - use the oldest playing
+	int oldest = -1;
+	for (int c = 0; c < config::AUDIO_CHANNELS; c++) {
+		if ((reserved_mask >> c) & 1) {
+			continue;
+		}
+		if (oldest < 0 ||
+		    (int32_t)(boundChannels->issued[c].started - boundChannels->issued[oldest].started) < 0) {
+			oldest = c;
+		}
+	}
+	return oldest < 0 ? 0 : oldest;
+}
@@ -1,6 +1,7 @@
 #ifndef SDL_AUDIO_H
 #define SDL_AUDIO_H
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdexcept>
 
@@ -8,17 +9,112 @@ struct audio_exception : public std::runtime_error {
 	using std::runtime_error::runtime_error;
 };
 
-void AUDIO_Init();
+// generates the samples of a channel on the audio thread. render and release are called on the
+// audio thread, render must not allocate or block.
+struct AudioSource {
+	virtual ~AudioSource() {
+	}
+	// write up to count samples to buffer and return how many were written, fewer than count
+	// means the source has finished.
+	virtual int render(int16_t* buffer, int count) = 0;
+	// leave any loop being played and play to the end
+	virtual void release() {
+	}
+};
+
+// drives the channels from the audio thread, eg a music sequencer. called with the audio device
+// locked, step and render must not allocate or block.
+struct AudioSequencer {
+	virtual ~AudioSequencer() {
+	}
+	// called before each run of samples is mixed, returns the number of samples (1 to count) to
+	// mix before it is called again.
+	virtual int step(int count) = 0;
+	// the sequencer's output for a channel for the current run, false if it is silent. called for
+	// every channel, the output is dropped while the channel is playing a sound of its own.
+	virtual bool render(int chan, int16_t* buffer, int count) = 0;
+};
+
+// opens the audio device. 0 uses the defaults in config.h for the sample rate, the number of
+// output channels (1 or 2) and the samples per callback. a buffer the device refuses is doubled
+// until it is accepted. the headless build (TAC08_HEADLESS) opens no device.
+void AUDIO_Init(int freq = 0, int channels = 0, int buffer = 0);
 void AUDIO_Shutdown();
+// mixes and drops frames of the output channels when there is no device, so sounds and music
+// keep time with a virtual clock
+void AUDIO_Advance(int frames);
+// rate sounds are generated and mixed at, fixed once the device is open
+int AUDIO_Frequency();
+
+struct AudioStats {
+	// as opened
+	int freq = 0;
+	int channels = 0;
+	int buffer = 0;  // samples per callback
+	uint32_t underruns = 0;  // since AUDIO_Init
+	// over the last period
+	uint32_t callbacks = 0;
+	float callbackAvgUs = 0;  // time taken to mix a buffer
+	float callbackMaxUs = 0;
+	int queueDepth = 0;  // most commands waiting at the start of a callback
+};
+// ends the period the stats are gathered over, called once a second. reopens the device with
+// a larger buffer if it kept underrunning in the period.
+void AUDIO_UpdateStats();
+const AudioStats& AUDIO_GetStats();
+// time taken to mix the last buffer
+uint32_t AUDIO_GetLastMixTime_us();
+
+// a set of playback channels, one per emulator instance. the AUDIO_ play/stop functions act on
+// the channels bound to the calling thread, the audio device mixes the output channels. rendered
+// channels are mixed with AUDIO_RenderChannels(). sounds played on channels that are neither are
+// dropped, so they do not keep the channels busy.
+struct AudioChannels;
+AudioChannels* AUDIO_CreateChannels(bool rendered = false);
+void AUDIO_DestroyChannels(AudioChannels* channels);
+void AUDIO_BindChannels(AudioChannels* channels);
+void AUDIO_SetOutputChannels(AudioChannels* channels);
+// mixes frames of interleaved stereo samples at AUDIO_Frequency() from channels that are not
+// the output channels, without the audio device. for rendering faster than real time.
+void AUDIO_RenderChannels(AudioChannels* channels, int16_t* buffer, int frames);
+// the sequencer of the bound channels, nullptr for none
+void AUDIO_SetSequencer(AudioSequencer* sequencer);
 
+// loads a wav now, throws an audio_exception if it cannot be loaded. wavs are cached by path and
+// contents, the id holds a reference until it is released.
 int AUDIO_LoadWav(const char* name, bool trim = true);
+// id for a wav that is loaded in the background, holds a reference. plays before it has loaded are
+// skipped.
+int AUDIO_RegisterWav(const char* name, bool trim = true);
+// id for a wav that is played as it is read from the file, for long music. starts straight away
+// and only holds a few KB while playing. played and released like a loaded wav, -1 if the file
+// is not a pcm or float wav.
+int AUDIO_OpenStream(const char* name);
+// true if the wav is loaded, never waits. a wav that is not is loaded in the background first.
+bool AUDIO_WavAvailable(int id);
+// the samples of unreferenced wavs are dropped first when the cache is over its size
+void AUDIO_ReleaseWav(int id);
+void AUDIO_SetWavCacheSize(size_t bytes);
+// hold wavs loaded from now on as 4 bit adpcm, decoded as they are played
+void AUDIO_SetWavAdpcm(bool enable);
 void AUDIO_Play(int id, int chan, bool loop);
 void AUDIO_Play(int id, int chan, int start, int end, bool loop);
 void AUDIO_Play(int id, int chan, int loop_start, int loop_end);
+// the source is owned by the caller and must not be modified while AUDIO_SourceInUse() is true
+void AUDIO_PlaySource(AudioSource* source, int chan);
+// true while the source is queued to play or playing on any of the bound channels
+bool AUDIO_SourceInUse(AudioSource* source);
+// play/stop calls are queued and applied by the audio thread at the sample matching when they
+// were made. applies the queued calls of the bound channels straight away.
+void AUDIO_Flush();
 void AUDIO_StopAll();
 void AUDIO_Stop(int chan);
 void AUDIO_StopLoop(int chan);
 bool AUDIO_isPlaying(int chan);
-int AUDIO_AvailableChan(bool force = false);
+// volume 1 is the normal level, pan is -1 (left) to 1 (right). kept while sounds are started on
+// the channel.
+void AUDIO_SetVolume(int chan, float volume, float pan = 0);
+// a channel not playing a sound, channels in reserved_mask are not used
+int AUDIO_AvailableChan(bool force = false, int reserved_mask = 0);
 
 #endif /* SDL_AUDIO_H */
@@ -5,7 +5,13 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
 #include <string>
+#include <thread>
+#include <vector>
 #ifdef __ANDROID__
 #include <jni.h>
 #endif
@@ -15,26 +21,140 @@
 #include "deque"
 #include "hal_core.h"
 #include "hal_palette.h"
+#include "hal_scale.h"
 #include "log.h"
+#include "timeline.h"
+#include "utils.h"
 
 static SDL_Window* sdlWin = nullptr;
 static SDL_Renderer* sdlRen = nullptr;
 static SDL_Texture* sdlTex = nullptr;
+// holds frames scaled up on the cpu
+static SDL_Texture* sdlOutTex = nullptr;
+static int outTexWidth = 0;
+static int outTexHeight = 0;
+// frames are scaled up to 32 bit pixels when the window has them, so the copy does not convert
+static bool outTex32 = false;
+static bool softwareRenderer = false;
 static SDL_PixelFormat* sdlPixFmt = nullptr;
 static SDL_Joystick* joystick = nullptr;
 static int screenWidth = config::INIT_SCREEN_WIDTH;
 static int screenHeight = config::INIT_SCREEN_HEIGHT;
 
-static std::array<pixel_t, 256> original_palette;
-static std::array<pixel_t, 256> palette;
+// a palette per emulator instance, the palette functions use the one bound to the calling thread
+struct GfxPalette {
+	std::array<pixel_t, 256> original;
+	std::array<pixel_t, 256> mapped;
+	std::string selected;
+};
+static thread_local GfxPalette* boundPalette = nullptr;
 
 static bool debug_trace_state = false;
+static bool debug_hud_state = false;
 static bool reload_requested = false;
-static std::string selectedPalette;
+static bool timeline_requested = false;
 
 static SDL_Point zoom_origin = SDL_Point{64, 64};
 static double zoom_factor = 1.0;
 static double zoom_rot = 0.0;
+// counts the times the window was resized or uncovered, so an unchanged screen is presented again
+static uint32_t windowChanges = 0;
+
+namespace {
+	const int OVERLAY_SIZE = 128;
+	// a frame that is ready after the wait it could have been shown in is still shown once the
+	// screen has gone this long without one, so a cart that never has time to spare is seen
+	const uint64_t STALE_PRESENT_US = 100000;
+
+	// how a frame is shown
+	struct FrameInfo {
+		int w = 0;
+		int h = 0;
+		SDL_Point zoomOrigin;
+		double zoomFactor;
+		double zoomRot;
+		std::array<float, OVERLAY_SIZE> overlay;
+		int overlayCount = 0;
+		float overlayLimit = 0;
+		uint32_t flip = 0;
+	};
+
+	// a finished frame as colour indexes, with the palette it is shown with
+	struct Frame : FrameInfo {
+		std::array<uint8_t, config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT> pixels;
+		std::array<pixel_t, 256> palette;
+	};
+
+	// a frame converted to rgb. scaled up on the cpu it is w * scale by h * scale pixels, 32 bit
+	// when rgb888 is set. otherwise scale is 0 and it is w x h rgb565 for the renderer to scale.
+	struct Image : FrameInfo {
+		int scale = 0;
+		bool rgb888 = false;
+		std::vector<uint8_t> pixels;
+	};
+
+	// hands frames from one thread to another without locking. the writer fills the back frame
+	// and swaps it with the middle one, the reader swaps its frame with the middle one when that
+	// holds a newer frame. neither waits for the other.
+	template <typename T>
+	class TripleBuffer {
+	   public:
+		T& back() {
+			return frames[backIndex];
+		}
+		void publish() {
+			backIndex = middle.exchange(backIndex | FRESH, std::memory_order_acq_rel) & INDEX;
+		}
+		bool fresh() const {
+			return (middle.load(std::memory_order_acquire) & FRESH) != 0;
+		}
+		// moves to the newest frame, false if there is none since the last take
+		bool take() {
+			if (!fresh()) {
+				return false;
+			}
+			frontIndex = middle.exchange(frontIndex, std::memory_order_acq_rel) & INDEX;
+			return true;
+		}
+		const T& front() const {
+			return frames[frontIndex];
+		}
+
+	   private:
+		static const uint8_t INDEX = 3;
+		static const uint8_t FRESH = 4;
+		std::array<T, 3> frames;
+		uint8_t backIndex = 0;
+		std::atomic<uint8_t> middle{1};
+		uint8_t frontIndex = 2;
+	};
+}  // namespace
+
+// frames flipped by the emulation thread for the conversion thread, and frames it has converted
+// for the main thread to present. sdl's renderer is only used from the main thread.
+static TripleBuffer<Frame> frameBuffer;
+static TripleBuffer<Image> imageBuffer;
+static std::thread convertThread;
+static std::atomic<bool> converting{false};
+// only for waking the threads, frames are not passed under it
+static std::mutex convertMutex;
+static std::condition_variable convertWake;
+static std::condition_variable convertedWake;
+// the newest flip converted
+static std::atomic<uint32_t> convertedFlip{0};
+// renderer output size, updated as frames are presented and read by the conversion thread
+static std::atomic<int> displayWidth{0};
+static std::atomic<int> displayHeight{0};
+static uint32_t presentTime = 0;
+// flips so far
+static uint32_t flips = 0;
+// the newest flip presented and when
+static uint32_t presentedFlip = 0;
+static uint64_t presentedAt = 0;
+// the filter chosen with GFX_SelectFilter, -1 until one is
+static std::atomic<int> selectedFilter{-1};
+// the multiple the last frame was scaled by on the cpu, 0 if the renderer scaled it
+static int cpuScale = 0;
 
 static void throw_error(std::string msg) {
 	msg += SDL_GetError();
@@ -61,6 +181,76 @@ void SYSLOG_LogMessage(LogLevel l, const char* msg) {
 	}
 }
 
+static void create_renderer() {
+	sdlRen = SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+	if (sdlRen == nullptr) {
+		logr << "no accelerated renderer: " << SDL_GetError();
+		sdlRen = SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_SOFTWARE);
+	}
+	if (sdlRen == nullptr) {
+		throw_error("SDL_CreateRenderer Error: ");
+	}
+
+	SDL_RendererInfo info;
+	if (SDL_GetRendererInfo(sdlRen, &info) == 0) {
+		softwareRenderer = (info.flags & SDL_RENDERER_SOFTWARE) != 0;
+		logr << "renderer: " << info.name;
+	}
+	outTex32 = SDL_BYTESPERPIXEL(SDL_GetWindowPixelFormat(sdlWin)) == 4;
+
+	sdlTex = SDL_CreateTexture(sdlRen, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING,
+	                           config::MAX_SCREEN_WIDTH, config::MAX_SCREEN_HEIGHT);
+	if (sdlTex == nullptr) {
+		throw_error("SDL_CreateTexture Error: ");
+	}
+
+	int w, h;
+	SDL_GetRendererOutputSize(sdlRen, &w, &h);
+	displayWidth = w;
+	displayHeight = h;
+}
+
+static void destroy_renderer() {
+	if (sdlOutTex) {
+		SDL_DestroyTexture(sdlOutTex);
+		sdlOutTex = nullptr;
+	}
+	if (sdlTex) {
+		SDL_DestroyTexture(sdlTex);
+		sdlTex = nullptr;
+	}
+	if (sdlRen) {
+		SDL_DestroyRenderer(sdlRen);
+		sdlRen = nullptr;
+	}
+}
+
+static void convert_frame(const Frame& f, Image& img);
+
+// converts each frame as it is flipped, for the main thread to present
+static void convert_loop() {
+	timeline::thread_name("convert");
+	while (converting) {
+		{
+			std::unique_lock<std::mutex> lock(convertMutex);
+			convertWake.wait(lock, [] { return frameBuffer.fresh() || !converting; });
+		}
+		if (!converting) {
+			break;
+		}
+		if (frameBuffer.take()) {
+			const Frame& f = frameBuffer.front();
+			convert_frame(f, imageBuffer.back());
+			imageBuffer.publish();
+			{
+				std::lock_guard<std::mutex> lock(convertMutex);
+				convertedFlip = f.flip;
+			}
+			convertedWake.notify_one();
+		}
+	}
+}
+
 void GFX_Init(int x, int y) {
 	TraceFunction();
 
@@ -85,10 +275,9 @@ void GFX_Init(int x, int y) {
 		throw_error("SDL_CreateWindow Error: ");
 	}
 
-	sdlRen = SDL_CreateRenderer(sdlWin, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
-	if (sdlRen == nullptr) {
-		throw_error("SDL_CreateRenderer Error: ");
-	}
+	create_renderer();
+	converting = true;
+	convertThread = std::thread(convert_loop);
 	SDL_ShowCursor(SDL_DISABLE);
 
 	int joystick_index = -1;
@@ -122,18 +311,21 @@ void GFX_Init(int x, int y) {
 
 void GFX_End() {
 	TraceFunction();
-	if (sdlRen) {
-		SDL_DestroyRenderer(sdlRen);
+	if (convertThread.joinable()) {
+		{
+			std::lock_guard<std::mutex> lock(convertMutex);
+			converting = false;
+		}
+		convertWake.notify_one();
+		convertThread.join();
 	}
+	destroy_renderer();
 	if (sdlWin) {
 		SDL_DestroyWindow(sdlWin);
 	}
 	if (sdlPixFmt) {
 		SDL_FreeFormat(sdlPixFmt);
 	}
-	if (sdlTex) {
-		SDL_DestroyTexture(sdlTex);
-	}
 	SDL_Quit();
 }
 
@@ -161,15 +353,10 @@ void GFX_CreateBackBuffer(int x, int y) {
 	TraceFunction();
 	GFX_SetBackBufferSize(x, y);
 
-	sdlTex = SDL_CreateTexture(sdlRen, SDL_PIXELFORMAT_RGB565, SDL_TEXTUREACCESS_STREAMING,
-	                           config::MAX_SCREEN_WIDTH, config::MAX_SCREEN_HEIGHT);
-	if (sdlTex == nullptr) {
-		throw_error("SDL_CreateTexture Error: ");
-	}
-
 	sdlPixFmt = SDL_AllocFormat(SDL_PIXELFORMAT_RGB565);
 
-	GFX_SelectPalette("pico8");
+	// sets up the palette bound before the pixel format was known
+	GFX_BindPalette(boundPalette);
 }
 
 void GFX_SetBackBufferSize(int x, int y) {
@@ -177,71 +364,102 @@ void GFX_SetBackBufferSize(int x, int y) {
 	screenHeight = y;
 }
 
-void GFX_SelectPalette(const std::string& name) {
+static void select_palette(GfxPalette* p, const std::string& name) {
 	auto& pal = GFX_GetPaletteInfo(name);
-	selectedPalette = name;
+	p->selected = name;
 
 	for (size_t i = 0; i < pal.size; i++) {
-		auto p = pal.pal[i];
-		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
-		original_palette[i] = pix;
-		palette[i] = pix;
+		auto c = pal.pal[i];
+		pixel_t pix = GFX_GetPixel((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+		p->original[i] = pix;
+		p->mapped[i] = pix;
 	}
 }
 
+GfxPalette* GFX_CreatePalette() {
+	GfxPalette* p = new GfxPalette();
+	p->original.fill(0);
+	p->mapped.fill(0);
+	if (sdlPixFmt) {
+		select_palette(p, "pico8");
+	}
+	return p;
+}
+
+void GFX_DestroyPalette(GfxPalette* palette) {
+	if (palette == boundPalette) {
+		boundPalette = nullptr;
+	}
+	delete palette;
+}
+
+void GFX_BindPalette(GfxPalette* palette) {
+	boundPalette = palette;
+	// created before the pixel format was known
+	if (palette && palette->selected.empty() && sdlPixFmt) {
+		select_palette(palette, "pico8");
+	}
+}
+
+void GFX_SelectPalette(const std::string& name) {
+	select_palette(boundPalette, name);
+}
+
 void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
-	palette[to] = original_palette[from];
+	boundPalette->mapped[to] = boundPalette->original[from];
 }
 
 void GFX_RestorePaletteMapping() {
-	palette = original_palette;
+	boundPalette->mapped = boundPalette->original;
 }
 
 void GFX_RestorePaletteMappingIndex(uint8_t i) {
-	palette[i] = original_palette[i];
+	boundPalette->mapped[i] = boundPalette->original[i];
 }
 
 void GFX_RestorePaletteRGB() {
-	GFX_SelectPalette(selectedPalette);
+	select_palette(boundPalette, boundPalette->selected);
 }
 
 void GFX_RestorePaletteRGBIndex(uint8_t i) {
-	auto& pal = GFX_GetPaletteInfo(selectedPalette);
+	auto& pal = GFX_GetPaletteInfo(boundPalette->selected);
 	if (i < pal.size) {
-		auto p = pal.pal[i];
-		pixel_t pix = GFX_GetPixel((p >> 16) & 0xff, (p >> 8) & 0xff, p & 0xff);
-		original_palette[i] = pix;
-		palette[i] = pix;
+		auto c = pal.pal[i];
+		pixel_t pix = GFX_GetPixel((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+		boundPalette->original[i] = pix;
+		boundPalette->mapped[i] = pix;
 	}
 }
 
 void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
-	palette[i] = GFX_GetPixel(r, g, b);
-	original_palette[i] = palette[i];
+	boundPalette->mapped[i] = GFX_GetPixel(r, g, b);
+	boundPalette->original[i] = boundPalette->mapped[i];
 }
 
+// the frame is converted to rgb on the conversion thread, only the indexes and the state needed
+// to show them are copied here
 void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h) {
-	pixel_t* pixels;
-	int pitch;
-
-	SDL_Rect r = {0, 0, buffer_w, buffer_h};
-
-	int res = SDL_LockTexture(sdlTex, &r, (void**)&pixels, &pitch);
-	if (res < 0) {
-		throw_error("SDL_LockTexture Error: ");
-	}
+	timeline::Scope scope("copy back buffer");
+	Frame& f = frameBuffer.back();
+	std::copy(buffer, buffer + buffer_w * buffer_h, f.pixels.begin());
+	f.palette = boundPalette->mapped;
+	f.w = buffer_w;
+	f.h = buffer_h;
+	f.zoomOrigin = zoom_origin;
+	f.zoomFactor = zoom_factor;
+	f.zoomRot = zoom_rot;
+	f.overlayCount = 0;
+}
 
-	for (int y = 0; y < buffer_h; y++) {
-		for (int x = 0; x < buffer_w; x++) {
-			pixels[x] = palette[buffer[x]];
-			x++;
-			pixels[x] = palette[buffer[x]];
-		}
-		pixels += pitch / sizeof(pixel_t);
-		buffer += buffer_w;
-	}
+void GFX_SetOverlay(const float* values, int count, float limit) {
+	Frame& f = frameBuffer.back();
+	f.overlayCount = std::min(count, OVERLAY_SIZE);
+	std::copy(values, values + f.overlayCount, f.overlay.begin());
+	f.overlayLimit = limit;
+}
 
-	SDL_UnlockTexture(sdlTex);
+uint32_t GFX_GetPresentTime_us() {
+	return presentTime;
 }
 
 void GFX_ShowHWMouse(bool show) {
@@ -249,7 +467,8 @@ void GFX_ShowHWMouse(bool show) {
 }
 
 void GFX_GetDisplayArea(int* w, int* h) {
-	SDL_GetRendererOutputSize(sdlRen, w, h);
+	*w = displayWidth;
+	*h = displayHeight;
 }
 
 void GFX_SetZoom(int x, int y, double factor, double rot) {
@@ -259,21 +478,28 @@ void GFX_SetZoom(int x, int y, double factor, double rot) {
 	zoom_rot = rot;
 }
 
-static SDL_Rect getDisplayArea(SDL_Window* win, double* scale = nullptr) {
+uint64_t GFX_DisplayHash() {
+	double zoom[] = {(double)zoom_origin.x, (double)zoom_origin.y, zoom_factor, zoom_rot};
+	uint64_t h = utils::hash(zoom, sizeof(zoom), windowChanges);
+	return utils::hash(boundPalette->mapped.data(), sizeof(boundPalette->mapped), h);
+}
+
+// where a screen of w x h pixels is shown in the window
+static SDL_Rect getDisplayArea(SDL_Window* win, int w, int h, double* scale = nullptr) {
 	int winx, winy;
 	SDL_GetWindowSize(win, &winx, &winy);
 
 	SDL_Rect r = {0, 0, winx, winy};
-	double xscale = (double)winx / (double)screenWidth;
-	double yscale = (double)winy / (double)screenHeight;
+	double xscale = (double)winx / (double)w;
+	double yscale = (double)winy / (double)h;
 
-	if (xscale * screenHeight > winy) {
-		r.w = (int)(yscale * screenWidth);
+	if (xscale * h > winy) {
+		r.w = (int)(yscale * w);
 		r.x = (int)(winx / 2 - r.w / 2);
 		if (scale)
 			*scale = yscale;
 	} else {
-		r.h = (int)(xscale * screenHeight);
+		r.h = (int)(xscale * h);
 		r.y = (int)(winy / 2 - r.h / 2);
 		if (scale)
 			*scale = xscale;
@@ -281,9 +507,122 @@ static SDL_Rect getDisplayArea(SDL_Window* win, double* scale = nullptr) {
 	return r;
 }
 
-void GFX_Flip() {
-	SDL_Rect dr = getDisplayArea(sdlWin);
-	SDL_Rect sr = {0, 0, screenWidth, screenHeight};
+// bars along the bottom quarter of area, scaled so the limit is half way up
+static void draw_overlay(const FrameInfo& f, const SDL_Rect& area) {
+	SDL_Rect graph = {area.x, area.y + area.h * 3 / 4, area.w, area.h / 4};
+	SDL_SetRenderDrawBlendMode(sdlRen, SDL_BLENDMODE_BLEND);
+	SDL_SetRenderDrawColor(sdlRen, 0, 0, 0, 160);
+	SDL_RenderFillRect(sdlRen, &graph);
+
+	float scale = f.overlayLimit > 0 ? graph.h / (f.overlayLimit * 2) : 0;
+	for (int n = 0; n < f.overlayCount; n++) {
+		int h = std::min(graph.h, (int)(f.overlay[n] * scale));
+		SDL_Rect bar = {graph.x + graph.w * n / OVERLAY_SIZE, graph.y + graph.h - h,
+		                std::max(1, graph.w / OVERLAY_SIZE - 1), h};
+		if (f.overlay[n] > f.overlayLimit) {
+			SDL_SetRenderDrawColor(sdlRen, 255, 0, 77, 255);
+		} else {
+			SDL_SetRenderDrawColor(sdlRen, 0, 228, 54, 255);
+		}
+		SDL_RenderFillRect(sdlRen, &bar);
+	}
+	SDL_SetRenderDrawColor(sdlRen, 255, 236, 39, 255);
+	SDL_RenderDrawLine(sdlRen, graph.x, graph.y + graph.h / 2, graph.x + graph.w,
+	                   graph.y + graph.h / 2);
+	SDL_SetRenderDrawColor(sdlRen, 0, 0, 0, 255);
+	SDL_SetRenderDrawBlendMode(sdlRen, SDL_BLENDMODE_NONE);
+}
+
+static hal_scale::Filter current_filter() {
+	int selected = selectedFilter;
+	if (selected >= 0) {
+		return (hal_scale::Filter)selected;
+	}
+	return softwareRenderer ? hal_scale::NEAREST : hal_scale::RENDERER;
+}
+
+static uint32_t rgb888(pixel_t p) {
+	uint32_t r = (p >> 11) & 0x1f;
+	uint32_t g = (p >> 5) & 0x3f;
+	uint32_t b = p & 0x1f;
+	return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+// converts the frame to rgb on the conversion thread, scaling it up by the filter in the same
+// pass when the filter scales on the cpu and the frame is not zoomed or rotated
+static void convert_frame(const Frame& f, Image& img) {
+	timeline::Scope scope("convert");
+	static_cast<FrameInfo&>(img) = f;
+	hal_scale::Filter filter = current_filter();
+	img.scale = hal_scale::fit_scale(filter, f.w, f.h, displayWidth, displayHeight);
+	if (filter == hal_scale::RENDERER || f.zoomFactor != 1.0 || f.zoomRot != 0.0) {
+		img.scale = 0;
+	}
+
+	if (img.scale > 0) {
+		int w = f.w * img.scale;
+		img.rgb888 = outTex32;
+		img.pixels.resize(w * f.h * img.scale * (img.rgb888 ? 4 : 2));
+		if (img.rgb888) {
+			std::array<uint32_t, 256> pal;
+			std::transform(f.palette.begin(), f.palette.end(), pal.begin(), rgb888);
+			hal_scale::scale(filter, f.pixels.data(), f.w, f.h, pal.data(), img.scale,
+			                 (uint32_t*)img.pixels.data(), w);
+		} else {
+			hal_scale::scale(filter, f.pixels.data(), f.w, f.h, f.palette.data(), img.scale,
+			                 (uint16_t*)img.pixels.data(), w);
+		}
+		return;
+	}
+
+	img.rgb888 = false;
+	img.pixels.resize(f.w * f.h * sizeof(pixel_t));
+	pixel_t* pixels = (pixel_t*)img.pixels.data();
+	const uint8_t* buffer = f.pixels.data();
+	for (int n = 0; n < f.w * f.h; n++) {
+		pixels[n] = f.palette[buffer[n]];
+	}
+}
+
+// copies an image scaled up on the cpu to the middle of the output without scaling it again. if
+// the output has shrunk since, the renderer scales it down to fit.
+static void present_cpu_scaled(const Image& img, int outW, int outH, SDL_Rect& area) {
+	int w = img.w * img.scale;
+	int h = img.h * img.scale;
+	if (!sdlOutTex || outTexWidth != w || outTexHeight != h) {
+		if (sdlOutTex) {
+			SDL_DestroyTexture(sdlOutTex);
+		}
+		sdlOutTex = SDL_CreateTexture(sdlRen,
+		                              outTex32 ? SDL_PIXELFORMAT_RGB888 : SDL_PIXELFORMAT_RGB565,
+		                              SDL_TEXTUREACCESS_STREAMING, w, h);
+		outTexWidth = sdlOutTex ? w : 0;
+		outTexHeight = sdlOutTex ? h : 0;
+	}
+	if (sdlOutTex == nullptr) {
+		logr << LogLevel::err << "SDL_CreateTexture Error: " << SDL_GetError();
+		return;
+	}
+	SDL_UpdateTexture(sdlOutTex, nullptr, img.pixels.data(), w * (img.rgb888 ? 4 : 2));
+
+	if (w <= outW && h <= outH) {
+		area = {(outW - w) / 2, (outH - h) / 2, w, h};
+		cpuScale = img.scale;
+	} else {
+		area = getDisplayArea(sdlWin, w, h);
+		cpuScale = 0;
+	}
+	SDL_RenderSetClipRect(sdlRen, nullptr);
+	SDL_RenderClear(sdlRen);
+	SDL_RenderCopy(sdlRen, sdlOutTex, nullptr, &area);
+}
+
+// copies an unscaled image into the texture and lets the renderer scale, zoom and rotate it
+static void present_renderer_scaled(const Image& img) {
+	SDL_Rect sr = {0, 0, img.w, img.h};
+	SDL_UpdateTexture(sdlTex, &sr, img.pixels.data(), img.w * sizeof(pixel_t));
+
+	SDL_Rect dr = getDisplayArea(sdlWin, img.w, img.h);
 
 	SDL_RenderClear(sdlRen);
 	SDL_RenderSetClipRect(sdlRen, &dr);
@@ -291,16 +630,88 @@ void GFX_Flip() {
 	double scalex = double(dr.w) / double(sr.w);
 	double scaley = double(dr.h) / double(sr.h);
 
-	dr.x = dr.x - zoom_origin.x * scalex * zoom_factor + dr.w / 2;
-	dr.y = dr.y - zoom_origin.y * scaley * zoom_factor + dr.h / 2;
-	dr.w *= zoom_factor;
-	dr.h *= zoom_factor;
+	dr.x = dr.x - img.zoomOrigin.x * scalex * img.zoomFactor + dr.w / 2;
+	dr.y = dr.y - img.zoomOrigin.y * scaley * img.zoomFactor + dr.h / 2;
+	dr.w *= img.zoomFactor;
+	dr.h *= img.zoomFactor;
+
+	SDL_Point c = {int(img.zoomOrigin.x * scalex * img.zoomFactor),
+	               int(img.zoomOrigin.y * scaley * img.zoomFactor)};
+
+	SDL_RenderCopyEx(sdlRen, sdlTex, &sr, &dr, img.zoomRot, &c, SDL_FLIP_NONE);
+	cpuScale = 0;
+}
+
+// presents a converted frame from the main thread, blocking until vsync
+static void present_image(const Image& img) {
+	timeline::Scope scope("present");
+	uint64_t start = TIME_GetTime_us();
 
-	SDL_Point c = {int(zoom_origin.x * scalex * zoom_factor),
-	               int(zoom_origin.y * scaley * zoom_factor)};
+	int w, h;
+	SDL_GetRendererOutputSize(sdlRen, &w, &h);
+	displayWidth = w;
+	displayHeight = h;
+
+	SDL_Rect area;
+	if (img.scale > 0) {
+		present_cpu_scaled(img, w, h, area);
+	} else {
+		present_renderer_scaled(img);
+		area = getDisplayArea(sdlWin, img.w, img.h);
+	}
+	if (img.overlayCount > 0) {
+		draw_overlay(img, area);
+	}
+	presentTime = (uint32_t)(TIME_GetTime_us() - start);
 
-	SDL_RenderCopyEx(sdlRen, sdlTex, &sr, &dr, zoom_rot, &c, SDL_FLIP_NONE);
 	SDL_RenderPresent(sdlRen);
+
+	presentedFlip = img.flip;
+	presentedAt = TIME_GetTime_us();
+}
+
+// presents the newest converted frame in the time the frame loop waits for t. the conversion
+// thread is only waited for until t, and a frame ready after t is left for a later wait, so
+// neither conversion nor vsync hold up a frame loop that has no time to spare.
+static void present_until(uint64_t t) {
+	uint64_t now = TIME_GetTime_us();
+	if (convertedFlip < flips && now < t) {
+		std::unique_lock<std::mutex> lock(convertMutex);
+		convertedWake.wait_for(lock, std::chrono::microseconds(t - now),
+		                       [] { return convertedFlip >= flips; });
+		now = TIME_GetTime_us();
+	}
+	bool stale = now - presentedAt >= STALE_PRESENT_US;
+	if ((now < t || stale) && imageBuffer.take() && imageBuffer.front().w > 0) {
+		present_image(imageBuffer.front());
+	}
+}
+
+bool GFX_SelectFilter(const std::string& name) {
+	hal_scale::Filter filter;
+	if (!hal_scale::find_filter(name, filter)) {
+		return false;
+	}
+	selectedFilter = filter;
+	return true;
+}
+
+// hands the frame to the conversion thread, it is presented while the frame loop next waits
+uint32_t GFX_Flip() {
+	timeline::Scope scope("flip");
+	frameBuffer.back().flip = ++flips;
+	frameBuffer.publish();
+	// taken so the wake is not lost between the thread checking for a frame and waiting
+	{
+		std::lock_guard<std::mutex> lock(convertMutex);
+	}
+	convertWake.notify_one();
+	return flips;
+}
+
+uint32_t GFX_GetPresented(uint64_t* time_us) {
+	*time_us = presentedAt;
+	return presentedFlip;
 }
 
 static uint8_t keyState = 0;
@@ -423,6 +834,11 @@ bool INP_ProcessInputEvents(const SDL_Event& ev) {
 			}
 		}
 	}
+	if (ev.type == SDL_WINDOWEVENT && (ev.window.event == SDL_WINDOWEVENT_EXPOSED ||
+	                                   ev.window.event == SDL_WINDOWEVENT_SIZE_CHANGED)) {
+		windowChanges++;
+		return true;
+	}
 	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_F11) {
 		GFX_ToggleFullScreen();
 		return true;
@@ -434,10 +850,18 @@ bool INP_ProcessInputEvents(const SDL_Event& ev) {
 		DEBUG_Trace(!DEBUG_Trace());
 		return true;
 	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_g && (ev.key.keysym.mod & KMOD_CTRL)) {
+		DEBUG_Hud(!DEBUG_Hud());
+		return true;
+	}
 	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_r && (ev.key.keysym.mod & KMOD_CTRL)) {
 		reload_requested = true;
 		return true;
 	}
+	if (ev.type == SDL_KEYDOWN && ev.key.keysym.sym == SDLK_e && (ev.key.keysym.mod & KMOD_CTRL)) {
+		timeline_requested = true;
+		return true;
+	}
 	if (ev.type == SDL_KEYDOWN || ev.type == SDL_KEYUP) {
 		set_state_bit(keyState, 0, ev.key.keysym.sym == SDLK_LEFT, ev.type == SDL_KEYDOWN);
 		set_state_bit(keyState, 1, ev.key.keysym.sym == SDLK_RIGHT, ev.type == SDL_KEYDOWN);
@@ -476,20 +900,58 @@ bool INP_ProcessInputEvents(const SDL_Event& ev) {
 	return true;
 }
 
+// the oldest input not yet taken with INP_TakeInputTimes, 0 if none
+static uint64_t inputEventTime = 0;
+static uint64_t inputPollTime = 0;
+
 bool EVT_ProcessEvents() {
+	timeline::Scope scope("events");
 	SDL_Event e;
 	while (SDL_PollEvent(&e)) {
 		if (e.type == SDL_QUIT) {
 			return false;
 		} else {
+			uint8_t state = INP_GetInputState();
 			if (!INP_ProcessInputEvents(e)) {
 				return false;
 			}
+			if (inputEventTime == 0 &&
+			    (state != INP_GetInputState() || e.type == SDL_MOUSEBUTTONDOWN ||
+			     e.type == SDL_MOUSEBUTTONUP)) {
+				// event timestamps are SDL_GetTicks() ms, moved to the us clock by their age.
+				// events pushed without one are taken as new.
+				inputPollTime = TIME_GetTime_us();
+				uint32_t stamp = e.common.timestamp;
+				uint64_t age_us = stamp ? (uint64_t)(SDL_GetTicks() - stamp) * 1000 : 0;
+				inputEventTime = inputPollTime - std::min(age_us, inputPollTime - 1);
+			}
 		}
 	}
 	return true;
 }
 
+bool INP_TakeInputTimes(uint64_t* event_us, uint64_t* poll_us) {
+	if (inputEventTime == 0) {
+		return false;
+	}
+	*event_us = inputEventTime;
+	*poll_us = inputPollTime;
+	inputEventTime = 0;
+	return true;
+}
+
+bool EVT_WaitUntil_us(uint64_t t) {
+	present_until(t);
+	timeline::Scope scope("wait for events");
+	uint64_t now = TIME_GetTime_us();
+	if (t > now) {
+		// rounded up, waking a little late rather than spinning. the event is left for
+		// EVT_ProcessEvents.
+		return SDL_WaitEventTimeout(nullptr, (int)((t - now + 999) / 1000)) == 1;
+	}
+	return false;
+}
+
 uint8_t INP_GetInputState() {
 	return keyState | joyState | hatState | simState;
 }
@@ -524,9 +986,37 @@ void TIME_Sleep(int ms) {
 	SDL_Delay(ms);
 }
 
+uint64_t TIME_GetTime_us() {
+	static const uint64_t freq = SDL_GetPerformanceFrequency();
+	uint64_t now = SDL_GetPerformanceCounter();
+	return (now / freq) * 1000000 + (now % freq) * 1000000 / freq;
+}
+
+void TIME_WaitUntil_us(uint64_t t) {
+	present_until(t);
+	// SDL_Delay can oversleep by a ms or so
+	const uint64_t SPIN_US = 2000;
+	for (uint64_t now = TIME_GetTime_us(); now < t; now = TIME_GetTime_us()) {
+		if (t - now > SPIN_US) {
+			SDL_Delay((uint32_t)((t - now - SPIN_US) / 1000) + 1);
+		}
+	}
+}
+
 static void scaleMouse(int& x, int& y) {
 	double scale;
-	SDL_Rect r = getDisplayArea(sdlWin, &scale);
+	SDL_Rect r = getDisplayArea(sdlWin, screenWidth, screenHeight, &scale);
+	int s = cpuScale;
+	if (s > 0 && displayWidth > 0) {
+		// a whole multiple of the screen in the middle of the output, which can have more pixels
+		// than the window has points
+		int winx, winy;
+		SDL_GetWindowSize(sdlWin, &winx, &winy);
+		double ratio = (double)winx / displayWidth;
+		scale = s * ratio;
+		r.x = (int)((displayWidth - screenWidth * s) / 2 * ratio);
+		r.y = (int)((displayHeight - screenHeight * s) / 2 * ratio);
+	}
 	x -= r.x;
 	y -= r.y;
 	x = (int)(x / scale);
@@ -567,6 +1057,7 @@ std::string FILE_LoadFile(std::string name) {
 }
 
 std::string FILE_LoadGameState(std::string name) {
+	timeline::Scope scope("load game state");
 	const char* path = SDL_GetPrefPath("0xcafed00d", "tac08");
 	name = std::string(path) + name;
 	SDL_free((void*)path);
@@ -575,6 +1066,7 @@ std::string FILE_LoadGameState(std::string name) {
 }
 
 void FILE_SaveGameState(std::string name, std::string data) {
+	timeline::Scope scope("save game state");
 	encrypt(data);
 
 	const char* path = SDL_GetPrefPath("0xcafed00d", "tac08");
@@ -618,6 +1110,7 @@ std::string FILE_GetDefaultCartName() {
 void HAL_StartFrame() {
 	simState = 0;
 	reload_requested = false;
+	timeline_requested = false;
 }
 
 void HAL_EndFrame() {
@@ -682,3 +1175,15 @@ void DEBUG_Trace(bool enable) {
 bool DEBUG_ReloadRequested() {
 	return reload_requested;
 }
+
+bool DEBUG_TimelineRequested() {
+	return timeline_requested;
+}
+
+bool DEBUG_Hud() {
+	return debug_hud_state;
+}
+
+void DEBUG_Hud(bool enable) {
+	debug_hud_state = enable;
+}
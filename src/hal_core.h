@@ -22,7 +22,25 @@ void GFX_CreateBackBuffer(int x, int y);
 void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h);
 void GFX_SetBackBufferSize(int x, int y);
 
-void GFX_Flip();
+// shows the frame copied since the last flip, returns the flip's number counting from 1. it is
+// converted on another thread and presented by a later TIME_WaitUntil_us or EVT_WaitUntil_us with
+// time to spare.
+uint32_t GFX_Flip();
+// the newest flip presented so far, 0 if none, and when it was shown on the TIME_GetTime_us()
+// clock. a flip replaced by a newer one before it was presented is never shown.
+uint32_t GFX_GetPresented(uint64_t* time_us);
+// a bar graph of count values drawn over the frame being built, bars over limit are red. call
+// after GFX_CopyBackBuffer.
+void GFX_SetOverlay(const float* values, int count, float limit);
+// how long the last frame presented took to convert and draw, not counting the wait for vsync
+uint32_t GFX_GetPresentTime_us();
+
+// the palette frames are shown with, one per emulator instance. the palette functions below and
+// GFX_CopyBackBuffer use the palette bound to the calling thread. a palette starts as pico8.
+struct GfxPalette;
+GfxPalette* GFX_CreatePalette();
+void GFX_DestroyPalette(GfxPalette* palette);
+void GFX_BindPalette(GfxPalette* palette);
 
 void GFX_SelectPalette(const std::string& name);
 
@@ -39,6 +57,13 @@ void GFX_GetDisplayArea(int* w, int* h);
 void GFX_ToggleFullScreen();
 void GFX_SetFullScreen(bool fullscreen);
 void GFX_SetZoom(int x, int y, double factor, double rot);
+// how the screen is scaled to the window: "renderer", "nearest", "scanlines" or "epx". the
+// others scale on the cpu, by whole multiples, when the screen is not zoomed or rotated. false
+// for an unknown name. the default is nearest with a software renderer, otherwise renderer.
+bool GFX_SelectFilter(const std::string& name);
+// a hash of how the back buffer is shown (the palette and zoom) and of the window changes that
+// need it presenting again, for telling whether a frame looks the same as the last
+uint64_t GFX_DisplayHash();
 
 std::string FILE_LoadFile(std::string name);
 std::string FILE_LoadGameState(std::string name);
@@ -48,8 +73,16 @@ void FILE_WriteClip(const std::string& data);
 std::string FILE_GetDefaultCartName();
 
 bool EVT_ProcessEvents();
+// presents the newest flipped frame if it is ready before t, then sleeps until t on the
+// TIME_GetTime_us() clock or until an event arrives, whichever is first. it can wake a ms late, it
+// does not spin. true if an event arrived, it is left for EVT_ProcessEvents.
+bool EVT_WaitUntil_us(uint64_t t);
 uint8_t INP_GetInputState();
 void INP_SetSimState(uint8_t state);
+// when the oldest input event since the last call happened and when EVT_ProcessEvents took it off
+// the queue, on the TIME_GetTime_us() clock. input is an event that changes a button or the mouse
+// buttons. false if there has been none.
+bool INP_TakeInputTimes(uint64_t* event_us, uint64_t* poll_us);
 
 uint32_t TIME_GetTime_ms();
 uint32_t TIME_GetElapsedTime_ms(uint32_t start);
@@ -58,6 +91,12 @@ uint64_t TIME_GetProfileTime();
 uint64_t TIME_GetElapsedProfileTime_us(uint64_t start);
 uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start);
 void TIME_Sleep(int ms);
+// a monotonic high resolution clock, the virtual clock when headless
+uint64_t TIME_GetTime_us();
+// presents the newest flipped frame if it is ready before t, then returns at t on the
+// TIME_GetTime_us() clock, sleeping while it is far off and spinning for the last of it. a t that
+// has passed returns straight away.
+void TIME_WaitUntil_us(uint64_t t);
 
 void SYSLOG_LogMessage(LogLevel l, const char* msg);
 
@@ -92,5 +131,10 @@ void PLATFORM_OpenURL(std::string url);
 bool DEBUG_Trace();
 void DEBUG_Trace(bool enable);
 bool DEBUG_ReloadRequested();
+// a timeline of the next frames, requested with ctrl-e
+bool DEBUG_TimelineRequested();
+// the frame time graph, toggled with ctrl-g
+bool DEBUG_Hud();
+void DEBUG_Hud(bool enable);
 
 #endif /* GFX_CORE_H */
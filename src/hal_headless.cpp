@@ -0,0 +1,410 @@
+// the hal without a display, built instead of hal_core.cpp when TAC08_HEADLESS is defined. the
+// back buffer is kept in memory, there is no input and time is a virtual clock that jumps to
+// whenever the frame loop waits for, so carts run as fast as they can be emulated.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <array>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "config.h"
+#include "crypt.h"
+#include "hal_audio.h"
+#include "hal_core.h"
+#include "hal_palette.h"
+#include "hal_scale.h"
+#include "log.h"
+#include "timeline.h"
+#include "utils.h"
+
+static std::vector<pixel_t> backBuffer;
+static int screenWidth = config::INIT_SCREEN_WIDTH;
+static int screenHeight = config::INIT_SCREEN_HEIGHT;
+
+// a palette per emulator instance, the palette functions use the one bound to the calling thread
+struct GfxPalette {
+	std::array<pixel_t, 256> original;
+	std::array<pixel_t, 256> mapped;
+	std::string selected;
+};
+static thread_local GfxPalette* boundPalette = nullptr;
+
+static bool debug_trace_state = false;
+static std::string clipboard;
+
+static uint8_t simState = 0;
+
+// virtual time since GFX_Init
+static uint64_t clock_us = 0;
+
+void SYSLOG_LogMessage(LogLevel l, const char* msg) {
+	switch (l) {
+		case LogLevel::info:
+			fprintf(stdout, "DEBUG: %s\n", msg);
+			break;
+		case LogLevel::perf:
+			fprintf(stdout, " PERF: %s\n", msg);
+			break;
+		case LogLevel::err:
+			fprintf(stderr, " FAIL: %s\n", msg);
+			break;
+		case LogLevel::trace:
+			fprintf(stdout, "TRACE: %s\n", msg);
+			break;
+		case LogLevel::apitrace:
+			fprintf(stdout, "  API: %s\n", msg);
+			break;
+	}
+}
+
+void GFX_Init(int x, int y) {
+	TraceFunction();
+	debug_trace_state = false;
+	clock_us = 0;
+	logr << "headless: no window";
+}
+
+void GFX_End() {
+	TraceFunction();
+	backBuffer.clear();
+}
+
+void checkmem() {
+}
+
+void GFX_ToggleFullScreen() {
+}
+
+void GFX_SetFullScreen(bool fullscreen) {
+}
+
+// rgb565, as the sdl texture
+static pixel_t get_pixel(uint8_t r, uint8_t g, uint8_t b) {
+	return (pixel_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+void GFX_CreateBackBuffer(int x, int y) {
+	TraceFunction();
+	GFX_SetBackBufferSize(x, y);
+	backBuffer.assign(config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT, 0);
+}
+
+void GFX_SetBackBufferSize(int x, int y) {
+	screenWidth = x;
+	screenHeight = y;
+}
+
+static void select_palette(GfxPalette* p, const std::string& name) {
+	auto& pal = GFX_GetPaletteInfo(name);
+	p->selected = name;
+
+	for (size_t i = 0; i < pal.size; i++) {
+		auto c = pal.pal[i];
+		pixel_t pix = get_pixel((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+		p->original[i] = pix;
+		p->mapped[i] = pix;
+	}
+}
+
+GfxPalette* GFX_CreatePalette() {
+	GfxPalette* p = new GfxPalette();
+	p->original.fill(0);
+	p->mapped.fill(0);
+	select_palette(p, "pico8");
+	return p;
+}
+
+void GFX_DestroyPalette(GfxPalette* palette) {
+	if (palette == boundPalette) {
+		boundPalette = nullptr;
+	}
+	delete palette;
+}
+
+void GFX_BindPalette(GfxPalette* palette) {
+	boundPalette = palette;
+}
+
+void GFX_SelectPalette(const std::string& name) {
+	select_palette(boundPalette, name);
+}
+
+void GFX_MapPaletteIndex(uint8_t to, uint8_t from) {
+	boundPalette->mapped[to] = boundPalette->original[from];
+}
+
+void GFX_RestorePaletteMapping() {
+	boundPalette->mapped = boundPalette->original;
+}
+
+void GFX_RestorePaletteMappingIndex(uint8_t i) {
+	boundPalette->mapped[i] = boundPalette->original[i];
+}
+
+void GFX_RestorePaletteRGB() {
+	select_palette(boundPalette, boundPalette->selected);
+}
+
+void GFX_RestorePaletteRGBIndex(uint8_t i) {
+	auto& pal = GFX_GetPaletteInfo(boundPalette->selected);
+	if (i < pal.size) {
+		auto c = pal.pal[i];
+		pixel_t pix = get_pixel((c >> 16) & 0xff, (c >> 8) & 0xff, c & 0xff);
+		boundPalette->original[i] = pix;
+		boundPalette->mapped[i] = pix;
+	}
+}
+
+void GFX_SetPaletteRGBIndex(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
+	boundPalette->mapped[i] = get_pixel(r, g, b);
+	boundPalette->original[i] = boundPalette->mapped[i];
+}
+
+void GFX_CopyBackBuffer(uint8_t* buffer, int buffer_w, int buffer_h) {
+	pixel_t* pixels = backBuffer.data();
+	for (int y = 0; y < buffer_h; y++) {
+		for (int x = 0; x < buffer_w; x++) {
+			pixels[x] = boundPalette->mapped[buffer[x]];
+		}
+		pixels += config::MAX_SCREEN_WIDTH;
+		buffer += buffer_w;
+	}
+}
+
+void GFX_ShowHWMouse(bool show) {
+}
+
+void GFX_GetDisplayArea(int* w, int* h) {
+	*w = screenWidth;
+	*h = screenHeight;
+}
+
+void GFX_SetZoom(int x, int y, double factor, double rot) {
+}
+
+static uint32_t flips = 0;
+
+// nothing waits for a display, a frame is shown as it is flipped
+uint32_t GFX_Flip() {
+	return ++flips;
+}
+
+uint32_t GFX_GetPresented(uint64_t* time_us) {
+	*time_us = clock_us;
+	return flips;
+}
+
+bool GFX_SelectFilter(const std::string& name) {
+	hal_scale::Filter filter;
+	return hal_scale::find_filter(name, filter);
+}
+
+uint64_t GFX_DisplayHash() {
+	return utils::hash(boundPalette->mapped.data(), sizeof(boundPalette->mapped));
+}
+
+void GFX_SetOverlay(const float* values, int count, float limit) {
+}
+
+uint32_t GFX_GetPresentTime_us() {
+	return 0;
+}
+
+bool INP_TouchAvailable() {
+	return false;
+}
+
+uint8_t INP_GetTouchMask() {
+	return 0;
+}
+
+TouchInfo INP_GetTouchInfo(int idx) {
+	return TouchInfo{};
+}
+
+std::string INP_GetKeyPress() {
+	return "";
+}
+
+bool EVT_ProcessEvents() {
+	return true;
+}
+
+// there are no events, so the frame loop still runs at full speed when idle
+bool EVT_WaitUntil_us(uint64_t t) {
+	TIME_WaitUntil_us(t);
+	return false;
+}
+
+uint8_t INP_GetInputState() {
+	return simState;
+}
+
+void INP_SetSimState(uint8_t state) {
+	simState = state;
+}
+
+bool INP_TakeInputTimes(uint64_t* event_us, uint64_t* poll_us) {
+	return false;
+}
+
+uint32_t TIME_GetTime_ms() {
+	return (uint32_t)(clock_us / 1000);
+}
+
+uint32_t TIME_GetElapsedTime_ms(uint32_t start) {
+	return TIME_GetTime_ms() - start;
+}
+
+// profile times are real, they measure the emulator
+uint64_t TIME_GetProfileTime() {
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t TIME_GetElapsedProfileTime_us(uint64_t start) {
+	return (TIME_GetProfileTime() - start) / 1000;
+}
+
+uint64_t TIME_GetElapsedProfileTime_ms(uint64_t start) {
+	return (TIME_GetProfileTime() - start) / 1000000;
+}
+
+void TIME_Sleep(int ms) {
+	TIME_WaitUntil_us(clock_us + ms * 1000);
+}
+
+uint64_t TIME_GetTime_us() {
+	return clock_us;
+}
+
+void TIME_WaitUntil_us(uint64_t t) {
+	if (t <= clock_us) {
+		return;
+	}
+	// the audio for the time passed, without rounding drift
+	uint64_t freq = AUDIO_Frequency();
+	uint64_t start = clock_us * freq / 1000000;
+	clock_us = t;
+	AUDIO_Advance((int)(clock_us * freq / 1000000 - start));
+}
+
+MouseState INP_GetMouseState() {
+	return MouseState{0, 0, 0, 0};
+}
+
+std::string FILE_LoadFile(std::string name) {
+	logr << "loading file: " << name;
+	std::string data;
+	std::ifstream file(name, std::ios::binary);
+	if (file) {
+		std::stringstream ss;
+		ss << file.rdbuf();
+		data = ss.str();
+		logr << "  " << data.size() << " bytes loaded";
+	}
+	decrypt(data);
+	return data;
+}
+
+// game state is kept in the working directory
+std::string FILE_LoadGameState(std::string name) {
+	timeline::Scope scope("load game state");
+	return FILE_LoadFile(name);
+}
+
+void FILE_SaveGameState(std::string name, std::string data) {
+	timeline::Scope scope("save game state");
+	encrypt(data);
+
+	logr << "writing file: " << name << " bytes: " << data.length();
+
+	std::ofstream file(name, std::ios::binary);
+	if (file) {
+		file.write(data.c_str(), data.length());
+		logr << "    file writen ";
+	}
+}
+
+std::string FILE_ReadClip() {
+	return clipboard;
+}
+
+void FILE_WriteClip(const std::string& data) {
+	clipboard = data;
+}
+
+std::string FILE_GetDefaultCartName() {
+	const char* val = getenv("TAC08_DEFAULT_CART_NAME");
+	if (val == nullptr) {
+		return "cart.p8";
+	}
+	return val;
+}
+
+void HAL_StartFrame() {
+	simState = 0;
+}
+
+void HAL_EndFrame() {
+}
+
+static uint32_t target_fps = 30;
+static uint32_t actual_fps = 30;
+static uint32_t sys_fps = 60;
+static uint32_t cpu_usage = 0;
+
+void HAL_SetFrameRates(uint32_t target, uint32_t actual, uint32_t sys, uint32_t cpu) {
+	target_fps = target;
+	actual_fps = actual;
+	sys_fps = sys;
+	cpu_usage = cpu;
+}
+
+// 't' = target, 'a' = actual, 's' = sys
+uint32_t HAL_GetFrameRate(char fps_type) {
+	switch (fps_type) {
+		case 't':
+			return target_fps;
+		case 'a':
+			return actual_fps;
+		case 's':
+			return sys_fps;
+		case 'c':
+			return cpu_usage;
+	}
+	return 0;
+}
+
+void PLATFORM_OpenURL(std::string url) {
+	logr << "headless: not opening " << url;
+}
+
+bool DEBUG_Trace() {
+	return debug_trace_state;
+}
+
+void DEBUG_Trace(bool enable) {
+	debug_trace_state = enable;
+	logr.setOutputFilter(LogLevel::apitrace, enable);
+}
+
+bool DEBUG_ReloadRequested() {
+	return false;
+}
+
+bool DEBUG_TimelineRequested() {
+	return false;
+}
+
+bool DEBUG_Hud() {
+	return false;
+}
+
+void DEBUG_Hud(bool enable) {
+}
@@ -0,0 +1,226 @@
+#include "hal_scale.h"
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCALE_SSE2
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define SCALE_NEON
+#endif
+
+// widest row of indexes scaled, a 512 pixel screen after the 4x of epx
+static const int MAX_ROW = 2048;
+
+// epx output, reused from frame to frame
+static std::vector<uint8_t> epxBuffer;
+static std::vector<uint8_t> epxBuffer2;
+
+#if defined(SCALE_SSE2)
+// each lane of lane bytes twice, the first half of v in lo and the second in hi
+static inline void double_lanes(__m128i v, int lane, __m128i& lo, __m128i& hi) {
+	switch (lane) {
+		case 2:
+			lo = _mm_unpacklo_epi16(v, v);
+			hi = _mm_unpackhi_epi16(v, v);
+			break;
+		case 4:
+			lo = _mm_unpacklo_epi32(v, v);
+			hi = _mm_unpackhi_epi32(v, v);
+			break;
+		case 8:
+			lo = _mm_unpacklo_epi64(v, v);
+			hi = _mm_unpackhi_epi64(v, v);
+			break;
+		default:
+			lo = v;
+			hi = v;
+			break;
+	}
+}
+#elif defined(SCALE_NEON)
+static inline void double_lanes(uint8x16_t v, int lane, uint8x16_t& lo, uint8x16_t& hi) {
+	switch (lane) {
+		case 2: {
+			uint16x8x2_t z = vzipq_u16(vreinterpretq_u16_u8(v), vreinterpretq_u16_u8(v));
+			lo = vreinterpretq_u8_u16(z.val[0]);
+			hi = vreinterpretq_u8_u16(z.val[1]);
+			break;
+		}
+		case 4: {
+			uint32x4x2_t z = vzipq_u32(vreinterpretq_u32_u8(v), vreinterpretq_u32_u8(v));
+			lo = vreinterpretq_u8_u32(z.val[0]);
+			hi = vreinterpretq_u8_u32(z.val[1]);
+			break;
+		}
+		case 8:
+			lo = vcombine_u8(vget_low_u8(v), vget_low_u8(v));
+			hi = vcombine_u8(vget_high_u8(v), vget_high_u8(v));
+			break;
+		default:
+			lo = v;
+			hi = v;
+			break;
+	}
+}
+#endif
+
+// writes each pixel of in s times. powers of 2 up to 16 are doubled a vector at a time.
+template <typename T>
+static void expand_row(const T* in, int count, int s, T* out) {
+	int n = 0;
+#if defined(SCALE_SSE2) || defined(SCALE_NEON)
+	if (s >= 2 && s <= 16 && (s & (s - 1)) == 0) {
+		const int per = 16 / sizeof(T);
+		for (; n + per <= count; n += per) {
+#if defined(SCALE_SSE2)
+			__m128i v[16];
+			v[0] = _mm_loadu_si128((const __m128i*)(in + n));
+#else
+			uint8x16_t v[16];
+			v[0] = vld1q_u8((const uint8_t*)(in + n));
+#endif
+			int k = 1;
+			for (int lane = sizeof(T); k < s; lane *= 2, k *= 2) {
+				for (int i = k - 1; i >= 0; i--) {
+					double_lanes(v[i], lane, v[i * 2], v[i * 2 + 1]);
+				}
+			}
+			T* o = out + n * s;
+			for (int i = 0; i < k; i++) {
+#if defined(SCALE_SSE2)
+				_mm_storeu_si128((__m128i*)(o + i * per), v[i]);
+#else
+				vst1q_u8((uint8_t*)(o + i * per), v[i]);
+#endif
+			}
+		}
+	}
+#endif
+	for (; n < count; n++) {
+		std::fill(out + n * s, out + n * s + s, in[n]);
+	}
+}
+
+// half brightness
+static inline uint16_t darken(uint16_t p) {
+	return (p >> 1) & 0x7bef;
+}
+
+static inline uint32_t darken(uint32_t p) {
+	return (p >> 1) & 0x7f7f7f;
+}
+
+template <typename T>
+static void scale_nearest(const uint8_t* src, int w, int h, const T* palette, int s,
+                          bool scanlines, T* dst, int pitch) {
+	T rgb[MAX_ROW];
+	int rowWidth = w * s;
+	for (int y = 0; y < h; y++) {
+		for (int x = 0; x < w; x++) {
+			rgb[x] = palette[src[x]];
+		}
+		T* row = dst + y * s * pitch;
+		expand_row(rgb, w, s, row);
+		for (int r = 1; r < s; r++) {
+			memcpy(row + r * pitch, row, rowWidth * sizeof(T));
+		}
+		if (scanlines && s >= 2) {
+			T* last = row + (s - 1) * pitch;
+			for (int x = 0; x < rowWidth; x++) {
+				last[x] = darken(last[x]);
+			}
+		}
+		src += w;
+	}
+}
+
+// scale2x: a pixel's corner takes the colour of the two neighbours it touches when they match and
+// the edge they make is not part of a line
+static void epx(const uint8_t* src, int w, int h, uint8_t* out) {
+	for (int y = 0; y < h; y++) {
+		const uint8_t* row = src + y * w;
+		const uint8_t* up = src + std::max(y - 1, 0) * w;
+		const uint8_t* down = src + std::min(y + 1, h - 1) * w;
+		uint8_t* o0 = out + y * 2 * w * 2;
+		uint8_t* o1 = o0 + w * 2;
+		for (int x = 0; x < w; x++) {
+			uint8_t p = row[x];
+			uint8_t a = up[x];
+			uint8_t b = row[std::min(x + 1, w - 1)];
+			uint8_t c = row[std::max(x - 1, 0)];
+			uint8_t d = down[x];
+			if (a != d && c != b) {
+				o0[x * 2] = c == a ? a : p;
+				o0[x * 2 + 1] = a == b ? b : p;
+				o1[x * 2] = d == c ? c : p;
+				o1[x * 2 + 1] = b == d ? d : p;
+			} else {
+				o0[x * 2] = o0[x * 2 + 1] = o1[x * 2] = o1[x * 2 + 1] = p;
+			}
+		}
+	}
+}
+
+template <typename T>
+static void scale_filter(hal_scale::Filter filter, const uint8_t* src, int w, int h,
+                         const T* palette, int s, T* dst, int pitch) {
+	if (filter == hal_scale::EPX && s >= 2) {
+		epxBuffer.resize(w * h * 4);
+		epx(src, w, h, epxBuffer.data());
+		if (s % 4 == 0 && w * 4 <= MAX_ROW) {
+			// twice for the larger scales, smoother than scaling up the 2x
+			epxBuffer2.resize(w * h * 16);
+			epx(epxBuffer.data(), w * 2, h * 2, epxBuffer2.data());
+			scale_nearest(epxBuffer2.data(), w * 4, h * 4, palette, s / 4, false, dst, pitch);
+		} else {
+			scale_nearest(epxBuffer.data(), w * 2, h * 2, palette, s / 2, false, dst, pitch);
+		}
+		return;
+	}
+	scale_nearest(src, w, h, palette, s, filter == hal_scale::SCANLINES, dst, pitch);
+}
+
+namespace hal_scale {
+
+	bool find_filter(const std::string& name, Filter& filter) {
+		static const struct {
+			const char* name;
+			Filter filter;
+		} FILTERS[] = {
+		    {"renderer", RENDERER}, {"nearest", NEAREST}, {"scanlines", SCANLINES}, {"epx", EPX}};
+		for (auto& f : FILTERS) {
+			if (name == f.name) {
+				filter = f.filter;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	int fit_scale(Filter filter, int w, int h, int out_w, int out_h) {
+		if (w <= 0 || h <= 0 || w > MAX_ROW) {
+			return 0;
+		}
+		int s = std::min(out_w / w, out_h / h);
+		if (filter == EPX && s > 2) {
+			// epx doubles, odd scales lose a step
+			s -= s % 2;
+		}
+		return std::max(s, 0);
+	}
+
+	void scale(Filter filter, const uint8_t* src, int w, int h, const uint16_t* palette,
+	           int scale, uint16_t* dst, int pitch) {
+		scale_filter(filter, src, w, h, palette, scale, dst, pitch);
+	}
+
+	void scale(Filter filter, const uint8_t* src, int w, int h, const uint32_t* palette,
+	           int scale, uint32_t* dst, int pitch) {
+		scale_filter(filter, src, w, h, palette, scale, dst, pitch);
+	}
+
+}  // namespace hal_scale
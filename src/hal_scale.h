@@ -0,0 +1,32 @@
+#ifndef HAL_SCALE_H
+#define HAL_SCALE_H
+
+#include <stdint.h>
+#include <string>
+
+// scales a screen of colour indexes up by a whole number on the cpu, converting it to rgb on the
+// way, for renderers that would otherwise scale it in software much more slowly.
+namespace hal_scale {
+	enum Filter {
+		RENDERER,   // not scaled here, the renderer scales the screen
+		NEAREST,    // each pixel becomes a square
+		SCANLINES,  // as nearest, with the last row of each pixel darkened
+		EPX,        // scale2x edge smoothing, then nearest
+	};
+
+	// false if there is no filter called name
+	bool find_filter(const std::string& name, Filter& filter);
+
+	// the largest multiple a w x h screen can be scaled up by to fit in out_w x out_h, 0 if it
+	// does not fit
+	int fit_scale(Filter filter, int w, int h, int out_w, int out_h);
+
+	// converts a w x h screen through the palette into dst, scaled up by a scale from fit_scale.
+	// pitch is in pixels. only one thread at a time can scale with EPX.
+	void scale(Filter filter, const uint8_t* src, int w, int h, const uint16_t* palette,
+	           int scale, uint16_t* dst, int pitch);
+	void scale(Filter filter, const uint8_t* src, int w, int h, const uint32_t* palette,
+	           int scale, uint32_t* dst, int pitch);
+}  // namespace hal_scale
+
+#endif /* HAL_SCALE_H */
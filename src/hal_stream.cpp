@@ -0,0 +1,394 @@
+#include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_rwops.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "hal_stream.h"
+
+#include "config.h"
+#include "log.h"
+
+namespace {
+	// frames read from the file at a time
+	const uint32_t READ_FRAMES = 1024;
+	// how often the reader tops up the rings, well inside the time a ring lasts
+	const int READ_INTERVAL_MS = 10;
+	// samples read by play() so a stream starts straight away, the reader reads the rest
+	const uint32_t PREFILL_SAMPLES = 2048;
+
+	// where the samples are in a wav file and what they are
+	struct Format {
+		SDL_AudioFormat format = 0;
+		int channels = 0;
+		int freq = 0;
+		int frameBytes = 0;
+		uint32_t dataOffset = 0;
+		uint32_t frames = 0;
+	};
+
+	// one playback of a stream. the reader thread reads and converts the file into the ring, the
+	// audio thread renders from it.
+	class Stream : public AudioSource {
+	   public:
+		Stream(const std::string& path, const Format& format, uint32_t start, uint32_t end,
+		       bool loop, uint32_t loopStart, uint32_t loopEnd);
+		~Stream();
+
+		bool ok() const {
+			return m_file && m_convert;
+		}
+		bool finished() const {
+			return m_finished.load(std::memory_order_acquire);
+		}
+		int render(int16_t* buffer, int count) override;
+		void release() override {
+			m_loop.store(false, std::memory_order_relaxed);
+		}
+		// reads ahead until the ring is full, limit samples have been added or the stream has
+		// been read to its end
+		void fill(uint32_t limit = UINT32_MAX);
+
+	   private:
+		uint32_t to_frame(uint32_t sample) const;
+		void seek(uint32_t frame);
+
+		const Format m_format;
+		SDL_RWops* m_file = nullptr;
+		SDL_AudioStream* m_convert = nullptr;
+		std::vector<uint8_t> m_read;
+
+		// reader thread
+		uint32_t m_frame = 0;  // next frame to read
+		uint32_t m_end;
+		uint32_t m_loopStart;
+		uint32_t m_loopEnd;
+		bool m_flushed = false;
+
+		std::atomic<bool> m_loop;
+		std::atomic<bool> m_finished{false};  // everything read is in the ring
+
+		std::vector<int16_t> m_ring;
+		std::atomic<uint32_t> m_head{0};
+		std::atomic<uint32_t> m_tail{0};
+	};
+
+	// a free entry has no path, it is reused by the next wav opened
+	struct Entry {
+		std::string path;
+		Format format;
+		int refs = 0;
+	};
+
+	std::mutex streamMutex;
+	std::vector<Entry> entries;  // indexed by id - ID_BASE
+	std::map<std::string, int> pathIds;
+	std::vector<std::weak_ptr<Stream>> playing;
+
+	std::thread reader;
+	std::condition_variable readerWake;
+	bool readerStop = false;
+}  // namespace
+
+Stream::Stream(const std::string& path, const Format& format, uint32_t start, uint32_t end,
+               bool loop, uint32_t loopStart, uint32_t loopEnd)
+    : m_format(format),
+      m_end(to_frame(end)),
+      m_loopStart(to_frame(loopStart)),
+      m_loopEnd(to_frame(loopEnd)),
+      m_loop(loop),
+      m_ring(config::STREAM_BUFFER_SIZE) {
+	m_file = SDL_RWFromFile(path.c_str(), "rb");
+	m_convert = SDL_NewAudioStream(format.format, format.channels, format.freq, AUDIO_S16SYS, 1,
+	                               AUDIO_Frequency());
+	m_read.resize(READ_FRAMES * format.frameBytes);
+	if (m_file) {
+		seek(to_frame(start));
+	}
+}
+
+Stream::~Stream() {
+	if (m_convert) {
+		SDL_FreeAudioStream(m_convert);
+	}
+	if (m_file) {
+		SDL_RWclose(m_file);
+	}
+}
+
+uint32_t Stream::to_frame(uint32_t sample) const {
+	return (uint32_t)std::min<uint64_t>((uint64_t)sample * m_format.freq / AUDIO_Frequency(),
+	                                    m_format.frames);
+}
+
+void Stream::seek(uint32_t frame) {
+	m_frame = frame;
+	SDL_RWseek(m_file, m_format.dataOffset + (Sint64)frame * m_format.frameBytes, RW_SEEK_SET);
+}
+
+int Stream::render(int16_t* buffer, int count) {
+	// checked before the ring, so when it is set the ring holds everything that is left
+	bool done = finished();
+	const uint32_t size = m_ring.size();
+	uint32_t head = m_head.load(std::memory_order_relaxed);
+	uint32_t n = std::min<uint32_t>(count, m_tail.load(std::memory_order_acquire) - head);
+	uint32_t pos = head & (size - 1);
+	uint32_t first = std::min(n, size - pos);
+	std::copy(&m_ring[pos], &m_ring[pos] + first, buffer);
+	std::copy(&m_ring[0], &m_ring[0] + (n - first), buffer + first);
+	m_head.store(head + n, std::memory_order_release);
+	if ((int)n < count && !done) {
+		// the reader has fallen behind, play silence rather than wait for it
+		std::fill(buffer + n, buffer + count, 0);
+		return count;
+	}
+	return n;
+}
+
+void Stream::fill(uint32_t limit) {
+	const uint32_t size = m_ring.size();
+	const uint32_t start = m_tail.load(std::memory_order_relaxed);
+	while (!finished()) {
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		uint32_t space = size - (tail - m_head.load(std::memory_order_acquire));
+		space = std::min(space, limit - std::min(limit, tail - start));
+		if (space == 0) {
+			return;
+		}
+		uint32_t available = SDL_AudioStreamAvailable(m_convert) / sizeof(int16_t);
+		if (available > 0) {
+			uint32_t pos = tail & (size - 1);
+			uint32_t n = std::min(std::min(available, space), size - pos);
+			int got = SDL_AudioStreamGet(m_convert, &m_ring[pos], n * sizeof(int16_t));
+			if (got <= 0) {
+				m_finished.store(true, std::memory_order_release);
+				return;
+			}
+			m_tail.store(tail + got / sizeof(int16_t), std::memory_order_release);
+			continue;
+		}
+		if (m_flushed) {
+			m_finished.store(true, std::memory_order_release);
+			return;
+		}
+
+		bool loop = m_loop.load(std::memory_order_relaxed) && m_loopEnd > m_loopStart;
+		uint32_t end = loop ? m_loopEnd : m_end;
+		if (m_frame >= end) {
+			if (loop) {
+				// carries on through the same converter, so the loop is joined without a gap
+				seek(m_loopStart);
+			} else {
+				SDL_AudioStreamFlush(m_convert);
+				m_flushed = true;
+			}
+			continue;
+		}
+		uint32_t frames = std::min(READ_FRAMES, end - m_frame);
+		size_t got = SDL_RWread(m_file, m_read.data(), m_format.frameBytes, frames);
+		if (got == 0) {
+			// cut short, play what there is
+			m_loop.store(false, std::memory_order_relaxed);
+			m_end = m_frame;
+			continue;
+		}
+		SDL_AudioStreamPut(m_convert, m_read.data(), got * m_format.frameBytes);
+		m_frame += got;
+	}
+}
+
+static void reader_thread() {
+	std::unique_lock<std::mutex> lock(streamMutex);
+	while (!readerStop) {
+		std::vector<std::shared_ptr<Stream>> streams;
+		for (auto i = playing.begin(); i != playing.end();) {
+			std::shared_ptr<Stream> s = i->lock();
+			if (s && !s->finished()) {
+				streams.push_back(s);
+				++i;
+			} else {
+				i = playing.erase(i);
+			}
+		}
+		lock.unlock();
+		for (auto& s : streams) {
+			s->fill();
+		}
+		// a stream that is no longer playing is closed here, off the audio thread
+		streams.clear();
+		lock.lock();
+		readerWake.wait_for(lock, std::chrono::milliseconds(READ_INTERVAL_MS));
+	}
+}
+
+static uint32_t read_le(const uint8_t* p, int bytes) {
+	uint32_t v = 0;
+	for (int n = bytes - 1; n >= 0; n--) {
+		v = (v << 8) | p[n];
+	}
+	return v;
+}
+
+// the sample formats sdl can convert as they stream
+static bool parse_fmt(const uint8_t* fmt, uint32_t size, Format& f) {
+	const uint32_t PCM = 1;
+	const uint32_t FLOAT = 3;
+	const uint32_t EXTENSIBLE = 0xfffe;
+	uint32_t tag = read_le(fmt, 2);
+	if (tag == EXTENSIBLE && size >= 26) {
+		tag = read_le(fmt + 24, 2);
+	}
+	f.channels = read_le(fmt + 2, 2);
+	f.freq = read_le(fmt + 4, 4);
+	f.frameBytes = read_le(fmt + 12, 2);
+	int bits = read_le(fmt + 14, 2);
+	if (tag == PCM && bits == 8) {
+		f.format = AUDIO_U8;
+	} else if (tag == PCM && bits == 16) {
+		f.format = AUDIO_S16LSB;
+	} else if (tag == PCM && bits == 32) {
+		f.format = AUDIO_S32LSB;
+	} else if (tag == FLOAT && bits == 32) {
+		f.format = AUDIO_F32LSB;
+	} else {
+		return false;
+	}
+	return f.channels > 0 && f.channels <= 8 && f.freq > 0 && f.frameBytes == f.channels * bits / 8;
+}
+
+// reads the chunk headers of a wav file, the samples are left for the stream to read
+static bool read_format(const std::string& path, Format& f) {
+	SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+	if (!rw) {
+		return false;
+	}
+	Sint64 fileSize = SDL_RWsize(rw);
+	uint8_t riff[12];
+	bool ok = SDL_RWread(rw, riff, sizeof(riff), 1) == 1 && memcmp(riff, "RIFF", 4) == 0 &&
+	          memcmp(riff + 8, "WAVE", 4) == 0;
+	bool haveFmt = false;
+	for (Sint64 pos = 12; ok;) {
+		uint8_t chunk[8];
+		if (SDL_RWseek(rw, pos, RW_SEEK_SET) < 0 || SDL_RWread(rw, chunk, sizeof(chunk), 1) != 1) {
+			ok = false;
+			break;
+		}
+		uint32_t size = read_le(chunk + 4, 4);
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			uint8_t fmt[40] = {0};
+			ok = size >= 16 && SDL_RWread(rw, fmt, std::min<uint32_t>(size, sizeof(fmt)), 1) == 1 &&
+			     parse_fmt(fmt, size, f);
+			haveFmt = ok;
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			ok = haveFmt && pos + 8 <= UINT32_MAX;
+			f.dataOffset = (uint32_t)(pos + 8);
+			f.frames = (uint32_t)(std::min<Sint64>(size, fileSize - pos - 8) / f.frameBytes);
+			break;
+		}
+		pos += 8 + (Sint64)size + (size & 1);
+	}
+	SDL_RWclose(rw);
+	return ok;
+}
+
+namespace hal_stream {
+	int open(const std::string& path) {
+		std::lock_guard<std::mutex> lock(streamMutex);
+		auto i = pathIds.find(path);
+		int index;
+		if (i != pathIds.end()) {
+			index = i->second;
+		} else {
+			Format format;
+			if (!read_format(path, format)) {
+				logr << "cannot stream wav: " << path;
+				return -1;
+			}
+			auto slot = std::find_if(entries.begin(), entries.end(),
+			                         [](const Entry& e) { return e.path.empty(); });
+			index = slot - entries.begin();
+			if (slot == entries.end()) {
+				entries.emplace_back();
+			}
+			entries[index].path = path;
+			entries[index].format = format;
+			pathIds[path] = index;
+			logr << "stream wav: " << path << " id: " << ID_BASE + index
+			     << " freq: " << format.freq << " channels: " << format.channels
+			     << " duration: " << (double)format.frames / format.freq;
+		}
+		entries[index].refs++;
+		return ID_BASE + index;
+	}
+
+	void close(int id) {
+		std::lock_guard<std::mutex> lock(streamMutex);
+		int index = id - ID_BASE;
+		if (index >= 0 && index < (int)entries.size() && entries[index].refs > 0 &&
+		    --entries[index].refs == 0) {
+			// streams still playing have their own copy of the entry
+			pathIds.erase(entries[index].path);
+			entries[index] = Entry();
+		}
+	}
+
+	bool is_stream(int id) {
+		std::lock_guard<std::mutex> lock(streamMutex);
+		int index = id - ID_BASE;
+		return index >= 0 && index < (int)entries.size() && !entries[index].path.empty();
+	}
+
+	std::shared_ptr<AudioSource> play(int id, uint32_t start, uint32_t end, bool loop,
+	                                  uint32_t loopStart, uint32_t loopEnd) {
+		Entry entry;
+		{
+			std::lock_guard<std::mutex> lock(streamMutex);
+			int index = id - ID_BASE;
+			if (index < 0 || index >= (int)entries.size() || entries[index].path.empty()) {
+				return nullptr;
+			}
+			entry = entries[index];
+		}
+		auto stream =
+		    std::make_shared<Stream>(entry.path, entry.format, start, end, loop, loopStart, loopEnd);
+		if (!stream->ok()) {
+			logr << LogLevel::err << "cannot stream wav: " << entry.path << " " << SDL_GetError();
+			return nullptr;
+		}
+		// only the start is read now so it plays straight away without holding up the game
+		// thread, the reader is woken to read the rest
+		stream->fill(PREFILL_SAMPLES);
+
+		std::lock_guard<std::mutex> lock(streamMutex);
+		if (!reader.joinable()) {
+			readerStop = false;
+			reader = std::thread(reader_thread);
+		}
+		playing.push_back(stream);
+		readerWake.notify_one();
+		return stream;
+	}
+
+	void shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(streamMutex);
+			readerStop = true;
+			readerWake.notify_one();
+		}
+		if (reader.joinable()) {
+			reader.join();
+		}
+		std::lock_guard<std::mutex> lock(streamMutex);
+		playing.clear();
+		entries.clear();
+		pathIds.clear();
+	}
+}  // namespace hal_stream
@@ -0,0 +1,31 @@
+#ifndef HAL_STREAM_H
+#define HAL_STREAM_H
+
+#include <stdint.h>
+#include <memory>
+#include <string>
+
+#include "hal_audio.h"
+
+// wav files played as they are read instead of being loaded first, for long music. a background
+// thread reads each playing stream ahead into a ring of samples at the device rate, the audio
+// thread takes what is there and never waits for it.
+namespace hal_stream {
+	// stream ids start here so they can be told apart from the ids of loaded wavs
+	const int ID_BASE = 0x4000;
+
+	// id of the wav at path, adds a reference. -1 if it is not a wav that can be streamed (pcm or
+	// float samples).
+	int open(const std::string& path);
+	// drops a reference, the id is freed with the last one. playing streams carry on.
+	void close(int id);
+	bool is_stream(int id);
+	// a source playing the stream from start to end, looping from loopEnd back to loopStart if
+	// loop is set. positions are in samples at the device rate. the first few samples are read
+	// before it returns.
+	std::shared_ptr<AudioSource> play(int id, uint32_t start, uint32_t end, bool loop,
+	                                  uint32_t loopStart, uint32_t loopEnd);
+	void shutdown();
+}  // namespace hal_stream
+
+#endif /* HAL_STREAM_H */
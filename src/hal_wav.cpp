@@ -0,0 +1,549 @@
+#include <SDL2/SDL_audio.h>
+#include <SDL2/SDL_rwops.h>
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <thread>
+
+#include "hal_wav.h"
+
+#include "config.h"
+#include "hal_adpcm.h"
+#include "hal_audio.h"
+#include "log.h"
+
+namespace {
+	struct Entry {
+		std::string path;
+		bool trim = true;
+		WavDataPtr data;  // nullptr until loaded, or once evicted
+		bool failed = false;
+		std::string error;
+		int refs = 0;
+		uint64_t lastUse = 0;
+	};
+
+	// samples decoded from a file, shared with files found to have the same bytes
+	struct Contents {
+		std::weak_ptr<const WavData> data;
+		std::string path;
+		bool trim;
+		bool compress;
+	};
+
+	std::mutex cacheMutex;
+	std::vector<Entry> entries;  // indexed by id
+	std::map<std::string, int> pathIds;
+	// samples by a hash of the file contents, so the same wav under another name is only decoded
+	// once. the hash only finds a candidate, the files are compared before the samples are shared.
+	std::map<uint64_t, Contents> byContents;
+	uint64_t useClock = 0;
+	size_t budget = config::WAV_CACHE_SIZE;
+	bool adpcm = false;
+
+	std::thread prefetcher;
+	std::condition_variable prefetchReady;
+	std::deque<int> prefetchQueue;
+	bool prefetchStop = false;
+}  // namespace
+
+static inline int16_t clamp(int32_t s) {
+	if (s < INT16_MIN)
+		return INT16_MIN;
+	if (s > INT16_MAX)
+		return INT16_MAX;
+	return (int16_t)s;
+}
+
+// windowed sinc resampler, wavs are brought to the device rate when they are loaded so the mixer
+// can play them sample for sample.
+static std::vector<int16_t> resample(const int16_t* in, uint32_t count, int from, int to) {
+	if (from == to || count == 0) {
+		return std::vector<int16_t>(in, in + count);
+	}
+	const int ZERO_CROSSINGS = 16;
+	const int PHASES = 256;
+	const double PI = 3.14159265358979323846;
+
+	// when downsampling the kernel is stretched so it also filters out what is above the new
+	// nyquist frequency.
+	double cutoff = std::min(1.0, (double)to / from);
+	int half = (int)std::ceil(ZERO_CROSSINGS / cutoff);
+	int taps = half * 2;
+
+	std::vector<float> kernel((PHASES + 1) * taps);
+	for (int p = 0; p <= PHASES; p++) {
+		for (int t = 0; t < taps; t++) {
+			double x = (t - half + 1) - (double)p / PHASES;
+			double u = x / half;
+			double window = std::abs(u) >= 1.0
+			                    ? 0.0
+			                    : 0.42 + 0.5 * std::cos(PI * u) + 0.08 * std::cos(2.0 * PI * u);
+			double sx = PI * cutoff * x;
+			double sinc = sx == 0.0 ? 1.0 : std::sin(sx) / sx;
+			kernel[p * taps + t] = (float)(cutoff * sinc * window);
+		}
+	}
+
+	double step = (double)from / to;
+	std::vector<int16_t> out((size_t)((uint64_t)count * to / from));
+	for (size_t n = 0; n < out.size(); n++) {
+		double pos = n * step;
+		int64_t base = (int64_t)pos;
+		const float* k = &kernel[(int)((pos - base) * PHASES + 0.5) * taps];
+		int64_t first = base - half + 1;
+		float acc = 0;
+		if (first >= 0 && first + taps <= (int64_t)count) {
+			const int16_t* src = in + first;
+			for (int t = 0; t < taps; t++) {
+				acc += src[t] * k[t];
+			}
+		} else {
+			for (int t = 0; t < taps; t++) {
+				int64_t i = first + t;
+				if (i >= 0 && i < (int64_t)count) {
+					acc += in[i] * k[t];
+				}
+			}
+		}
+		out[n] = clamp((int32_t)std::lrint(acc));
+	}
+	return out;
+}
+
+static uint32_t trim_sample(const int16_t* sampleData, uint32_t numSamples) {
+	for (uint32_t n = numSamples; n > 0; n--) {
+		if (sampleData[n - 1] != 0) {
+			return n;
+		}
+	}
+	return 0;
+}
+
+// fnv-1a
+static uint64_t hash_contents(const std::vector<uint8_t>& data, bool trim, bool compress) {
+	uint64_t hash = 14695981039346656037ull;
+	for (uint8_t b : data) {
+		hash = (hash ^ b) * 1099511628211ull;
+	}
+	return (hash ^ ((trim ? 1 : 0) | (compress ? 2 : 0))) * 1099511628211ull;
+}
+
+static bool read_file(const std::string& path, std::vector<uint8_t>& data) {
+	SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "rb");
+	if (!rw) {
+		return false;
+	}
+	Sint64 size = SDL_RWsize(rw);
+	bool ok = size >= 0;
+	if (ok) {
+		data.resize((size_t)size);
+		ok = size == 0 || SDL_RWread(rw, data.data(), (size_t)size, 1) == 1;
+	}
+	SDL_RWclose(rw);
+	return ok;
+}
+
+// true if the file at path holds exactly data
+static bool same_file(const std::string& path, const std::vector<uint8_t>& data) {
+	std::vector<uint8_t> other;
+	return read_file(path, other) && other == data;
+}
+
+static uint32_t read_le(const uint8_t* p, int bytes) {
+	uint32_t v = 0;
+	for (int n = bytes - 1; n >= 0; n--) {
+		v = (v << 8) | p[n];
+	}
+	return v;
+}
+
+// takes the blocks of an ima-adpcm wav file as they are if it is mono at the device rate, false
+// for any other file.
+static bool read_adpcm(const std::vector<uint8_t>& file, WavData& wav) {
+	if (file.size() < 12 || memcmp(&file[0], "RIFF", 4) != 0 || memcmp(&file[8], "WAVE", 4) != 0) {
+		return false;
+	}
+	const uint8_t* fmt = nullptr;
+	const uint8_t* data = nullptr;
+	uint32_t dataSize = 0;
+	uint32_t factSamples = UINT32_MAX;
+	for (uint64_t pos = 12; pos + 8 <= file.size();) {
+		const uint8_t* chunk = &file[pos];
+		uint32_t size = read_le(chunk + 4, 4);
+		uint32_t avail = (uint32_t)std::min<uint64_t>(size, file.size() - pos - 8);
+		if (memcmp(chunk, "fmt ", 4) == 0 && avail >= 20) {
+			fmt = chunk + 8;
+		} else if (memcmp(chunk, "fact", 4) == 0 && avail >= 4) {
+			factSamples = read_le(chunk + 8, 4);
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			data = chunk + 8;
+			dataSize = avail;
+		}
+		pos += 8 + (uint64_t)size + (size & 1);
+	}
+	if (!fmt || !data) {
+		return false;
+	}
+	const uint32_t IMA_ADPCM = 0x11;
+	int blockSize = read_le(fmt + 12, 2);
+	if (read_le(fmt, 2) != IMA_ADPCM || read_le(fmt + 2, 2) != 1 ||
+	    (int)read_le(fmt + 4, 4) != AUDIO_Frequency() || read_le(fmt + 14, 2) != 4 ||
+	    blockSize <= 4 || read_le(fmt + 18, 2) != hal_adpcm::block_samples(blockSize)) {
+		return false;
+	}
+	uint32_t blocks = dataSize / blockSize;
+	wav.adpcm.assign(data, data + blocks * blockSize);
+	wav.adpcmBlockSize = blockSize;
+	wav.numSamples = std::min(blocks * hal_adpcm::block_samples(blockSize), factSamples);
+	wav.sourceFreq = AUDIO_Frequency();
+	return true;
+}
+
+// drops the silence at the end of adpcm samples
+static void trim_adpcm(WavData& wav) {
+	std::vector<int16_t> samples(wav.numSamples);
+	hal_adpcm::Decoder decoder;
+	hal_adpcm::decode(wav.adpcm.data(), wav.adpcmBlockSize, decoder, 0, samples.data(),
+	                  samples.size());
+	wav.numSamples = trim_sample(samples.data(), samples.size());
+	uint32_t perBlock = hal_adpcm::block_samples(wav.adpcmBlockSize);
+	wav.adpcm.resize((wav.numSamples + perBlock - 1) / perBlock * wav.adpcmBlockSize);
+}
+
+// decodes a wav file of any format and channel count to mono 16 bit at the device rate, held as
+// adpcm if compress is set
+static WavDataPtr decode(const std::vector<uint8_t>& file, bool trim, bool compress,
+                         std::string& error) {
+	auto wav = std::make_shared<WavData>();
+	if (read_adpcm(file, *wav)) {
+		if (trim) {
+			trim_adpcm(*wav);
+		}
+		wav->adpcm.shrink_to_fit();
+		return wav;
+	}
+
+	SDL_AudioSpec spec;
+	uint8_t* data = nullptr;
+	uint32_t length = 0;
+	if (SDL_LoadWAV_RW(SDL_RWFromConstMem(file.data(), file.size()), 1, &spec, &data, &length) ==
+	    nullptr) {
+		error = std::string("SDL_LoadWav error: ") + SDL_GetError();
+		return nullptr;
+	}
+
+	// the rate conversion is left to resample()
+	SDL_AudioCVT cvt;
+	if (SDL_BuildAudioCVT(&cvt, spec.format, spec.channels, spec.freq, AUDIO_S16SYS, 1,
+	                      spec.freq) < 0) {
+		SDL_FreeWAV(data);
+		error = std::string("SDL_BuildAudioCVT error: ") + SDL_GetError();
+		return nullptr;
+	}
+	std::vector<uint8_t> converted(length * cvt.len_mult);
+	std::copy(data, data + length, converted.begin());
+	SDL_FreeWAV(data);
+	cvt.buf = converted.data();
+	cvt.len = length;
+	if (cvt.needed && SDL_ConvertAudio(&cvt) != 0) {
+		error = std::string("SDL_ConvertAudio error: ") + SDL_GetError();
+		return nullptr;
+	}
+	uint32_t numSamples = (cvt.needed ? cvt.len_cvt : length) / 2;
+
+	wav->sourceFreq = spec.freq;
+	wav->samples =
+	    resample((const int16_t*)converted.data(), numSamples, spec.freq, AUDIO_Frequency());
+	if (trim) {
+		wav->samples.resize(trim_sample(wav->samples.data(), wav->samples.size()));
+	}
+	wav->numSamples = wav->samples.size();
+	if (compress) {
+		wav->adpcm = hal_adpcm::encode(wav->samples.data(), wav->numSamples);
+		wav->adpcmBlockSize = hal_adpcm::BLOCK_SIZE;
+		wav->samples.clear();
+	}
+	wav->samples.shrink_to_fit();
+	return wav;
+}
+
+static size_t data_size(const WavDataPtr& data) {
+	return data->samples.size() * sizeof(int16_t) + data->adpcm.size();
+}
+
+// drops samples until the cache is within budget, never the ones of keep. called with the cache
+// locked.
+static void evict(const WavData* keep) {
+	for (;;) {
+		std::set<const WavData*> counted;
+		size_t total = 0;
+		Entry* victim = nullptr;
+		for (auto& e : entries) {
+			if (!e.data) {
+				continue;
+			}
+			if (counted.insert(e.data.get()).second) {
+				total += data_size(e.data);
+			}
+			if (e.data.get() == keep) {
+				continue;
+			}
+			// unreferenced wavs go first, then the least recently used
+			if (!victim || (e.refs == 0) > (victim->refs == 0) ||
+			    ((e.refs == 0) == (victim->refs == 0) && e.lastUse < victim->lastUse)) {
+				victim = &e;
+			}
+		}
+		if (total <= budget || !victim) {
+			return;
+		}
+		// channels still playing the samples keep them alive until they are done
+		const WavData* dropped = victim->data.get();
+		for (auto& e : entries) {
+			if (e.data.get() == dropped) {
+				logr << "evicted wav: " << e.path;
+				e.data = nullptr;
+			}
+		}
+	}
+}
+
+// loads the samples of an entry, the file is read and decoded without the cache locked
+static WavDataPtr load(int id, std::string* error) {
+	std::string path;
+	bool trim;
+	bool compress;
+	{
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		if (id < 0 || id >= (int)entries.size()) {
+			if (error) {
+				*error = "invalid wav id";
+			}
+			return nullptr;
+		}
+		Entry& e = entries[id];
+		e.lastUse = ++useClock;
+		if (e.data || e.failed) {
+			if (error) {
+				*error = e.error;
+			}
+			return e.data;
+		}
+		path = e.path;
+		trim = e.trim;
+		compress = adpcm;
+	}
+
+	std::vector<uint8_t> file;
+	WavDataPtr data;
+	std::string err;
+	uint64_t hash = 0;
+	// the file whose samples were found to match, the samples of another file with the same hash
+	// are never shared
+	std::string matched;
+	if (!read_file(path, file)) {
+		err = std::string("could not read wav: ") + path;
+	} else {
+		hash = hash_contents(file, trim, compress);
+		WavDataPtr candidate;
+		std::string candidatePath;
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			auto i = byContents.find(hash);
+			if (i != byContents.end() && i->second.trim == trim &&
+			    i->second.compress == compress) {
+				candidate = i->second.data.lock();
+				candidatePath = i->second.path;
+			}
+		}
+		if (candidate && same_file(candidatePath, file)) {
+			data = candidate;
+			matched = candidatePath;
+		} else {
+			data = decode(file, trim, compress, err);
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(cacheMutex);
+	Entry& e = entries[id];
+	if (e.data) {
+		// loaded by another thread meanwhile
+		return e.data;
+	}
+	if (!data) {
+		e.failed = true;
+		e.error = err;
+		if (error) {
+			*error = err;
+		}
+		return nullptr;
+	}
+	auto i = byContents.find(hash);
+	if (i != byContents.end() && !i->second.data.expired()) {
+		// decoded by another thread meanwhile, only shared if it is the file compared above
+		if (!matched.empty() && i->second.path == matched) {
+			data = i->second.data.lock();
+		}
+	} else {
+		byContents[hash] = Contents{data, path, trim, compress};
+		logr << "loaded wav: " << path << " id: " << id << " freq: " << data->sourceFreq
+		     << " samples: " << data->numSamples << (data->adpcm.empty() ? "" : " adpcm")
+		     << " duration: " << (double)data->numSamples / (double)AUDIO_Frequency();
+	}
+	e.data = data;
+	evict(data.get());
+	for (auto i = byContents.begin(); i != byContents.end();) {
+		i = i->second.data.expired() ? byContents.erase(i) : std::next(i);
+	}
+	return data;
+}
+
+static void prefetch_thread() {
+	std::unique_lock<std::mutex> lock(cacheMutex);
+	for (;;) {
+		prefetchReady.wait(lock, [] { return prefetchStop || !prefetchQueue.empty(); });
+		if (prefetchStop) {
+			return;
+		}
+		int id = prefetchQueue.front();
+		prefetchQueue.pop_front();
+		lock.unlock();
+		load(id, nullptr);
+		lock.lock();
+	}
+}
+
+// queue id for the background thread, at the front if urgent. cacheMutex must be held.
+static void queue_prefetch(int id, bool urgent) {
+	if (!prefetcher.joinable()) {
+		prefetchStop = false;
+		prefetcher = std::thread(prefetch_thread);
+	}
+	auto i = std::find(prefetchQueue.begin(), prefetchQueue.end(), id);
+	if (i != prefetchQueue.end()) {
+		if (!urgent) {
+			return;
+		}
+		prefetchQueue.erase(i);
+	}
+	if (urgent) {
+		prefetchQueue.push_front(id);
+	} else {
+		prefetchQueue.push_back(id);
+	}
+	prefetchReady.notify_one();
+}
+
+namespace hal_wav {
+	int acquire(const std::string& path, bool trim) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		std::string key = (trim ? "t:" : "u:") + path;
+		auto i = pathIds.find(key);
+		int id;
+		if (i != pathIds.end()) {
+			id = i->second;
+		} else {
+			id = entries.size();
+			entries.emplace_back();
+			entries[id].path = path;
+			entries[id].trim = trim;
+			pathIds[key] = id;
+		}
+		Entry& e = entries[id];
+		e.refs++;
+		// the file may have appeared since it last failed
+		if (e.refs == 1 && e.failed) {
+			e.failed = false;
+			e.error.clear();
+		}
+		return id;
+	}
+
+	void release(int id) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		if (id >= 0 && id < (int)entries.size() && entries[id].refs > 0) {
+			entries[id].refs--;
+		}
+	}
+
+	WavDataPtr get(int id, std::string* error) {
+		return load(id, error);
+	}
+
+	WavDataPtr get_loaded(int id) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		if (id < 0 || id >= (int)entries.size()) {
+			return nullptr;
+		}
+		Entry& e = entries[id];
+		e.lastUse = ++useClock;
+		if (e.data || e.failed) {
+			return e.data;
+		}
+		logr << "wav not loaded yet: " << e.path;
+		queue_prefetch(id, true);
+		return nullptr;
+	}
+
+	void prefetch(int id) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		if (id < 0 || id >= (int)entries.size() || entries[id].data || entries[id].failed) {
+			return;
+		}
+		queue_prefetch(id, false);
+	}
+
+	void set_budget(size_t bytes) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		budget = bytes;
+		evict(nullptr);
+	}
+
+	void set_adpcm(bool enable) {
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		adpcm = enable;
+	}
+
+	void shutdown() {
+		{
+			std::lock_guard<std::mutex> lock(cacheMutex);
+			prefetchStop = true;
+			prefetchQueue.clear();
+			prefetchReady.notify_one();
+		}
+		if (prefetcher.joinable()) {
+			prefetcher.join();
+		}
+		std::lock_guard<std::mutex> lock(cacheMutex);
+		entries.clear();
+		pathIds.clear();
+		byContents.clear();
+	}
+
+	bool save(const std::string& path, const int16_t* samples, size_t frames, int channels,
+	          int freq) {
+		SDL_RWops* rw = SDL_RWFromFile(path.c_str(), "wb");
+		if (!rw) {
+			return false;
+		}
+		uint32_t dataSize = (uint32_t)(frames * channels * sizeof(int16_t));
+		bool ok = SDL_RWwrite(rw, "RIFF", 4, 1) == 1 && SDL_WriteLE32(rw, 36 + dataSize) &&
+		          SDL_RWwrite(rw, "WAVEfmt ", 8, 1) == 1 && SDL_WriteLE32(rw, 16) &&
+		          SDL_WriteLE16(rw, 1) && SDL_WriteLE16(rw, channels) && SDL_WriteLE32(rw, freq) &&
+		          SDL_WriteLE32(rw, freq * channels * sizeof(int16_t)) &&
+		          SDL_WriteLE16(rw, channels * sizeof(int16_t)) && SDL_WriteLE16(rw, 16) &&
+		          SDL_RWwrite(rw, "data", 4, 1) == 1 && SDL_WriteLE32(rw, dataSize);
+		for (size_t n = 0; ok && n < frames * channels; n++) {
+			ok = SDL_WriteLE16(rw, (uint16_t)samples[n]) == 1;
+		}
+		return SDL_RWclose(rw) == 0 && ok;
+	}
+}  // namespace hal_wav
@@ -0,0 +1,47 @@
+#ifndef HAL_WAV_H
+#define HAL_WAV_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <string>
+#include <vector>
+
+// samples of a loaded wav, mono and resampled to AUDIO_Frequency(). never modified once loaded,
+// wavs with the same contents share their samples.
+struct WavData {
+	std::vector<int16_t> samples;  // empty when held as adpcm
+	std::vector<uint8_t> adpcm;    // hal_adpcm blocks of adpcmBlockSize bytes, decoded as played
+	int adpcmBlockSize = 0;
+	uint32_t numSamples = 0;
+	int sourceFreq = 0;  // rate of the wav file
+};
+typedef std::shared_ptr<const WavData> WavDataPtr;
+
+// the wavs loaded by all instances. a path keeps its id for the life of the process, its samples
+// are loaded on first use or in the background and are dropped when the cache goes over its
+// budget, least recently used and unreferenced wavs first.
+namespace hal_wav {
+	// id of the wav at path, adds a reference. does not read the file.
+	int acquire(const std::string& path, bool trim);
+	void release(int id);
+	// the samples of the wav, loaded now if they are not already. nullptr if the id is not valid
+	// or the file could not be loaded, error is set to why.
+	WavDataPtr get(int id, std::string* error = nullptr);
+	// the samples of the wav if they are loaded, never waits. otherwise nullptr, and a wav that
+	// has not failed is loaded on the background thread ahead of the other prefetches.
+	WavDataPtr get_loaded(int id);
+	// load the samples on the background thread
+	void prefetch(int id);
+	void set_budget(size_t bytes);
+	// wavs loaded after this are held as adpcm, a quarter of the size. adpcm wav files that are
+	// mono at the device rate are always kept as they are.
+	void set_adpcm(bool enable);
+	void shutdown();
+
+	// writes 16 bit samples, interleaved when there is more than one channel, as a wav file
+	bool save(const std::string& path, const int16_t* samples, size_t frames, int channels,
+	          int freq);
+}  // namespace hal_wav
+
+#endif /* HAL_WAV_H */
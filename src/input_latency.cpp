@@ -0,0 +1,145 @@
+#include "input_latency.h"
+
+#include <algorithm>
+#include <array>
+#include <deque>
+#include <sstream>
+
+#include "log.h"
+
+namespace {
+	const char* PHASE_NAMES[input_latency::NUM_PHASES] = {"poll", "frame", "present", "total"};
+
+	// 1ms buckets, the last one holds everything longer
+	const int BUCKETS = 256;
+	// buckets put together in each bar of the summary
+	const int BAR_MS = 4;
+	// inputs waiting for their frame to be presented, older ones are dropped past this
+	const size_t MAX_PENDING = 16;
+
+	struct Input {
+		uint64_t event;
+		uint64_t poll;
+		uint64_t sample;
+		uint32_t flip;
+	};
+
+	struct Histogram {
+		std::array<uint32_t, BUCKETS> counts{};
+		uint32_t inputs = 0;
+		uint64_t maxUs = 0;
+
+		void add(uint64_t us) {
+			counts[std::min<uint64_t>(us / 1000, BUCKETS - 1)]++;
+			inputs++;
+			maxUs = std::max(maxUs, us);
+		}
+
+		// the bucket holding the percentile, in ms
+		int percentile(float p) const {
+			uint32_t rank = std::max<uint32_t>(1, (uint32_t)(p / 100.0f * inputs + 0.5f));
+			uint32_t seen = 0;
+			for (int n = 0; n < BUCKETS; n++) {
+				seen += counts[n];
+				if (seen >= rank) {
+					return n;
+				}
+			}
+			return BUCKETS - 1;
+		}
+	};
+
+	std::deque<Input> pending;
+	std::array<Histogram, input_latency::NUM_PHASES> second;
+	std::array<Histogram, input_latency::NUM_PHASES> run;
+
+	void record(const Input& input, uint64_t shown) {
+		// the event time is worked out from a ms timestamp, so can be a little after the poll
+		uint64_t event = std::min(input.event, input.poll);
+		shown = std::max(shown, input.sample);
+		uint64_t us[input_latency::NUM_PHASES] = {input.poll - event, input.sample - input.poll,
+		                                          shown - input.sample, shown - event};
+		for (int n = 0; n < input_latency::NUM_PHASES; n++) {
+			second[n].add(us[n]);
+			run[n].add(us[n]);
+		}
+	}
+
+	std::string percentiles(const Histogram& h) {
+		std::ostringstream s;
+		s << h.percentile(50) << "/" << h.percentile(95) << "/" << h.maxUs / 1000;
+		return s.str();
+	}
+}  // namespace
+
+namespace input_latency {
+
+	void sampled(uint64_t event_us, uint64_t poll_us, uint64_t sample_us) {
+		if (pending.size() >= MAX_PENDING) {
+			pending.pop_front();
+		}
+		pending.push_back(Input{event_us, poll_us, sample_us, 0});
+	}
+
+	void frame_end(uint32_t flip, bool unchanged) {
+		for (auto it = pending.begin(); it != pending.end();) {
+			if (it->flip == 0 && unchanged) {
+				it = pending.erase(it);
+				continue;
+			}
+			if (it->flip == 0) {
+				it->flip = flip;
+			}
+			++it;
+		}
+	}
+
+	void presented(uint32_t flip, uint64_t time_us) {
+		// a flip replaced by a newer one before it was shown is seen in that one
+		while (!pending.empty() && pending.front().flip != 0 && pending.front().flip <= flip) {
+			record(pending.front(), time_us);
+			pending.pop_front();
+		}
+	}
+
+	void log_stats() {
+		if (second[TOTAL].inputs == 0) {
+			return;
+		}
+		std::string line;
+		for (int n = 0; n < NUM_PHASES; n++) {
+			line += std::string(" ") + PHASE_NAMES[n] + " " + percentiles(second[n]);
+		}
+		logr << LogLevel::perf << "input latency ms p50/p95/max:" << line
+		     << " inputs: " << second[TOTAL].inputs;
+		second = {};
+	}
+
+	void log_summary() {
+		const Histogram& total = run[TOTAL];
+		if (total.inputs == 0) {
+			return;
+		}
+		std::string line;
+		for (int n = 0; n < NUM_PHASES; n++) {
+			line += std::string(" ") + PHASE_NAMES[n] + " " + percentiles(run[n]);
+		}
+		logr << LogLevel::perf << total.inputs << " inputs, latency ms p50/p95/max:" << line;
+
+		int last = BUCKETS - 1;
+		while (total.counts[last] == 0) {
+			last--;
+		}
+		for (int n = 0; n <= last; n += BAR_MS) {
+			uint32_t count = 0;
+			for (int i = n; i < std::min(n + BAR_MS, BUCKETS); i++) {
+				count += total.counts[i];
+			}
+			std::string bar((count * 60 + total.inputs - 1) / total.inputs, '#');
+			std::string range = n + BAR_MS >= BUCKETS ? std::to_string(n) + "+"
+			                                          : std::to_string(n) + "-" +
+			                                                std::to_string(n + BAR_MS - 1);
+			logr << LogLevel::perf << "  " << range << "ms " << count << " " << bar;
+		}
+	}
+}  // namespace input_latency
@@ -0,0 +1,27 @@
+#ifndef INPUT_LATENCY_H
+#define INPUT_LATENCY_H
+
+#include <stdint.h>
+
+// how long input takes from the os event to the first frame presented that has seen it, split into
+// waiting to be polled, waiting for the frame to start and running and presenting the frame. times
+// are on the TIME_GetTime_us() clock.
+namespace input_latency {
+	enum Phase { POLL, FRAME, PRESENT, TOTAL, NUM_PHASES };
+
+	// input the frame read before _update: when the event happened, when it was polled and when
+	// the frame read it
+	void sampled(uint64_t event_us, uint64_t poll_us, uint64_t sample_us);
+	// at the end of each frame with the flip that shows it, 0 if it was not flipped. input read by
+	// a frame that looked the same as the last is dropped, nothing it did is presented.
+	void frame_end(uint32_t flip, bool unchanged);
+	// the newest flip presented and when it was shown
+	void presented(uint32_t flip, uint64_t time_us);
+
+	// percentiles of the input presented since the last call, in the perf log
+	void log_stats();
+	// a histogram of all the input presented, in the perf log
+	void log_summary();
+}  // namespace input_latency
+
+#endif /* INPUT_LATENCY_H */
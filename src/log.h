@@ -18,18 +18,18 @@ class Logger {
 	class LogProxy {
 	   public:
 		LogProxy(Logger& logger) : m_logger(logger) {
-			m_logger.m_proxycount++;
+			message().proxycount++;
 		}
 
 		~LogProxy() {
-			m_logger.m_proxycount--;
+			message().proxycount--;
 
-			if (m_logger.m_proxycount == 0) {
+			if (message().proxycount == 0) {
 				m_logger.flush();
 			}
 		}
 		LogProxy(const LogProxy& that) : m_logger(that.m_logger) {
-			m_logger.m_proxycount++;
+			message().proxycount++;
 		}
 
 		template <typename T>
@@ -47,13 +47,13 @@ class Logger {
 	template <typename T>
 	LogProxy operator<<(const T& v) {
 		if (ok()) {
-			m_str << v;
+			message().str << v;
 		}
 		return LogProxy(*this);
 	};
 
 	LogProxy operator<<(LogLevel l) {
-		m_level = l;
+		message().level = l;
 		return LogProxy(*this);
 	}
 
@@ -79,27 +79,38 @@ class Logger {
 	}
 
    private:
+	// the message being built is kept per thread so emulator instances running on worker threads
+	// can log. settings are expected to be set up before any worker threads start.
+	struct Message {
+		std::stringstream str;
+		int proxycount = 0;
+		LogLevel level = LogLevel::info;
+	};
+
+	static Message& message() {
+		static thread_local Message m;
+		return m;
+	}
+
 	void flush() {
+		Message& m = message();
 		if (ok()) {
 			if (m_outputFunc) {
-				m_outputFunc(m_level, m_str.str().c_str());
+				m_outputFunc(m.level, m.str.str().c_str());
 			} else {
-				std::cerr << m_str.str() << std::endl;
+				std::cerr << m.str.str() << std::endl;
 			}
-			m_str.str("");
-			m_str.clear();
+			m.str.str("");
+			m.str.clear();
 		}
-		m_level = LogLevel::info;
+		m.level = LogLevel::info;
 	}
 
 	bool ok() {
-		return m_enabled && ((uint32_t)m_level & (uint32_t)m_logfilter);
+		return m_enabled && ((uint32_t)message().level & (uint32_t)m_logfilter);
 	}
 
-	std::stringstream m_str;
-	int m_proxycount = 0;
 	bool m_enabled = true;
-	LogLevel m_level = LogLevel::info;
 	uint32_t m_logfilter = 0xff;
 	std::function<void(LogLevel, const char*)> m_outputFunc;
 };
@@ -1,38 +1,155 @@
+#ifndef TAC08_HEADLESS
 #include <SDL2/SDL.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
 
 #include "config.h"
+#include "frame_scheduler.h"
+#include "frame_timings.h"
 #include "hal_audio.h"
 #include "hal_core.h"
+#include "input_latency.h"
 #include "log.h"
 #include "pico_audio.h"
 #include "pico_cart.h"
 #include "pico_core.h"
 #include "pico_data.h"
+#include "pico_instance.h"
+#include "pico_plugin.h"
+#include "pico_render.h"
 #include "pico_script.h"
+#include "timeline.h"
+#include "utils.h"
+
+// frames shown in the frame time graph
+static const int HUD_FRAMES = 128;
 
 int safe_main(int argc, char** argv) {
 	TraceFunction();
+	timeline::thread_name("main");
+
+	std::string cart;
+	std::string renderDir;
+	std::string timingsFile;
+	std::string timelineFile;
+	uint32_t timelineFirst = 1;
+	uint32_t timelineLast = config::TIMELINE_FRAMES;
+	int audioFreq = 0;
+	int audioChannels = 0;
+	int audioBuffer = 0;
+	uint32_t frameLimit = 0;
+	int maxDrawSkip = config::MAX_DRAW_SKIP;
+	bool cpuLimit = false;
+	bool lateInput = false;
+	for (int n = 1; n < argc; n++) {
+		std::string arg = argv[n];
+		if (arg == "--plugin") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--plugin requires a library name";
+				return 1;
+			}
+			pico_plugin::add_plugin(argv[n]);
+		} else if (arg == "--allow-cart-plugins") {
+			pico_plugin::allow_cart_plugins(true);
+		} else if (arg == "--sfx-wavs") {
+			pico_control::set_sfx_wavs(true);
+		} else if (arg == "--wav-cache") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--wav-cache requires a size in MB";
+				return 1;
+			}
+			AUDIO_SetWavCacheSize((size_t)std::max(0, atoi(argv[n])) * 1024 * 1024);
+		} else if (arg == "--wav-adpcm") {
+			AUDIO_SetWavAdpcm(true);
+		} else if (arg == "--audio-freq" || arg == "--audio-channels" || arg == "--audio-buffer") {
+			if (++n >= argc) {
+				logr << LogLevel::err << arg << " requires a number";
+				return 1;
+			}
+			int value = std::max(0, atoi(argv[n]));
+			int& setting = arg == "--audio-freq" ? audioFreq
+			               : arg == "--audio-channels" ? audioChannels
+			                                           : audioBuffer;
+			setting = value;
+		} else if (arg == "--frames") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--frames requires a number of frames";
+				return 1;
+			}
+			frameLimit = (uint32_t)std::max(0, atoi(argv[n]));
+		} else if (arg == "--max-skip") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--max-skip requires a number of frames";
+				return 1;
+			}
+			maxDrawSkip = std::max(0, atoi(argv[n]));
+		} else if (arg == "--filter") {
+			if (++n >= argc || !GFX_SelectFilter(argv[n])) {
+				logr << LogLevel::err
+				     << "--filter requires renderer, nearest, scanlines or epx";
+				return 1;
+			}
+		} else if (arg == "--cpu-limit") {
+			cpuLimit = true;
+		} else if (arg == "--late-input") {
+			lateInput = true;
+		} else if (arg == "--timings") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--timings requires a file name";
+				return 1;
+			}
+			timingsFile = argv[n];
+		} else if (arg == "--timeline") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--timeline requires a file name";
+				return 1;
+			}
+			timelineFile = argv[n];
+		} else if (arg == "--timeline-frames") {
+			if (++n >= argc ||
+			    sscanf(argv[n], "%u-%u", &timelineFirst, &timelineLast) != 2) {
+				logr << LogLevel::err << "--timeline-frames requires a range of frames: first-last";
+				return 1;
+			}
+		} else if (arg == "--render-audio") {
+			if (++n >= argc) {
+				logr << LogLevel::err << "--render-audio requires an output directory";
+				return 1;
+			}
+			renderDir = argv[n];
+		} else if (cart.empty()) {
+			cart = arg;
+		} else {
+			logr << LogLevel::err << "unexpected argument: " << arg;
+			return 1;
+		}
+	}
+
+	if (cart.empty()) {
+		cart = FILE_GetDefaultCartName();
+	}
+	if (!renderDir.empty()) {
+		// no window or audio device
+		return pico_render::render_audio(cart, renderDir) == 0 ? 0 : 1;
+	}
 
 	//	GFX_Init(config::INIT_SCREEN_WIDTH * 4, config::INIT_SCREEN_HEIGHT * 4);
 	GFX_Init(512 * 3, 256 * 3);
 	GFX_CreateBackBuffer(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
-	AUDIO_Init();
+	AUDIO_Init(audioFreq, audioChannels, audioBuffer);
 	pico_control::init();
 	pico_data::load_font_data();
 
-	if (argc == 1) {
-		pico_api::load(FILE_GetDefaultCartName());
-	} else {
-		if (argc > 1) {
-			pico_api::load(argv[1]);
-		} else {
-			logr << LogLevel::err << "no cart specified";
-			return 1;
-		}
+	pico_api::load(cart);
+
+	if (!timelineFile.empty()) {
+		timeline::record(timelineFile, timelineFirst, timelineLast);
 	}
 
-	uint32_t target_ticks = 20;
-	uint32_t ticks = 0;
+	FrameScheduler scheduler;
 	uint32_t target_fps = 30;
 	uint32_t actual_fps = 30;
 	uint32_t sys_fps = 60;
@@ -40,7 +157,26 @@ int safe_main(int argc, char** argv) {
 
 	uint32_t systemFrameCount = 0;
 	uint32_t gameFrameCount = 0;
+	uint32_t skippedFrameCount = 0;
+	// _draw calls skipped in a row
+	int drawSkips = 0;
+	// frames the cart is behind on the virtual cpu, with --cpu-limit
+	double cpuDebt = 0;
+	// virtual cpu over the last second, and over all frames
+	double cpuMax = 0;
+	uint32_t overBudgetCount = 0;
+	double cpuMaxRun = 0;
+	uint32_t overBudgetRun = 0;
+	// the screen last flipped, frames that look the same are not copied or presented. after
+	// frames unchanged for a while the loop sleeps until input or the next frame.
+	uint64_t shownHash = 0;
+	bool shown = false;
+	uint32_t unchangedFrames = 0;
+	uint32_t unchangedCount = 0;
 	uint32_t frameTimer = TIME_GetTime_ms();
+	// game frames run, the loop stops at frameLimit if it is set
+	uint32_t framesRun = 0;
+	uint64_t runStart = TIME_GetProfileTime();
 
 	uint64_t updateTime = 0;
 	uint64_t drawTime = 0;
@@ -50,9 +186,24 @@ int safe_main(int argc, char** argv) {
 	bool restarted = true;
 	bool script_error = false;
 
-	while (EVT_ProcessEvents()) {
+	while (frameLimit == 0 || framesRun < frameLimit) {
 		using namespace pico_api;
 
+		timeline::frame(framesRun + 1);
+		timeline::Scope frameScope("frame", framesRun + 1);
+
+		frame_timings::Frame timing;
+		uint64_t eventsStart = TIME_GetProfileTime();
+		if (!EVT_ProcessEvents()) {
+			break;
+		}
+		timing.us[frame_timings::EVENTS] = TIME_GetElapsedProfileTime_us(eventsStart);
+
+		if (DEBUG_TimelineRequested()) {
+			timeline::record(timelineFile.empty() ? "timeline.json" : timelineFile, framesRun + 2,
+			                 framesRun + 1 + config::TIMELINE_FRAMES);
+		}
+
 		if (DEBUG_ReloadRequested()) {
 			restarted = true;
 			pico_api::reloadcart();
@@ -62,26 +213,64 @@ int safe_main(int argc, char** argv) {
 			restarted = false;
 			script_error = false;
 			init = false;
+			target_fps = 30;
 		}
 
-		target_fps = pico_script::symbolExist("_update60") ? 60 : 30;
+		// _update60 is only known to be defined once boot has run the top level code and _init,
+		// until then frames run at 30 fps like flip()
+		if (init) {
+			target_fps = pico_script::symbolExist("_update60") ? 60 : 30;
+		}
 		HAL_SetFrameRates(target_fps, actual_fps, sys_fps, cpu_usage);
 
-		if ((TIME_GetTime_ms() - ticks) > target_ticks) {
-			HAL_StartFrame();
-			pico_control::frame_start();
-			pico_control::sound_tick();
+		scheduler.setRate(target_fps);
+		uint32_t idleAfter = pico_control::idle_when_unchanged() ? 1 : config::IDLE_FRAMES;
+		bool woken = scheduler.wait(unchangedFrames >= idleAfter);
+		if (lateInput || woken) {
+			// input that arrived during the wait is read by this frame instead of the next
+			uint64_t lateStart = TIME_GetProfileTime();
+			if (!EVT_ProcessEvents()) {
+				break;
+			}
+			timing.us[frame_timings::EVENTS] += TIME_GetElapsedProfileTime_us(lateStart);
+		}
+		uint64_t frameStart = TIME_GetProfileTime();
 
-			if (!script_error) {
-				try {
-					if (!init) {
-						pico_script::run("_init", true, restarted);
-						init = true;
-					}
+		// _update reads the input next
+		uint64_t inputEvent;
+		uint64_t inputPoll;
+		if (INP_TakeInputTimes(&inputEvent, &inputPoll)) {
+			input_latency::sampled(inputEvent, inputPoll, TIME_GetTime_us());
+		}
 
-					pico_script::run("_pre_update", true, restarted);
+		HAL_StartFrame();
+		pico_control::frame_start();
+		pico_control::sound_tick();
+		bool drawSkipped = false;
+
+		if (!script_error) {
+			try {
+				bool booting = !init;
+				if (booting) {
+					// top level code & _init run in a coroutine and may take several frames
+					// (flip() based carts never finish), keep input ticking while they do.
 					pico_control::set_input_state(INP_GetInputState());
 					pico_control::set_mouse_state(INP_GetMouseState());
+					if (pico_control::is_pause_menu()) {
+						if (pico_script::do_menu()) {
+							pico_control::end_pause_menu();
+						}
+					} else {
+						init = pico_script::boot(restarted);
+					}
+				}
+
+				if (init) {
+					pico_script::run("_pre_update", true, restarted);
+					if (!booting) {
+						pico_control::set_input_state(INP_GetInputState());
+						pico_control::set_mouse_state(INP_GetMouseState());
+					}
 
 					if (pico_control::is_pause_menu()) {
 						if (pico_script::do_menu()) {
@@ -90,67 +279,181 @@ int safe_main(int argc, char** argv) {
 					} else {
 						uint64_t updateTimeStart = TIME_GetProfileTime();
 						if (!pico_script::run("_update", true, restarted)) {
-							if (pico_script::run("_update60", true, restarted)) {
-								target_ticks = 1;
-							}
+							pico_script::run("_update60", true, restarted);
 						}
-						updateTime += TIME_GetElapsedProfileTime_us(updateTimeStart);
+						timing.us[frame_timings::UPDATE] = TIME_GetElapsedProfileTime_us(updateTimeStart);
+						updateTime += timing.us[frame_timings::UPDATE];
 
-						uint64_t drawTimeStart = TIME_GetProfileTime();
-						pico_script::run("_draw", true, restarted);
-						drawTime += TIME_GetElapsedProfileTime_us(drawTimeStart);
+						// like pico-8, a cart that is behind runs _update again without drawing
+						// to keep the game at speed
+						if (drawSkips < maxDrawSkip && (scheduler.behind() > 0 || cpuDebt > 0)) {
+							drawSkipped = true;
+							drawSkips++;
+						} else {
+							drawSkips = 0;
+							uint64_t drawTimeStart = TIME_GetProfileTime();
+							pico_script::run("_draw", true, restarted);
+							timing.us[frame_timings::DRAW] = TIME_GetElapsedProfileTime_us(drawTimeStart);
+							drawTime += timing.us[frame_timings::DRAW];
+						}
 					}
-				} catch (pico_script::error& e) {
-					pico_control::displayerror(e.what());
-					logr << LogLevel::err << e.what();
-					script_error = true;
 				}
+			} catch (pico_script::error& e) {
+				pico_control::displayerror(e.what());
+				logr << LogLevel::err << e.what();
+				script_error = true;
 			}
+		}
+
+		// flip() only yields inside the cart coroutine so is a no-op here, but some carts
+		// implement their own version to mark end of frame.
+		pico_script::run("flip", true, restarted);
 
-			// call flip() even though this does not do anything, some carts implement their
-			// own version to make end of frame.
-			pico_script::run("flip", true, restarted);
+		uint64_t gcStart = TIME_GetProfileTime();
+		pico_script::gc_step();
+		timing.us[frame_timings::GC] = TIME_GetElapsedProfileTime_us(gcStart);
 
+		bool unchanged = false;
+		if (!drawSkipped) {
 			int buffer_w;
 			int buffer_h;
 			pico_api::colour_t* buffer = pico_control::get_buffer(buffer_w, buffer_h);
 			uint64_t copyBBStart = TIME_GetProfileTime();
-			GFX_SetBackBufferSize(buffer_w, buffer_h);
-			GFX_CopyBackBuffer(buffer, buffer_w, buffer_h);
-			copyBBTime += TIME_GetElapsedProfileTime_us(copyBBStart);
+			uint64_t size = (uint64_t)buffer_w << 32 | (uint32_t)buffer_h;
+			uint64_t hash = utils::hash(buffer, buffer_w * buffer_h, GFX_DisplayHash() ^ size);
+			// the graph changes every frame
+			unchanged = shown && hash == shownHash;
+			shown = !DEBUG_Hud();
+			shownHash = hash;
+			if (!unchanged) {
+				GFX_SetBackBufferSize(buffer_w, buffer_h);
+				GFX_CopyBackBuffer(buffer, buffer_w, buffer_h);
+			}
+			timing.us[frame_timings::COPY] = TIME_GetElapsedProfileTime_us(copyBBStart);
+			copyBBTime += timing.us[frame_timings::COPY];
+
+			if (unchanged) {
+				unchangedFrames++;
+				unchangedCount++;
+			} else {
+				unchangedFrames = 0;
+			}
+
+			if (DEBUG_Hud()) {
+				// total frame times in ms against the frame budget
+				float graph[HUD_FRAMES];
+				int count = std::min(frame_timings::count(), HUD_FRAMES);
+				for (int n = 0; n < count; n++) {
+					graph[n] = frame_timings::get(count - 1 - n).us[frame_timings::TOTAL] / 1000.0f;
+				}
+				GFX_SetOverlay(graph, count, 1000.0f / target_fps);
+			}
+		} else {
+			skippedFrameCount++;
+		}
+
+		gameFrameCount++;
+		framesRun++;
 
-			ticks = TIME_GetTime_ms();
-			gameFrameCount++;
+		pico_control::frame_end();
+		HAL_EndFrame();
 
-			pico_control::frame_end();
-			HAL_EndFrame();
+		double cpu = pico_control::frame_cpu();
+		cpuMax = std::max(cpuMax, cpu);
+		if (cpu > 1) {
+			overBudgetCount++;
 		}
-		systemFrameCount++;
-		GFX_Flip();
+		if (cpuLimit) {
+			// as on pico-8, a frame over budget runs into the next ones: they skip _draw to
+			// catch up, or wait for the frames taken when they cannot
+			cpuDebt = std::max(0.0, cpuDebt + cpu - 1);
+			if (drawSkips >= maxDrawSkip) {
+				for (; cpuDebt >= 1; cpuDebt -= 1) {
+					scheduler.wait();
+				}
+			}
+		}
+		uint32_t flip = 0;
+		if (!drawSkipped && !unchanged) {
+			systemFrameCount++;
+			flip = GFX_Flip();
+		}
+		input_latency::frame_end(flip, unchanged);
+		uint64_t presentedAt;
+		uint32_t presented = GFX_GetPresented(&presentedAt);
+		input_latency::presented(presented, presentedAt);
+
+		timing.frame = framesRun;
+		timing.drawSkipped = drawSkipped;
+		timing.us[frame_timings::PRESENT] = GFX_GetPresentTime_us();
+		timing.us[frame_timings::AUDIO] = AUDIO_GetLastMixTime_us();
+		timing.us[frame_timings::TOTAL] =
+		    timing.us[frame_timings::EVENTS] + TIME_GetElapsedProfileTime_us(frameStart);
+		frame_timings::add(timing);
 
 		if (TIME_GetElapsedTime_ms(frameTimer) >= 1000) {
 			updateTime /= gameFrameCount;
 			drawTime /= gameFrameCount;
-			copyBBTime /= gameFrameCount;
+			copyBBTime /= std::max(1u, gameFrameCount - skippedFrameCount);
 
 			logr << LogLevel::perf << "game FPS: " << gameFrameCount
-			     << " sys FPS: " << systemFrameCount << " update: " << updateTime / 1000.0f
+			     << " skipped: " << skippedFrameCount << " unchanged: " << unchangedCount
+			     << " sys FPS: " << systemFrameCount
+			     << " update: " << updateTime / 1000.0f
 			     << "ms  draw: " << drawTime / 1000.0f << "ms"
 			     << " bb copy: " << copyBBTime << "us"
-			     << " cpu: " << cpu_usage;
+			     << " cpu: " << cpu_usage << " virtual cpu max: " << (int)(cpuMax * 100)
+			     << " over budget: " << overBudgetCount;
+
+			FrameScheduler::Stats frames = scheduler.takeStats();
+			logr << LogLevel::perf << "frame jitter: " << frames.jitterAvgUs
+			     << "us max: " << frames.jitterMaxUs << "us dropped: " << frames.dropped;
 
-			actual_fps = gameFrameCount;
+			AUDIO_UpdateStats();
+			const AudioStats& audio = AUDIO_GetStats();
+			logr << LogLevel::perf << "audio callbacks: " << audio.callbacks
+			     << " mix: " << audio.callbackAvgUs << "us max: " << audio.callbackMaxUs
+			     << "us buffer: " << audio.buffer << " underruns: " << audio.underruns
+			     << " queue: " << audio.queueDepth;
+
+			input_latency::log_stats();
+
+			// frames drawn, as pico-8 reports it
+			actual_fps = gameFrameCount - skippedFrameCount;
 			sys_fps = systemFrameCount;
 			cpu_usage = ((updateTime + drawTime) * 100) / (target_fps == 60 ? 16666 : 33333);
 			gameFrameCount = 0;
+			skippedFrameCount = 0;
+			unchangedCount = 0;
 			systemFrameCount = 0;
 			updateTime = 0;
 			drawTime = 0;
 			copyBBTime = 0;
+			cpuMaxRun = std::max(cpuMaxRun, cpuMax);
+			overBudgetRun += overBudgetCount;
+			cpuMax = 0;
+			overBudgetCount = 0;
 			frameTimer = TIME_GetTime_ms();
 		}
 	}
 
+	if (!timingsFile.empty()) {
+		frame_timings::write_csv(timingsFile);
+	}
+	timeline::finish();
+	input_latency::log_summary();
+
+	uint64_t runTime = std::max<uint64_t>(1, TIME_GetElapsedProfileTime_us(runStart));
+	logr << LogLevel::perf << "ran " << framesRun << " frames (" << TIME_GetTime_ms()
+	     << "ms) in " << runTime / 1000 << "ms, " << framesRun * 1000000.0 / runTime << " fps";
+
+	cpuMaxRun = std::max(cpuMaxRun, cpuMax);
+	overBudgetRun += overBudgetCount;
+	if (overBudgetRun > 0) {
+		logr << LogLevel::perf << overBudgetRun << " frames over the pico-8 cpu budget, max "
+		     << (int)(cpuMaxRun * 100) << "%";
+	}
+
 	return 0;
 }
 
@@ -162,6 +465,11 @@ int main(int argc, char** argv) {
 	logr.setOutputFilter(LogLevel::trace, false);
 
 	TraceFunction();
+
+	pico_control::Instance instance;
+	pico_control::InstanceScope instanceScope(instance);
+	pico_control::set_audio_output(&instance);
+
 	try {
 		safe_main(argc, argv);
 	} catch (gfx_exception& err) {
@@ -1,12 +1,16 @@
-#include <map>
+#include <algorithm>
 #include <sstream>
+#include <vector>
 
 #include "pico_audio.h"
 
+#include "config.h"
 #include "hal_audio.h"
 #include "log.h"
 #include "pico_cart.h"
 #include "pico_core.h"
+#include "pico_instance.h"
+#include "pico_synth.h"
 
 namespace pico_private {
 #pragma pack(1)
@@ -40,29 +44,132 @@ namespace pico_private {
 
 #pragma pack()
 
-	std::map<int, int> sfx_map;
+	struct AudioState {
+		// wav id of each sfx with --sfx-wavs, -1 for none
+		int sfxWavs[64];
+		bool sfxWavsRegistered = false;
+		// wavload() ids, released when the cart is restarted
+		std::vector<int> cartWavs;
+		// a new sfx is set up on a voice the audio thread is done with. once the queued
+		// commands are flushed at most one voice per channel is in use.
+		pico_synth::SfxVoice voices[config::AUDIO_CHANNELS * 2];
+		// voice started on each channel, nullptr once the channel is stopped or given a wav
+		pico_synth::SfxVoice* channelVoice[config::AUDIO_CHANNELS] = {nullptr};
+		pico_synth::MusicPlayer music;
+		int musicMask = 0;  // channels reserved for music
+		// pcmplay() samples and the channel they were started on, -1 for none
+		pico_synth::PcmStream pcm;
+		int pcmChan = -1;
 
+		AudioState() {
+			std::fill_n(sfxWavs, 64, -1);
+		}
+	};
+
+	// drops the references the cart holds on cached wavs
+	static void release_wavs(AudioState* s) {
+		for (int& id : s->sfxWavs) {
+			if (id >= 0) {
+				AUDIO_ReleaseWav(id);
+			}
+			id = -1;
+		}
+		s->sfxWavsRegistered = false;
+		for (int id : s->cartWavs) {
+			AUDIO_ReleaseWav(id);
+		}
+		s->cartWavs.clear();
+	}
+
+	AudioState* audio_create_state() {
+		return new AudioState();
+	}
+
+	void audio_destroy_state(AudioState* s) {
+		release_wavs(s);
+		delete s;
+	}
+}  // namespace pico_private
+
+static thread_local pico_private::AudioState* audio_state = nullptr;
+// play exported sfx wavs in place of the synth when they exist (--sfx-wavs)
+static bool useSfxWavs = false;
+
+namespace pico_private {
+	void audio_bind_state(AudioState* s) {
+		audio_state = s;
+	}
+
+	// the wavs are loaded in the background, an sfx whose wav has not loaded yet when it is
+	// played loads it then.
 	void load_wavs() {
-		sfx_map[-1] = -1;
+		const pico_cart::Cart& cart = pico_cart::getCart();
 		for (int n = 0; n < 64; n++) {
-			std::string name = pico_cart::getCart().sections["base_path"] +
-			                   pico_cart::getCart().sections["cart_name"] + std::to_string(n) +
-			                   ".wav";
-			try {
-				int id = AUDIO_LoadWav(name.c_str());
-				sfx_map[n] = id;
-			} catch (audio_exception& e) {
-				// logr << "failed to load wav: " << e.what();
+			std::string name =
+			    cart.section("base_path") + cart.section("cart_name") + std::to_string(n) + ".wav";
+			audio_state->sfxWavs[n] = AUDIO_RegisterWav(name.c_str());
+		}
+		audio_state->sfxWavsRegistered = true;
+	}
+
+
+	void play_synth(int n, int channel, int offset, int length) {
+		if (channel < 0 || channel >= config::AUDIO_CHANNELS) {
+			return;
+		}
+		pico_synth::SfxVoice* free = nullptr;
+		for (int flushed = 0; !free && flushed < 2; flushed++) {
+			if (flushed) {
+				AUDIO_Flush();
 			}
+			for (auto& voice : audio_state->voices) {
+				if (!AUDIO_SourceInUse(&voice)) {
+					free = &voice;
+					break;
+				}
+			}
+		}
+		if (!free) {
+			return;
 		}
+		pico_synth::SfxVoice& voice = *free;
+		std::replace(audio_state->channelVoice, audio_state->channelVoice + config::AUDIO_CHANNELS,
+		             free, (pico_synth::SfxVoice*)nullptr);
+		voice.start(pico_control::get_sfx_data(), n, offset, length);
+		AUDIO_PlaySource(&voice, channel);
+		audio_state->channelVoice[channel] = &voice;
+	}
+
+	void play_wav(int wavid, int channel, int start, int end, bool loop) {
+		if (channel >= 0 && channel < config::AUDIO_CHANNELS) {
+			audio_state->channelVoice[channel] = nullptr;
+		}
+		if (start < 0) {
+			AUDIO_Play(wavid, channel, loop);
+		} else if (loop) {
+			AUDIO_Play(wavid, channel, start, end);
+		} else {
+			AUDIO_Play(wavid, channel, start, end, false);
+		}
+	}
+
+	void stop_channel(int channel) {
+		if (channel >= 0 && channel < config::AUDIO_CHANNELS) {
+			audio_state->channelVoice[channel] = nullptr;
+		}
+		AUDIO_Stop(channel);
+	}
+
+	int free_channel() {
+		return AUDIO_AvailableChan(true, audio_state->musicMask);
 	}
 
 	int get_wavid(int sfx_id) {
-		auto i = sfx_map.find(sfx_id);
-		if (i != sfx_map.end()) {
-			return i->second;
+		if (sfx_id < 0 || sfx_id >= 64) {
+			return -1;
 		}
-		return -1;
+		int id = audio_state->sfxWavs[sfx_id];
+		return id >= 0 && AUDIO_WavAvailable(id) ? id : -1;
 	}
 
 }  // namespace pico_private
@@ -71,15 +178,39 @@ namespace pico_control {
 	void audio_init() {
 		TraceFunction();
 		AUDIO_StopAll();
-		pico_private::sfx_map.clear();
+		// applied now, so the audio thread is done with the pcm stream before pcmplay() resets it
+		AUDIO_Flush();
+		pico_private::release_wavs(audio_state);
+		std::fill_n(audio_state->channelVoice, config::AUDIO_CHANNELS, nullptr);
+		audio_state->pcmChan = -1;
+		pico_synth::init();
+
+		AUDIO_SetSequencer(nullptr);
+		audio_state->music.setMemory(pico_control::get_music_data(), get_sfx_data());
+		audio_state->musicMask = 0;
+		AUDIO_SetSequencer(&audio_state->music);
+	}
+
+	void set_sfx_wavs(bool enabled) {
+		useSfxWavs = enabled;
 	}
 
-	void set_music_from_cart(std::string& data) {
+	void set_music_from_cart(const std::string& data) {
 		TraceFunction();
+		parse_music(data, pico_control::get_music_data());
+	}
+
+	void set_sfx_from_cart(const std::string& data) {
+		TraceFunction();
+		parse_sfx(data, pico_control::get_sfx_data());
+	}
+
+	void parse_music(const std::string& data, uint8_t* music) {
 		std::istringstream str(data);
 		std::string line;
-		uint8_t* ptr = pico_control::get_music_data();
-		while (std::getline(str, line)) {
+		uint8_t* ptr = music;
+		uint8_t* end = music + 64 * 4;
+		while (ptr < end && std::getline(str, line)) {
 			// puts(line.c_str());
 			int o[5] = {0};
 			if (sscanf(line.c_str(), "%02x %02x%02x%02x%02x", o, o + 1, o + 2, o + 3, o + 4) == 5) {
@@ -100,13 +231,13 @@ namespace pico_control {
 		}
 	}
 
-	void set_sfx_from_cart(std::string& data) {
-		TraceFunction();
+	void parse_sfx(const std::string& data, uint8_t* sfx) {
 		std::istringstream str(data);
 		std::string line;
-		pico_private::SFX* sfx_ptr = (pico_private::SFX*)pico_control::get_sfx_data();
+		pico_private::SFX* sfx_ptr = (pico_private::SFX*)sfx;
+		pico_private::SFX* sfx_end = sfx_ptr + 64;
 		int linenum = 0;
-		while (std::getline(str, line)) {
+		while (sfx_ptr < sfx_end && std::getline(str, line)) {
 			int o[5] = {0};
 			if (sscanf(line.c_str(), "%02x%02x%02x%02x", o, o + 1, o + 2, o + 3) == 4) {
 				sfx_ptr->mode = o[0];
@@ -137,7 +268,7 @@ namespace pico_control {
 	}
 
 	void sound_tick() {
-		if (pico_private::sfx_map.empty()) {
+		if (useSfxWavs && !audio_state->sfxWavsRegistered) {
 			pico_private::load_wavs();
 		}
 	}
@@ -145,6 +276,29 @@ namespace pico_control {
 	void stop_all_audio() {
 		TraceFunction();
 		AUDIO_StopAll();
+		std::fill_n(audio_state->channelVoice, config::AUDIO_CHANNELS, nullptr);
+		pico_api::music(-1);
+	}
+
+	int audio_stat(int key) {
+		pico_synth::MusicStatus music = audio_state->music.status();
+		if (key >= 16 && key <= 23) {
+			int c = (key - 16) & 3;
+			pico_synth::SfxVoice* voice = audio_state->channelVoice[c];
+			if (voice && voice->sfx() >= 0) {
+				return key < 20 ? voice->sfx() : voice->note();
+			}
+			return key < 20 ? music.sfx[c] : music.note[c];
+		}
+		switch (key) {
+			case 24:
+				return music.pattern;
+			case 25:
+				return music.patternCount;
+			case 26:
+				return music.ticks;
+		}
+		return 0;
 	}
 
 }  // namespace pico_control
@@ -157,7 +311,7 @@ namespace pico_api {
 
 	void sfx(int n, int channel) {
 		if (channel == -1) {
-			channel = AUDIO_AvailableChan(true);
+			channel = pico_private::free_channel();
 		}
 		if (channel == -2) {
 			// TODO:
@@ -167,22 +321,22 @@ namespace pico_api {
 			int wavid = pico_private::get_wavid(n);
 			if (wavid >= 0) {
 				pico_private::SFX* sfx_ptr = (pico_private::SFX*)pico_control::get_sfx_data();
-				sfx_ptr += wavid;
+				sfx_ptr += n;
 
 				if (sfx_ptr->loopstart == 0 && sfx_ptr->loopend == 0) {
-					AUDIO_Play(wavid, channel, false);
+					pico_private::play_wav(wavid, channel, -1, -1, false);
 				} else {
 					int speed = sfx_ptr->speed;
 					int lstart = speed * sfx_ptr->loopstart;
 					int lend = speed * (sfx_ptr->loopend + 1) - 1;
-					AUDIO_Play(wavid, channel, lstart, lend);
+					pico_private::play_wav(wavid, channel, lstart, lend, true);
 				}
 			} else {
-				AUDIO_Stop(channel);
+				pico_private::play_synth(n, channel, 0, 32);
 			}
 		}
 		if (n == -1) {
-			AUDIO_Stop(channel);
+			pico_private::stop_channel(channel);
 		}
 		if (n == -2) {
 			AUDIO_StopLoop(channel);
@@ -194,11 +348,11 @@ namespace pico_api {
 	}
 
 	void sfx(int n, int channel, int offset, int length) {
-		if (offset == 0) {
+		if (offset == 0 && length >= 32) {
 			sfx(n, channel);
 		} else {
 			if (channel == -1) {
-				channel = AUDIO_AvailableChan(true);
+				channel = pico_private::free_channel();
 			}
 			if (channel == -2) {
 				// TODO:
@@ -207,34 +361,96 @@ namespace pico_api {
 			int wavid = pico_private::get_wavid(n);
 			if (wavid >= 0) {
 				pico_private::SFX* sfx_ptr = (pico_private::SFX*)pico_control::get_sfx_data();
-				sfx_ptr += wavid;
+				sfx_ptr += n;
 
 				int speed = sfx_ptr->speed;
 				int start = speed * offset;
 				int end = speed * (offset + length);
-				AUDIO_Play(wavid, channel, start, end, false);
+				pico_private::play_wav(wavid, channel, start, end, false);
+			} else if (n >= 0 && n <= 63) {
+				pico_private::play_synth(n, channel, offset, length);
 			} else {
-				AUDIO_Stop(channel);
+				pico_private::stop_channel(channel);
 			}
 		}
 	}
 
 	void music(int n) {
+		music(n, 0, 0);
 	}
+
 	void music(int n, int fadems) {
+		music(n, fadems, 0);
 	}
+
 	void music(int n, int fadems, int channelmask) {
+		audio_state->musicMask = n >= 0 ? channelmask : 0;
+		audio_state->music.play(n, fadems, channelmask);
 	}
 
 }  // namespace pico_api
 
 namespace pico_apix {
-	int wavload(std::string filename) {
-		filename = pico_cart::getCart().sections["base_path"] + filename;
+	int wavload(std::string filename, bool stream) {
+		filename = pico_cart::getCart().section("base_path") + filename;
+		if (stream) {
+			int id = AUDIO_OpenStream(filename.c_str());
+			if (id >= 0) {
+				audio_state->cartWavs.push_back(id);
+				return id;
+			}
+			// formats that cannot be streamed are loaded instead
+		}
 		try {
-			return AUDIO_LoadWav(filename.c_str());
+			int id = AUDIO_LoadWav(filename.c_str());
+			audio_state->cartWavs.push_back(id);
+			return id;
 		} catch (audio_exception&) {
 			return -1;
 		}
 	}
+
+	void pcmplay(int chan, int rate) {
+		pcmstop();
+		if (chan < 0 || chan >= config::AUDIO_MIX_CHANNELS) {
+			return;
+		}
+		if (chan < config::AUDIO_CHANNELS) {
+			audio_state->channelVoice[chan] = nullptr;
+		}
+		audio_state->pcm.reset(rate);
+		AUDIO_PlaySource(&audio_state->pcm, chan);
+		audio_state->pcmChan = chan;
+	}
+
+	void pcmstop() {
+		pico_synth::PcmStream& pcm = audio_state->pcm;
+		// the channel may have been given another sound since
+		if (audio_state->pcmChan >= 0 && AUDIO_SourceInUse(&pcm)) {
+			AUDIO_Stop(audio_state->pcmChan);
+		}
+		// also applies a stop queued elsewhere, as when all sound is stopped, before the stream
+		// can be reset
+		if (AUDIO_SourceInUse(&pcm)) {
+			AUDIO_Flush();
+		}
+		audio_state->pcmChan = -1;
+	}
+
+	int pcmpush(const uint8_t* data, int len, int bits) {
+		return audio_state->pcm.push(data, bits == 16 ? len / 2 : len, bits);
+	}
+
+	int pcmpush(uint16_t addr, int len, int bits) {
+		uint8_t data[config::PCM_BUFFER_SIZE * 2];
+		len = std::max(0, std::min<int>(len, sizeof(data)));
+		for (int n = 0; n < len; n++) {
+			data[n] = pico_api::peek(addr + n);
+		}
+		return pcmpush(data, len, bits);
+	}
+
+	int pcmfree() {
+		return audio_state->pcm.space();
+	}
 }  // namespace pico_apix
@@ -16,15 +16,32 @@ namespace pico_api {
 }  // namespace pico_api
 
 namespace pico_apix {
-	int wavload(std::string filename);
+	int wavload(std::string filename, bool stream = false);
+	// plays the samples queued by pcmpush() on chan at rate hz, from an empty queue
+	void pcmplay(int chan, int rate);
+	void pcmstop();
+	// queues len bytes of 8 bit unsigned or 16 bit signed samples, returns the number of samples
+	// queued
+	int pcmpush(const uint8_t* data, int len, int bits);
+	int pcmpush(uint16_t addr, int len, int bits);
+	// samples that can be queued
+	int pcmfree();
 }
 
 namespace pico_control {
 	void audio_init();
-	void set_music_from_cart(std::string& data);
-	void set_sfx_from_cart(std::string& data);
+	// play exported sfx wavs (<cart name><n>.wav) instead of synthesizing the sfx
+	void set_sfx_wavs(bool enabled);
+	void set_music_from_cart(const std::string& data);
+	void set_sfx_from_cart(const std::string& data);
+	// parse a cart's __music__ / __sfx__ section into music (0x100 bytes) / sfx (0x1100 bytes)
+	// memory
+	void parse_music(const std::string& data, uint8_t* music);
+	void parse_sfx(const std::string& data, uint8_t* sfx);
 	void sound_tick();
 	void stop_all_audio();
+	// stat(16..26), sfx and music playback position
+	int audio_stat(int key);
 }  // namespace pico_control
 
 #endif /* PICO_AUDIO_H */
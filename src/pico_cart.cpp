@@ -9,6 +9,7 @@
 #include "log.h"
 #include "pico_audio.h"
 #include "pico_core.h"
+#include "pico_instance.h"
 #include "pico_script.h"
 #include "utf8-util.h"
 #include "utils.h"
@@ -120,6 +121,20 @@ namespace pico_cart {
 		return false;
 	}
 
+	bool check_plugin(const std::string& line, Cart& cart, int filenum) {
+		// the token must end at a space or the end of the line, #pluginfoo is not a plugin
+		if (line.size() && line[0] == '#' && line.find("#plugin") == 0 &&
+		    (line.size() == 7 || line[7] == ' ' || line[7] == '\t')) {
+			cart.source.push_back(Line{filenum, std::string("-- ") + line});
+			// a name, pico_plugin decides whether and where it is loaded from
+			std::string plugin = utils::trimboth(line.substr(7));
+			logr << "Cart requires plugin " << plugin;
+			cart.plugins.push_back(plugin);
+			return true;
+		}
+		return false;
+	}
+
 	void do_load(std::istream& s, Cart& cart, std::string filename) {
 		TraceFunction();
 
@@ -131,7 +146,7 @@ namespace pico_cart {
 			line = utils::trimright(line, " \n\r");
 			line = convert_emojis(line);
 
-			if (!check_include_file(line, cart, filenum)) {
+			if (!check_include_file(line, cart, filenum) && !check_plugin(line, cart, filenum)) {
 				if (valid_sections.find(line) != valid_sections.end()) {
 					cart.sections["cur_sect"] = line;
 					logr << "section " << line;
@@ -190,10 +205,9 @@ namespace pico_cart {
 		return res;
 	}
 
-	static Cart loadedCart;
-
-	Cart& getCart() {
-		return loadedCart;
+	std::string Cart::section(const std::string& name) const {
+		auto i = sections.find(name);
+		return i != sections.end() ? i->second : std::string();
 	}
 
 	// if the filename begins with a $ then the path of the new cart of relative to the one
@@ -206,9 +220,8 @@ namespace pico_cart {
 
 		filename = path::normalisePath(filename);
 
-		if (loadedCart.sections.find("base_path") != loadedCart.sections.end() &&
-		    filename.length() && filename[0] == '$') {
-			filename = loadedCart.sections["base_path"] + filename.substr(1);
+		if (filename.length() && filename[0] == '$') {
+			filename = getCart().section("base_path") + filename.substr(1);
 		}
 
 		std::string data = FILE_LoadFile(filename);
@@ -217,25 +230,26 @@ namespace pico_cart {
 			throw error(std::string("failed to open cart file: ") + filename);
 		}
 
-		loadedCart = Cart{};
+		auto cart = std::make_shared<Cart>();
 		logr << "Loading cart: " << filename;
-		loadedCart.sections["filename"] = filename;
-		loadedCart.sections["base_path"] = path::getPath(filename);
-		loadedCart.sections["cart_name"] = path::splitFilename(path::getFilename(filename)).first;
-		loadedCart.sections["cur_sect"] = "header";
+		cart->sections["filename"] = filename;
+		cart->sections["base_path"] = path::getPath(filename);
+		cart->sections["cart_name"] = path::splitFilename(path::getFilename(filename)).first;
+		cart->sections["cur_sect"] = "header";
 
 		std::istringstream s(data);
-		do_load(s, loadedCart, filename);
+		do_load(s, *cart, filename);
+		setCart(cart);
 	}
 
-	void extractAssets(Cart& cart);
+	void extractAssets(const Cart& cart);
 
-	void loadassets(std::string filename, Cart& parentCart) {
+	void loadassets(std::string filename) {
 		TraceFunction();
 
 		logr << "Request asset load: " << filename;
 		filename = path::normalisePath(filename);
-		filename = loadedCart.sections["base_path"] + filename;
+		filename = getCart().section("base_path") + filename;
 
 		std::string data = FILE_LoadFile(filename);
 		logr << "loaded: " << data.size() << "bytes";
@@ -248,20 +262,56 @@ namespace pico_cart {
 		}
 	}
 
-	void extractAssets(Cart& cart) {
-		pico_control::set_sprite_data_4bit(cart.sections["__gfx__"]);
-		pico_control::set_sprite_data_8bit(cart.sections["__gfx8__"]);
-		pico_control::set_sprite_flags(cart.sections["__gff__"]);
-		pico_control::set_font_data(cart.sections["__font__"]);
-		pico_control::set_map_data(cart.sections["__map__"]);
-		pico_control::set_music_from_cart(cart.sections["__music__"]);
-		pico_control::set_sfx_from_cart(cart.sections["__sfx__"]);
+	void extractAssets(const Cart& cart) {
+		pico_control::set_sprite_data_4bit(cart.section("__gfx__"));
+		pico_control::set_sprite_data_8bit(cart.section("__gfx8__"));
+		pico_control::set_sprite_flags(cart.section("__gff__"));
+		pico_control::set_font_data(cart.section("__font__"));
+		pico_control::set_map_data(cart.section("__map__"));
+		pico_control::set_music_from_cart(cart.section("__music__"));
+		pico_control::set_sfx_from_cart(cart.section("__sfx__"));
 		pico_control::init_rom();
 	}
 
-	void extractCart(Cart& cart) {
+	void extractCart(const Cart& cart) {
 		extractAssets(cart);
 		pico_script::load(cart);
 	}
 
 }  // namespace pico_cart
+
+namespace pico_private {
+	struct CartState {
+		pico_cart::CartPtr cart = std::make_shared<pico_cart::Cart>();
+	};
+
+	CartState* cart_create_state() {
+		return new CartState();
+	}
+
+	void cart_destroy_state(CartState* s) {
+		delete s;
+	}
+}  // namespace pico_private
+
+static thread_local pico_private::CartState* cart_state = nullptr;
+
+namespace pico_private {
+	void cart_bind_state(CartState* s) {
+		cart_state = s;
+	}
+}  // namespace pico_private
+
+namespace pico_cart {
+	const Cart& getCart() {
+		return *cart_state->cart;
+	}
+
+	CartPtr getCartPtr() {
+		return cart_state->cart;
+	}
+
+	void setCart(CartPtr cart) {
+		cart_state->cart = cart;
+	}
+}  // namespace pico_cart
@@ -2,6 +2,7 @@
 #define PICO_CART_H
 
 #include <map>
+#include <memory>
 #include <stack>
 #include <stdexcept>
 #include <string>
@@ -22,12 +23,21 @@ namespace pico_cart {
 		std::map<std::string, std::string> sections;
 		std::vector<Line> source;
 		std::vector<std::string> files;
+		std::vector<std::string> plugins;  // names of the native plugins asked for with #plugin
+
+		// contents of a section, empty if the cart does not have it
+		std::string section(const std::string& name) const;
 	};
 
+	// a loaded cart is never modified so it can be shared by instances running the same cart
+	typedef std::shared_ptr<const Cart> CartPtr;
+
 	void load(std::string filename);
-	void loadassets(std::string filename, Cart& parentCart);
-	void extractCart(Cart& cart);
-	Cart& getCart();
+	void loadassets(std::string filename);
+	void extractCart(const Cart& cart);
+	const Cart& getCart();
+	CartPtr getCartPtr();
+	void setCart(CartPtr cart);
 
 	struct LineInfo {
 		std::string filename;
@@ -7,19 +7,17 @@
 #include <array>
 
 #include "config.h"
+#include "frame_timings.h"
+#include "hal_audio.h"
 #include "log.h"
 #include "pico_audio.h"
 #include "pico_cart.h"
 #include "pico_gfx.h"
+#include "pico_instance.h"
 #include "pico_memory.h"
 #include "pico_script.h"
 #include "utils.h"
 
-static pico_api::colour_t* backbuffer = nullptr;
-
-static int buffer_size_x = 0;
-static int buffer_size_y = 0;
-
 struct InputState {
 	uint8_t old = 0;
 	uint8_t current = 0;
@@ -67,79 +65,125 @@ struct InputState {
 	}
 };
 
-static std::string lastLoadedCart;
-
-static InputState inputState[4];
-static MouseState mouseState;
-static std::string cartDataName;
-static bool pauseMenuRequested = false;
-static bool pauseMenuActive = false;
-
 struct SpriteSheet {
 	pico_api::colour_t sprite_data[128 * 128];
 	uint8_t flags[256];
 };
 
-static SpriteSheet spriteSheet;
-static SpriteSheet* currentSprData = &spriteSheet;
-static std::map<int, SpriteSheet> extendedSpriteSheets;
-
-static SpriteSheet fontSheet;
-static SpriteSheet* currentFontData = &fontSheet;
-static std::map<int, SpriteSheet> extendedFontSheets;
-
 struct MapSheet {
 	uint8_t map_data[128 * 64];
 };
 
-static uint8_t cart_data[pico_ram::MEM_CART_DATA_SIZE] = {0};
-static uint8_t scratch_data[pico_ram::MEM_SCRATCH_SIZE] = {0};
-static uint8_t music_data[pico_ram::MEM_MUSIC_SIZE] = {0};
-static uint8_t sfx_data[pico_ram::MEM_SFX_SIZE] = {0};
-
-static MapSheet mapSheet;
-static MapSheet* currentMapData = &mapSheet;
-static std::map<int, MapSheet> extendedMapSheets;
-
-static pico_ram::RAM ram;
-static pico_ram::SplitNibbleMemoryArea mem_gfx(spriteSheet.sprite_data,
-                                               pico_ram::MEM_GFX_ADDR,
-                                               pico_ram::MEM_GFX_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_gfx2(spriteSheet.sprite_data + 128 * 64,
-                                                pico_ram::MEM_GFX2_MAP2_ADDR,
-                                                pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::LinearMemoryArea mem_map2(mapSheet.map_data + 128 * 32,
-                                           pico_ram::MEM_GFX2_MAP2_ADDR,
-                                           pico_ram::MEM_GFX2_MAP2_SIZE);
-static pico_ram::DualMemoryArea mem_gfx2_map2(&mem_map2,
-                                              &mem_gfx2);  // shared memory between gfx2 & map2
-static pico_ram::LinearMemoryArea mem_map(mapSheet.map_data,
-                                          pico_ram::MEM_MAP_ADDR,
-                                          pico_ram::MEM_MAP_SIZE);
-static pico_ram::LinearMemoryArea mem_flags(spriteSheet.flags,
-                                            pico_ram::MEM_GFX_PROPS_ADDR,
-                                            pico_ram::MEM_GFX_PROPS_SIZE);
-static pico_ram::SplitNibbleMemoryArea mem_screen(backbuffer,
-                                                  pico_ram::MEM_SCREEN_ADDR,
-                                                  pico_ram::MEM_SCREEN_SIZE);
-
-static pico_ram::LinearMemoryAreaDF mem_cart_data(cart_data,
-                                                  pico_ram::MEM_CART_DATA_ADDR,
-                                                  pico_ram::MEM_CART_DATA_SIZE);
-
-static pico_ram::LinearMemoryArea mem_scratch_data(scratch_data,
-                                                   pico_ram::MEM_SCRATCH_ADDR,
-                                                   pico_ram::MEM_SCRATCH_SIZE);
-
-static pico_ram::LinearMemoryArea mem_music_data(music_data,
-                                                 pico_ram::MEM_MUSIC_ADDR,
-                                                 pico_ram::MEM_MUSIC_SIZE);
-
-static pico_ram::LinearMemoryArea mem_sfx_data(sfx_data,
-                                               pico_ram::MEM_SFX_ADDR,
-                                               pico_ram::MEM_SFX_SIZE);
-
-static uint8_t cartrom[0x4300];
+namespace pico_private {
+	struct CoreState {
+		CoreState();
+		~CoreState();
+		CoreState(const CoreState&) = delete;
+		CoreState& operator=(const CoreState&) = delete;
+
+		pico_api::colour_t* backbuffer = nullptr;
+		int buffer_size_x = 0;
+		int buffer_size_y = 0;
+
+		std::string lastLoadedCart;
+
+		InputState inputState[4];
+		MouseState mouseState;
+		std::string cartDataName;
+		bool pauseMenuRequested = false;
+		bool pauseMenuActive = false;
+		// set with idle(), the frame loop sleeps as soon as the screen stops changing
+		bool idleWhenUnchanged = false;
+
+		// virtual cpu cycles when the frame started and used by the last frame
+		uint64_t frameStartCycles = 0;
+		uint64_t lastFrameCycles = 0;
+
+		SpriteSheet spriteSheet;
+		SpriteSheet* currentSprData = &spriteSheet;
+		std::map<int, SpriteSheet> extendedSpriteSheets;
+
+		SpriteSheet fontSheet;
+		SpriteSheet* currentFontData = &fontSheet;
+		std::map<int, SpriteSheet> extendedFontSheets;
+
+		uint8_t cart_data[pico_ram::MEM_CART_DATA_SIZE] = {0};
+		uint8_t scratch_data[pico_ram::MEM_SCRATCH_SIZE] = {0};
+		uint8_t music_data[pico_ram::MEM_MUSIC_SIZE] = {0};
+		uint8_t sfx_data[pico_ram::MEM_SFX_SIZE] = {0};
+
+		MapSheet mapSheet;
+		MapSheet* currentMapData = &mapSheet;
+		std::map<int, MapSheet> extendedMapSheets;
+
+		pico_ram::RAM ram;
+		pico_ram::SplitNibbleMemoryArea mem_gfx{spriteSheet.sprite_data, pico_ram::MEM_GFX_ADDR,
+		                                        pico_ram::MEM_GFX_SIZE};
+		pico_ram::SplitNibbleMemoryArea mem_gfx2{spriteSheet.sprite_data + 128 * 64,
+		                                         pico_ram::MEM_GFX2_MAP2_ADDR,
+		                                         pico_ram::MEM_GFX2_MAP2_SIZE};
+		pico_ram::LinearMemoryArea mem_map2{mapSheet.map_data + 128 * 32,
+		                                    pico_ram::MEM_GFX2_MAP2_ADDR,
+		                                    pico_ram::MEM_GFX2_MAP2_SIZE};
+		pico_ram::DualMemoryArea mem_gfx2_map2{&mem_map2,
+		                                       &mem_gfx2};  // shared memory between gfx2 & map2
+		pico_ram::LinearMemoryArea mem_map{mapSheet.map_data, pico_ram::MEM_MAP_ADDR,
+		                                   pico_ram::MEM_MAP_SIZE};
+		pico_ram::LinearMemoryArea mem_flags{spriteSheet.flags, pico_ram::MEM_GFX_PROPS_ADDR,
+		                                     pico_ram::MEM_GFX_PROPS_SIZE};
+		pico_ram::SplitNibbleMemoryArea mem_screen{backbuffer, pico_ram::MEM_SCREEN_ADDR,
+		                                           pico_ram::MEM_SCREEN_SIZE};
+
+		pico_ram::LinearMemoryAreaDF mem_cart_data{cart_data, pico_ram::MEM_CART_DATA_ADDR,
+		                                           pico_ram::MEM_CART_DATA_SIZE};
+
+		pico_ram::LinearMemoryArea mem_scratch_data{scratch_data, pico_ram::MEM_SCRATCH_ADDR,
+		                                            pico_ram::MEM_SCRATCH_SIZE};
+
+		pico_ram::LinearMemoryArea mem_music_data{music_data, pico_ram::MEM_MUSIC_ADDR,
+		                                          pico_ram::MEM_MUSIC_SIZE};
+
+		pico_ram::LinearMemoryArea mem_sfx_data{sfx_data, pico_ram::MEM_SFX_ADDR,
+		                                        pico_ram::MEM_SFX_SIZE};
+
+		uint8_t cartrom[0x4300];
+	};
+
+	CoreState::CoreState() {
+		backbuffer = new uint8_t[config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT];
+		mem_screen.setData(backbuffer);
+
+		ram.addMemoryArea(&mem_gfx);
+		ram.addMemoryArea(&mem_gfx2_map2);
+		ram.addMemoryArea(&mem_map);
+		ram.addMemoryArea(&mem_flags);
+		ram.addMemoryArea(&mem_screen);
+		ram.addMemoryArea(&mem_cart_data);
+		ram.addMemoryArea(&mem_scratch_data);
+		ram.addMemoryArea(&mem_music_data);
+		ram.addMemoryArea(&mem_sfx_data);
+	}
+
+	CoreState::~CoreState() {
+		delete[] backbuffer;
+	}
+
+	CoreState* core_create_state() {
+		return new CoreState();
+	}
+
+	void core_destroy_state(CoreState* s) {
+		delete s;
+	}
+}  // namespace pico_private
+
+static thread_local pico_private::CoreState* core_state = nullptr;
+
+namespace pico_private {
+	void core_bind_state(CoreState* s) {
+		core_state = s;
+	}
+}  // namespace pico_private
 
 namespace pico_private {
 	using namespace pico_api;
@@ -159,7 +203,7 @@ namespace pico_private {
 				}
 			}
 		}
-		mem_cart_data.clearDirty();
+		core_state->mem_cart_data.clearDirty();
 	}
 
 	std::string get_cartdata_as_str() {
@@ -235,71 +279,81 @@ namespace pico_control {
 		x = utils::limit(x, config::MIN_SCREEN_WIDTH, config::MAX_SCREEN_WIDTH);
 		y = utils::limit(y, config::MIN_SCREEN_HEIGHT, config::MAX_SCREEN_HEIGHT);
 
-		buffer_size_x = x;
-		buffer_size_y = y;
+		core_state->buffer_size_x = x;
+		core_state->buffer_size_y = y;
 
-		pico_control::set_backbuffer(backbuffer, x, y, x);
+		pico_control::set_backbuffer(core_state->backbuffer, x, y, x);
 	}
 
 	void init() {
 		TraceFunction();
-		if (!backbuffer) {
-			backbuffer = new uint8_t[config::MAX_SCREEN_WIDTH * config::MAX_SCREEN_HEIGHT];
-		}
 		gfx_init();
 
 		init_backbuffer_mem(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
-		pico_control::set_spritebuffer(spriteSheet.sprite_data);
-		pico_control::set_spriteflags(spriteSheet.flags);
-		pico_control::set_mapbuffer(mapSheet.map_data);
-		pico_control::set_fontbuffer(fontSheet.sprite_data);
+		pico_control::set_spritebuffer(core_state->spriteSheet.sprite_data);
+		pico_control::set_spriteflags(core_state->spriteSheet.flags);
+		pico_control::set_mapbuffer(core_state->mapSheet.map_data);
+		pico_control::set_fontbuffer(core_state->fontSheet.sprite_data);
 
-		mem_screen.setData(backbuffer);
+		core_state->cartDataName = "";
 
-		cartDataName = "";
+		core_state->pauseMenuActive = false;
+		core_state->idleWhenUnchanged = false;
 
-		pauseMenuActive = false;
+		audio_init();
+	}
 
-		ram.addMemoryArea(&mem_gfx);
-		ram.addMemoryArea(&mem_gfx2_map2);
-		ram.addMemoryArea(&mem_map);
-		ram.addMemoryArea(&mem_flags);
-		ram.addMemoryArea(&mem_screen);
-		ram.addMemoryArea(&mem_cart_data);
-		ram.addMemoryArea(&mem_scratch_data);
-		ram.addMemoryArea(&mem_music_data);
-		ram.addMemoryArea(&mem_sfx_data);
+	// virtual cpu cycles used since the cart was loaded
+	static uint64_t cpu_cycles() {
+		return pico_script::instructions() * config::CPU_INSTRUCTION_CYCLES +
+		       pico_control::gfx_cpu_cycles();
+	}
 
-		audio_init();
+	// cycles used since the frame started, the count restarts when a cart is loaded
+	static uint64_t frame_cycles() {
+		uint64_t now = cpu_cycles();
+		return now >= core_state->frameStartCycles ? now - core_state->frameStartCycles : now;
+	}
+
+	static double cpu_fraction(uint64_t cycles) {
+		uint32_t fps = std::max(1u, HAL_GetFrameRate('t'));
+		return double(cycles) * fps / config::CPU_CYCLES_PER_SECOND;
 	}
 
 	void frame_start() {
+		core_state->frameStartCycles = cpu_cycles();
+	}
+
+	double frame_cpu() {
+		return cpu_fraction(core_state->lastFrameCycles);
 	}
 
 	void frame_end() {
-		if (mem_cart_data.isDirty()) {
-			if (!cartDataName.empty()) {
-				FILE_SaveGameState(cartDataName + ".p8d.txt", pico_private::get_cartdata_as_str());
+		core_state->lastFrameCycles = frame_cycles();
+		if (core_state->mem_cart_data.isDirty()) {
+			if (!core_state->cartDataName.empty()) {
+				FILE_SaveGameState(core_state->cartDataName + ".p8d.txt",
+				                   pico_private::get_cartdata_as_str());
 			}
-			mem_cart_data.clearDirty();
+			core_state->mem_cart_data.clearDirty();
 		}
-		if (pauseMenuRequested)
+		if (core_state->pauseMenuRequested)
 			begin_pause_menu();
 	}
 
 	pico_api::colour_t* get_buffer(int& width, int& height) {
-		width = buffer_size_x;
-		height = buffer_size_y;
-		return backbuffer;
+		width = core_state->buffer_size_x;
+		height = core_state->buffer_size_y;
+		return core_state->backbuffer;
 	}
 
 	void set_sprite_data_4bit(std::string data) {
 		TraceFunction();
 		if (data.size()) {
-			if (currentSprData == &spriteSheet) {
+			if (core_state->currentSprData == &core_state->spriteSheet) {
 				pico_private::copy_gfxdata_to_ram(pico_ram::MEM_GFX_ADDR, data);
 			} else {
-				pico_private::copy_data_to_sprites(*currentSprData, data, false);
+				pico_private::copy_data_to_sprites(*core_state->currentSprData, data, false);
 			}
 		}
 	}
@@ -308,7 +362,7 @@ namespace pico_control {
 		TraceFunction();
 		if (data.size()) {
 			logr << " loading 8bit sprite data";
-			pico_private::copy_data_to_sprites(*currentSprData, data, true);
+			pico_private::copy_data_to_sprites(*core_state->currentSprData, data, true);
 		}
 	}
 
@@ -319,7 +373,7 @@ namespace pico_control {
 
 	void set_font_data(std::string data) {
 		TraceFunction();
-		pico_private::copy_data_to_sprites(*currentFontData, data, false);
+		pico_private::copy_data_to_sprites(*core_state->currentFontData, data, false);
 	}
 
 	void set_map_data(std::string data) {
@@ -328,16 +382,16 @@ namespace pico_control {
 	}
 
 	void set_input_state(int state, int player) {
-		inputState[player].set(state);
+		core_state->inputState[player].set(state);
 		if (player == 0) {
-			if (inputState[0].justPressed(6) && !is_pause_menu()) {
-				pauseMenuRequested = true;
+			if (core_state->inputState[0].justPressed(6) && !is_pause_menu()) {
+				core_state->pauseMenuRequested = true;
 			}
 		}
 	}
 
 	void set_mouse_state(const MouseState& ms) {
-		mouseState = ms;
+		core_state->mouseState = ms;
 	}
 
 	void test_integrity() {
@@ -345,29 +399,34 @@ namespace pico_control {
 
 	void begin_pause_menu() {
 		pico_apix::gfxstate(-1);
-		pauseMenuRequested = false;
-		pauseMenuActive = true;
+		core_state->pauseMenuRequested = false;
+		core_state->pauseMenuActive = true;
 	}
 
 	bool is_pause_menu() {
-		return pauseMenuActive;
+		return core_state->pauseMenuActive;
+	}
+
+	bool idle_when_unchanged() {
+		return core_state->idleWhenUnchanged || core_state->pauseMenuActive;
 	}
 
 	void end_pause_menu() {
-		pauseMenuActive = false;
+		core_state->pauseMenuActive = false;
 		pico_apix::gfxstate(0);
 	}
 
 	uint8_t* get_music_data() {
-		return music_data;
+		return core_state->music_data;
 	}
 	uint8_t* get_sfx_data() {
-		return sfx_data;
+		return core_state->sfx_data;
 	}
 
 	void restartCart() {
 		TraceFunction();
-		pauseMenuActive = false;
+		core_state->pauseMenuActive = false;
+		core_state->idleWhenUnchanged = false;
 		gfx_init();
 		init_backbuffer_mem(config::INIT_SCREEN_WIDTH, config::INIT_SCREEN_HEIGHT);
 		stop_all_audio();
@@ -396,24 +455,30 @@ namespace pico_control {
 
 	void init_rom() {
 		for (uint16_t a = 0; a < 0x4300; a++) {
-			cartrom[a] = pico_api::peek(a);
+			core_state->cartrom[a] = pico_api::peek(a);
 		}
 	}
 
 }  // namespace pico_control
 
+// a time in microseconds as ms for stat(), which would overflow the 16.16 numbers carts get in
+// microseconds. the fraction is kept and times past the largest number are clamped.
+static double stat_ms(double us) {
+	return std::min(us / 1000.0, 32767.0);
+}
+
 namespace pico_api {
 
 	void load(std::string cartname) {
 		TraceFunction();
 		pico_cart::load(cartname);
-		lastLoadedCart = cartname;
+		core_state->lastLoadedCart = cartname;
 		pico_control::restartCart();
 	}
 
 	void reloadcart() {
 		TraceFunction();
-		load(pico_cart::getCart().sections["basepath"] + pico_cart::getCart().sections["filename"]);
+		load(pico_cart::getCart().section("filename"));
 	}
 
 	void run() {
@@ -426,7 +491,7 @@ namespace pico_api {
 		if (a >= 0x5f00 && a <= 0x5f3f) {
 			return gfx_peek(a);
 		} else {
-			return ram.peek(a);
+			return core_state->ram.peek(a);
 		}
 	}
 
@@ -449,7 +514,7 @@ namespace pico_api {
 		if (a >= 0x5f00 && a <= 0x5f3f) {
 			gfx_poke(a, v);
 		} else {
-			ram.poke(a, v);
+			core_state->ram.poke(a, v);
 		}
 	}
 
@@ -486,8 +551,8 @@ namespace pico_api {
 	}
 
 	void cartdata(std::string name) {
-		cartDataName = name;
-		std::string data = FILE_LoadGameState(cartDataName + ".p8d.txt");
+		core_state->cartDataName = name;
+		std::string data = FILE_LoadGameState(core_state->cartDataName + ".p8d.txt");
 		pico_private::copy_cartdata_to_ram(data);
 	}
 
@@ -500,30 +565,39 @@ namespace pico_api {
 	}
 
 	int btn() {
-		return inputState[0].current;
+		return core_state->inputState[0].current;
 	}
 
 	int btn(int n, int player) {
 		if (player < 0 || player > 3)
 			return 0;
-		return inputState[player].isPressed(n);
+		return core_state->inputState[player].isPressed(n);
 	}
 
 	int btnp() {
-		return inputState[0].justPressed();  // TODO: impl repeat on this
+		return core_state->inputState[0].justPressed();  // TODO: impl repeat on this
 	}
 
 	int btnp(int n, int player) {
 		if (player < 0 || player > 3)
 			return 0;
-		return inputState[player].justPressedRpt(n);
+		return core_state->inputState[player].justPressedRpt(n);
 	}
 
 	int stat(int key, std::string& sval, int& ival, double& fval) {
+		if (key >= 430 && key < 430 + frame_timings::NUM_PHASES * 4) {
+			// p50, p95, p99 and max of each phase
+			static const float PERCENTILES[4] = {50, 95, 99, 100};
+			int n = key - 430;
+			fval = stat_ms(
+			    frame_timings::percentile((frame_timings::Phase)(n / 4), PERCENTILES[n % 4]));
+			return 3;
+		}
 		switch (key) {
 			case 1:
 			case 2:
-				fval = double(HAL_GetFrameRate('c')) / 100.0;
+				// the frame so far, on the virtual cpu
+				fval = pico_control::cpu_fraction(pico_control::frame_cycles());
 				return 3;
 			case 7:
 				ival = HAL_GetFrameRate('a');
@@ -534,32 +608,45 @@ namespace pico_api {
 			case 9:
 				ival = HAL_GetFrameRate('s');
 				return 2;
+			case 16:
+			case 17:
+			case 18:
+			case 19:
+			case 20:
+			case 21:
+			case 22:
+			case 23:
+			case 24:
+			case 25:
+			case 26:
+				ival = pico_control::audio_stat(key);
+				return 2;
 			case 32:
-				ival = mouseState.x;
+				ival = core_state->mouseState.x;
 				return 2;
 			case 33:
-				ival = mouseState.y;
+				ival = core_state->mouseState.y;
 				return 2;
 			case 34:
-				ival = mouseState.buttons;
+				ival = core_state->mouseState.buttons;
 				return 2;
 			case 36:
-				ival = mouseState.wheel;
+				ival = core_state->mouseState.wheel;
 				return 2;
 			case 102:
 				sval = TOSTRING(TAC08_PLATFORM);
 				return 1;
 			case 400:
-				sval = pico_cart::getCart().sections["base_path"];
+				sval = pico_cart::getCart().section("base_path");
 				return 1;
 			case 401:
-				sval = pico_cart::getCart().sections["cart_name"];
+				sval = pico_cart::getCart().section("cart_name");
 				return 1;
 			case 410:
-				ival = buffer_size_x;
+				ival = core_state->buffer_size_x;
 				return 2;
 			case 411:
-				ival = buffer_size_y;
+				ival = core_state->buffer_size_y;
 				return 2;
 			case 412: {
 				int x, y;
@@ -573,6 +660,27 @@ namespace pico_api {
 				ival = y;
 				return 2;
 			}
+			case 420:
+				ival = AUDIO_GetStats().freq;
+				return 2;
+			case 421:
+				ival = AUDIO_GetStats().channels;
+				return 2;
+			case 422:
+				ival = AUDIO_GetStats().buffer;
+				return 2;
+			case 423:
+				ival = AUDIO_GetStats().underruns;
+				return 2;
+			case 424:
+				fval = stat_ms(AUDIO_GetStats().callbackAvgUs);
+				return 3;
+			case 425:
+				fval = stat_ms(AUDIO_GetStats().callbackMaxUs);
+				return 3;
+			case 426:
+				ival = AUDIO_GetStats().queueDepth;
+				return 2;
 		}
 
 		ival = 0;
@@ -582,7 +690,7 @@ namespace pico_api {
 	void reload(uint16_t dest_addr, uint16_t source_addr, uint16_t len) {
 		len = std::min<uint16_t>(len, 0x4300);
 		for (uint16_t n = 0; n < len; n++) {
-			poke(dest_addr + n, cartrom[source_addr + n]);
+			poke(dest_addr + n, core_state->cartrom[source_addr + n]);
 		}
 	}
 
@@ -598,11 +706,11 @@ namespace pico_apix {
 	}
 
 	void wrstr(const std::string& name, const std::string& s) {
-		FILE_SaveGameState(cartDataName + "_" + name, s);
+		FILE_SaveGameState(core_state->cartDataName + "_" + name, s);
 	}
 
 	std::string rdstr(const std::string& name) {
-		return FILE_LoadGameState(cartDataName + "_" + name);
+		return FILE_LoadGameState(core_state->cartDataName + "_" + name);
 	}
 
 	void setpal(uint8_t i, uint8_t r, uint8_t g, uint8_t b) {
@@ -632,7 +740,7 @@ namespace pico_apix {
 	}
 
 	void zoom() {
-		GFX_SetZoom(buffer_size_x / 2, buffer_size_y / 2, 1.0, 0);
+		GFX_SetZoom(core_state->buffer_size_x / 2, core_state->buffer_size_y / 2, 1.0, 0);
 	}
 
 	void cursor(bool enable) {
@@ -641,52 +749,56 @@ namespace pico_apix {
 
 	void menu() {
 		if (!pico_control::is_pause_menu())
-			pauseMenuRequested = true;
+			core_state->pauseMenuRequested = true;
 	}
 
 	void siminput(uint8_t state) {
 		INP_SetSimState(state);
 	}
 
+	void idle(bool enable) {
+		core_state->idleWhenUnchanged = enable;
+	}
+
 	void sprites() {
-		currentSprData = &spriteSheet;
-		pico_control::set_spritebuffer(currentSprData->sprite_data);
-		pico_control::set_spriteflags(currentSprData->flags);
+		core_state->currentSprData = &core_state->spriteSheet;
+		pico_control::set_spritebuffer(core_state->currentSprData->sprite_data);
+		pico_control::set_spriteflags(core_state->currentSprData->flags);
 	}
 
 	void sprites(int page) {
-		if (extendedSpriteSheets.find(page) == extendedSpriteSheets.end()) {
-			memset(&extendedSpriteSheets[page], 0, sizeof(SpriteSheet));
+		if (core_state->extendedSpriteSheets.find(page) == core_state->extendedSpriteSheets.end()) {
+			memset(&core_state->extendedSpriteSheets[page], 0, sizeof(SpriteSheet));
 		}
-		currentSprData = &extendedSpriteSheets[page];
-		pico_control::set_spritebuffer(currentSprData->sprite_data);
-		pico_control::set_spriteflags(currentSprData->flags);
+		core_state->currentSprData = &core_state->extendedSpriteSheets[page];
+		pico_control::set_spritebuffer(core_state->currentSprData->sprite_data);
+		pico_control::set_spriteflags(core_state->currentSprData->flags);
 	}
 
 	void maps() {
-		currentMapData = &mapSheet;
-		pico_control::set_mapbuffer(currentMapData->map_data);
+		core_state->currentMapData = &core_state->mapSheet;
+		pico_control::set_mapbuffer(core_state->currentMapData->map_data);
 	}
 
 	void maps(int page) {
-		if (extendedMapSheets.find(page) == extendedMapSheets.end()) {
-			memset(&extendedMapSheets[page], 0, sizeof(MapSheet));
+		if (core_state->extendedMapSheets.find(page) == core_state->extendedMapSheets.end()) {
+			memset(&core_state->extendedMapSheets[page], 0, sizeof(MapSheet));
 		}
-		currentMapData = &extendedMapSheets[page];
-		pico_control::set_mapbuffer(currentMapData->map_data);
+		core_state->currentMapData = &core_state->extendedMapSheets[page];
+		pico_control::set_mapbuffer(core_state->currentMapData->map_data);
 	}
 
 	void fonts() {
-		currentFontData = &fontSheet;
-		pico_control::set_fontbuffer(currentFontData->sprite_data);
+		core_state->currentFontData = &core_state->fontSheet;
+		pico_control::set_fontbuffer(core_state->currentFontData->sprite_data);
 	}
 
 	void fonts(int page) {
-		if (extendedFontSheets.find(page) == extendedFontSheets.end()) {
-			memset(&extendedFontSheets[page], 0, sizeof(SpriteSheet));
+		if (core_state->extendedFontSheets.find(page) == core_state->extendedFontSheets.end()) {
+			memset(&core_state->extendedFontSheets[page], 0, sizeof(SpriteSheet));
 		}
-		currentFontData = &extendedFontSheets[page];
-		pico_control::set_fontbuffer(currentFontData->sprite_data);
+		core_state->currentFontData = &core_state->extendedFontSheets[page];
+		pico_control::set_fontbuffer(core_state->currentFontData->sprite_data);
 	}
 
 	void fullscreen(bool enable) {
@@ -694,7 +806,7 @@ namespace pico_apix {
 	}
 
 	void assetload(std::string filename) {
-		pico_cart::loadassets(filename, pico_cart::getCart());
+		pico_cart::loadassets(filename);
 	}
 
 	std::pair<std::string, bool> dbg_getsrc(std::string src, int line) {
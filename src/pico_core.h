@@ -57,6 +57,7 @@ namespace pico_apix {
 	void cursor(bool enable);
 	void menu();
 	void siminput(uint8_t state);
+	void idle(bool enable);
 
 	void sprites();
 	void sprites(int page);
@@ -82,6 +83,8 @@ namespace pico_control {
 	void init();
 	void frame_start();
 	void frame_end();
+	// virtual cpu used by the last frame, 1 is the whole frame
+	double frame_cpu();
 	pico_api::colour_t* get_buffer(int& width, int& height);
 	void set_sprite_data_4bit(std::string data);
 	void set_sprite_data_8bit(std::string data);
@@ -95,6 +98,9 @@ namespace pico_control {
 	void begin_pause_menu();
 	bool is_pause_menu();
 	void end_pause_menu();
+	// whether the frame loop can sleep as soon as the screen stops changing, rather than after
+	// config::IDLE_FRAMES, because the cart asked to or the pause menu is showing
+	bool idle_when_unchanged();
 	uint8_t* get_music_data();
 	uint8_t* get_sfx_data();
 	void restartCart();
@@ -5,20 +5,11 @@
 #include <array>
 #include <map>
 
+#include "config.h"
 #include "hal_core.h"
+#include "pico_instance.h"
 #include "utf8-util.h"
 
-static pico_api::colour_t* backbuffer = nullptr;
-static int buffer_size_x = 0;
-static int buffer_size_y = 0;
-static int buffer_stride = 0;
-
-static pico_api::colour_t* spritebuffer = nullptr;
-static uint8_t* spriteflags = nullptr;
-static uint8_t* mapbuffer = nullptr;
-
-static pico_api::colour_t* fontbuffer = nullptr;
-
 struct GraphicsState {
 	pico_api::colour_t fg = 7;
 	pico_api::colour_t bg = 0;
@@ -42,35 +33,71 @@ struct GraphicsState {
 	bool extendedPalette = false;
 };
 
-static GraphicsState* currentGraphicsState = nullptr;
-static std::map<int, GraphicsState> extendedGraphicsStates;
+namespace pico_private {
+	struct GfxState {
+		pico_api::colour_t* backbuffer = nullptr;
+		int buffer_size_x = 0;
+		int buffer_size_y = 0;
+		int buffer_stride = 0;
+
+		pico_api::colour_t* spritebuffer = nullptr;
+		uint8_t* spriteflags = nullptr;
+		uint8_t* mapbuffer = nullptr;
+
+		pico_api::colour_t* fontbuffer = nullptr;
+
+		GraphicsState* currentGraphicsState = nullptr;
+		std::map<int, GraphicsState> extendedGraphicsStates;
+
+		// virtual cpu cost of the pixels drawn, in 1/16ths of a cycle
+		uint64_t cpuCost = 0;
+	};
+
+	GfxState* gfx_create_state() {
+		return new GfxState();
+	}
+
+	void gfx_destroy_state(GfxState* s) {
+		delete s;
+	}
+}  // namespace pico_private
+
+static thread_local pico_private::GfxState* gfx_state = nullptr;
+
+namespace pico_private {
+	void gfx_bind_state(GfxState* s) {
+		gfx_state = s;
+	}
+}  // namespace pico_private
 
 namespace pico_private {
 	using namespace pico_api;
 
 	static void restore_palette() {
-		for (size_t n = 0; n < currentGraphicsState->palette_map.size(); n++) {
-			currentGraphicsState->palette_map[n] = (colour_t)n;
+		for (size_t n = 0; n < gfx_state->currentGraphicsState->palette_map.size(); n++) {
+			gfx_state->currentGraphicsState->palette_map[n] = (colour_t)n;
 		}
 		GFX_RestorePaletteMapping();
 	}
 
 	static void restore_transparency() {
-		for (size_t n = 0; n < currentGraphicsState->palette_map.size(); n++) {
-			currentGraphicsState->transparent[n] = false;
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		for (size_t n = 0; n < gs->palette_map.size(); n++) {
+			gs->transparent[n] = false;
 		}
-		currentGraphicsState->transparent[0] = true;
+		gs->transparent[0] = true;
 	}
 
 	// test if rectangle is within cliping rectangle
 	static bool is_visible(int x, int y, int w, int h) {
-		if (x >= currentGraphicsState->clip_x2)
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		if (x >= gs->clip_x2)
 			return false;
-		if (y >= currentGraphicsState->clip_y2)
+		if (y >= gs->clip_y2)
 			return false;
-		if (x + w <= currentGraphicsState->clip_x1)
+		if (x + w <= gs->clip_x1)
 			return false;
-		if (y + h <= currentGraphicsState->clip_y1)
+		if (y + h <= gs->clip_y1)
 			return false;
 		if (w <= 0 || h <= 0)
 			return false;
@@ -78,7 +105,19 @@ namespace pico_private {
 		return true;
 	}
 
-	static void blitter(colour_t* spritebuffer,
+	inline void charge_fill(int pixels) {
+		if (pixels > 0) {
+			gfx_state->cpuCost += (uint64_t)pixels * config::CPU_FILL_COST;
+		}
+	}
+
+	inline void charge_blit(int pixels) {
+		if (pixels > 0) {
+			gfx_state->cpuCost += (uint64_t)pixels * config::CPU_BLIT_COST;
+		}
+	}
+
+	static void blitter(colour_t* srcbuffer,
 	                    int scr_x,
 	                    int scr_y,
 	                    int spr_x,
@@ -90,13 +129,15 @@ namespace pico_private {
 		if (!is_visible(scr_x, scr_y, spr_w, spr_h))
 			return;
 
+		const GraphicsState& gs = *gfx_state->currentGraphicsState;
+
 		int scr_w = spr_w;
 		int scr_h = spr_h;
 
 		// left clip
-		if (scr_x < currentGraphicsState->clip_x1) {
-			int nclip = currentGraphicsState->clip_x1 - scr_x;
-			scr_x = currentGraphicsState->clip_x1;
+		if (scr_x < gs.clip_x1) {
+			int nclip = gs.clip_x1 - scr_x;
+			scr_x = gs.clip_x1;
 			scr_w -= nclip;
 			if (!flip_x) {
 				spr_x += nclip;
@@ -106,15 +147,15 @@ namespace pico_private {
 		}
 
 		// right clip
-		if (scr_x + scr_w > currentGraphicsState->clip_x2) {
-			int nclip = (scr_x + scr_w) - currentGraphicsState->clip_x2;
+		if (scr_x + scr_w > gs.clip_x2) {
+			int nclip = (scr_x + scr_w) - gs.clip_x2;
 			scr_w -= nclip;
 		}
 
 		// top clip
-		if (scr_y < currentGraphicsState->clip_y1) {
-			int nclip = currentGraphicsState->clip_y1 - scr_y;
-			scr_y = currentGraphicsState->clip_y1;
+		if (scr_y < gs.clip_y1) {
+			int nclip = gs.clip_y1 - scr_y;
+			scr_y = gs.clip_y1;
 			scr_h -= nclip;
 			if (!flip_y) {
 				spr_y += nclip;
@@ -124,41 +165,43 @@ namespace pico_private {
 		}
 
 		// bottom clip
-		if (scr_y + scr_h > currentGraphicsState->clip_y2) {
-			int nclip = (scr_y + scr_h) - currentGraphicsState->clip_y2;
+		if (scr_y + scr_h > gs.clip_y2) {
+			int nclip = (scr_y + scr_h) - gs.clip_y2;
 			scr_h -= nclip;
 		}
 
+		charge_blit(scr_w * scr_h);
+
 		int dy = 1;
 		if (flip_y) {
 			spr_y += spr_h - 1;
 			dy = -dy;
 		}
 
-		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		colour_t* pix = gfx_state->backbuffer + scr_y * gfx_state->buffer_size_x + scr_x;
 		for (int y = 0; y < scr_h; y++) {
-			colour_t* spr = spritebuffer + ((spr_y + y * dy) & 0x7f) * 128;
+			colour_t* spr = srcbuffer + ((spr_y + y * dy) & 0x7f) * 128;
 
 			if (!flip_x) {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[(spr_x + x) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs.transparent[c]) {
+						pix[x] = gs.palette_map[c];
 					}
 				}
 			} else {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[(spr_x + spr_w - x - 1) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs.transparent[c]) {
+						pix[x] = gs.palette_map[c];
 					}
 				}
 			}
-			pix += buffer_size_x;
+			pix += gfx_state->buffer_size_x;
 		}
 	}
 
-	static void stretch_blitter(colour_t* spritebuffer,
+	static void stretch_blitter(colour_t* srcbuffer,
 	                            int spr_x,
 	                            int spr_y,
 	                            int spr_w,
@@ -171,13 +214,15 @@ namespace pico_private {
 	                            bool flip_y = false) {
 		if (spr_h == scr_h && spr_w == scr_w) {
 			// use faster non stretch blitter if sprite is not stretched
-			blitter(spritebuffer, scr_x, scr_y, spr_x, spr_y, scr_w, scr_h, flip_x, flip_y);
+			blitter(srcbuffer, scr_x, scr_y, spr_x, spr_y, scr_w, scr_h, flip_x, flip_y);
 			return;
 		}
 
 		if (!is_visible(scr_x, scr_y, scr_w, scr_h))
 			return;
 
+		const GraphicsState& gs = *gfx_state->currentGraphicsState;
+
 		spr_x = spr_x << 16;
 		spr_y = spr_y << 16;
 		spr_w = spr_w << 16;
@@ -187,9 +232,9 @@ namespace pico_private {
 		int dy = spr_h / scr_h;
 
 		// left clip
-		if (scr_x < currentGraphicsState->clip_x1) {
-			int nclip = currentGraphicsState->clip_x1 - scr_x;
-			scr_x = currentGraphicsState->clip_x1;
+		if (scr_x < gs.clip_x1) {
+			int nclip = gs.clip_x1 - scr_x;
+			scr_x = gs.clip_x1;
 			scr_w -= nclip;
 			if (!flip_x) {
 				spr_x += nclip * dx;
@@ -199,15 +244,15 @@ namespace pico_private {
 		}
 
 		// right clip
-		if (scr_x + scr_w > currentGraphicsState->clip_x2) {
-			int nclip = (scr_x + scr_w) - currentGraphicsState->clip_x2;
+		if (scr_x + scr_w > gs.clip_x2) {
+			int nclip = (scr_x + scr_w) - gs.clip_x2;
 			scr_w -= nclip;
 		}
 
 		// top clip
-		if (scr_y < currentGraphicsState->clip_y1) {
-			int nclip = currentGraphicsState->clip_y1 - scr_y;
-			scr_y = currentGraphicsState->clip_y1;
+		if (scr_y < gs.clip_y1) {
+			int nclip = gs.clip_y1 - scr_y;
+			scr_y = gs.clip_y1;
 			scr_h -= nclip;
 			if (!flip_y) {
 				spr_y += nclip * dy;
@@ -217,56 +262,59 @@ namespace pico_private {
 		}
 
 		// bottom clip
-		if (scr_y + scr_h > currentGraphicsState->clip_y2) {
-			int nclip = (scr_y + scr_h) - currentGraphicsState->clip_y2;
+		if (scr_y + scr_h > gs.clip_y2) {
+			int nclip = (scr_y + scr_h) - gs.clip_y2;
 			scr_h -= nclip;
 		}
 
+		charge_blit(scr_w * scr_h);
+
 		if (flip_y) {
 			spr_y += spr_h - 1 * dy;
 			dy = -dy;
 		}
 
-		colour_t* pix = backbuffer + scr_y * buffer_size_x + scr_x;
+		colour_t* pix = gfx_state->backbuffer + scr_y * gfx_state->buffer_size_x + scr_x;
 		for (int y = 0; y < scr_h; y++) {
-			colour_t* spr = spritebuffer + (((spr_y + y * dy) >> 16) & 0x7f) * 128;
+			colour_t* spr = srcbuffer + (((spr_y + y * dy) >> 16) & 0x7f) * 128;
 
 			if (!flip_x) {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[((spr_x + x * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs.transparent[c]) {
+						pix[x] = gs.palette_map[c];
 					}
 				}
 			} else {
 				for (int x = 0; x < scr_w; x++) {
 					colour_t c = spr[((spr_x + spr_w - (x + 1) * dx) >> 16) & 0x7f];
-					if (!currentGraphicsState->transparent[c]) {
-						pix[x] = currentGraphicsState->palette_map[c];
+					if (!gs.transparent[c]) {
+						pix[x] = gs.palette_map[c];
 					}
 				}
 			}
-			pix += buffer_size_x;
+			pix += gfx_state->buffer_size_x;
 		}
 	}
 
 	static int clip_rect(int& x0, int& y0, int& x1, int& y1) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
 		int flags = 0;
 
-		if (x0 < currentGraphicsState->clip_x1) {
-			x0 = currentGraphicsState->clip_x1;
+		if (x0 < gs->clip_x1) {
+			x0 = gs->clip_x1;
 			flags |= 1;
 		}
-		if (y0 < currentGraphicsState->clip_y1) {
-			y0 = currentGraphicsState->clip_y1;
+		if (y0 < gs->clip_y1) {
+			y0 = gs->clip_y1;
 			flags |= 2;
 		}
-		if (x1 >= currentGraphicsState->clip_x2) {
-			x1 = currentGraphicsState->clip_x2 - 1;
+		if (x1 >= gs->clip_x2) {
+			x1 = gs->clip_x2 - 1;
 			flags |= 4;
 		}
-		if (y1 >= currentGraphicsState->clip_y2) {
-			y1 = currentGraphicsState->clip_y2 - 1;
+		if (y1 >= gs->clip_y2) {
+			y1 = gs->clip_y2 - 1;
 			flags |= 8;
 		}
 		return 0;
@@ -278,20 +326,22 @@ namespace pico_private {
 	}
 
 	void hline(int x0, int x1, int y) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
 		normalise_coords(x0, x1);
 		x1++;
-		if (y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+		if (y < gs->clip_y1 || y >= gs->clip_y2) {
 			return;
 		}
-		x0 = utils::limit(x0, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
-		x1 = utils::limit(x1, currentGraphicsState->clip_x1, currentGraphicsState->clip_x2);
+		x0 = utils::limit(x0, gs->clip_x1, gs->clip_x2);
+		x1 = utils::limit(x1, gs->clip_x1, gs->clip_x2);
+		charge_fill(x1 - x0);
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
 
-		colour_t* pix = backbuffer + y * buffer_size_x;
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t* pix = gfx_state->backbuffer + y * gfx_state->buffer_size_x;
+		uint16_t pat = gs->pattern;
+		bool pattr = gs->pattern_transparent;
 
 		if (pat == 0) {
 			memset(pix + x0, fg, x1 - x0);
@@ -313,46 +363,50 @@ namespace pico_private {
 	}
 
 	void vline(int y0, int y1, int x) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		if (x < gs->clip_x1 || x >= gs->clip_x2) {
 			return;
 		}
 
-		y0 = utils::limit(y0, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
-		y1 = utils::limit(y1, currentGraphicsState->clip_y1, currentGraphicsState->clip_y2);
+		y0 = utils::limit(y0, gs->clip_y1, gs->clip_y2);
+		y1 = utils::limit(y1, gs->clip_y1, gs->clip_y2);
+		charge_fill(y1 - y0);
 
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
+		colour_t* pix = gfx_state->backbuffer + y0 * gfx_state->buffer_size_x;
 
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
+		uint16_t pat = gs->pattern;
+		bool pattr = gs->pattern_transparent;
 
 		if (pattr) {
 			for (int y = y0; y < y1; y++) {
 				if (((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) == 0) {
 					pix[x] = fg;
 				}
-				pix += buffer_size_x;
+				pix += gfx_state->buffer_size_x;
 			}
 		} else {
 			for (int y = y0; y < y1; y++) {
 				pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? bg : fg;
-				pix += buffer_size_x;
+				pix += gfx_state->buffer_size_x;
 			}
 		}
 	}
 
 	void pset(int x, int y) {
-		if (x < currentGraphicsState->clip_x1 || x >= currentGraphicsState->clip_x2 ||
-		    y < currentGraphicsState->clip_y1 || y >= currentGraphicsState->clip_y2) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		if (x < gs->clip_x1 || x >= gs->clip_x2 ||
+		    y < gs->clip_y1 || y >= gs->clip_y2) {
 			return;
 		}
+		charge_fill(1);
 
-		colour_t* pix = backbuffer + y * buffer_size_x + x;
-		uint16_t pat = currentGraphicsState->pattern;
-		colour_t fg = currentGraphicsState->palette_map[currentGraphicsState->fg];
-		colour_t bg = currentGraphicsState->palette_map[currentGraphicsState->bg];
-		bool pattr = currentGraphicsState->pattern_transparent;
+		colour_t* pix = gfx_state->backbuffer + y * gfx_state->buffer_size_x + x;
+		uint16_t pat = gs->pattern;
+		colour_t fg = gs->palette_map[gs->fg];
+		colour_t bg = gs->palette_map[gs->bg];
+		bool pattr = gs->pattern_transparent;
 
 		if (pat == 0) {
 			*pix = fg;
@@ -370,12 +424,12 @@ namespace pico_private {
 	}
 
 	void apply_camera(int& x, int& y) {
-		x = x - currentGraphicsState->camera_x;
-		y = y - currentGraphicsState->camera_y;
+		x = x - gfx_state->currentGraphicsState->camera_x;
+		y = y - gfx_state->currentGraphicsState->camera_y;
 	}
 
 	inline colour_t fgcolor(uint16_t c) {
-		if (currentGraphicsState->extendedPalette) {
+		if (gfx_state->currentGraphicsState->extendedPalette) {
 			return c & 0xff;
 		} else {
 			return c & 0xf;
@@ -383,7 +437,7 @@ namespace pico_private {
 	}
 
 	inline colour_t bgcolor(uint16_t c) {
-		if (currentGraphicsState->extendedPalette) {
+		if (gfx_state->currentGraphicsState->extendedPalette) {
 			return c >> 8;
 		} else {
 			return (c >> 4) & 0xf;
@@ -394,16 +448,18 @@ namespace pico_private {
 
 namespace pico_api {
 	void color(uint16_t c) {
-		currentGraphicsState->fg = pico_private::fgcolor(c);
-		currentGraphicsState->bg = pico_private::bgcolor(c);
+		gfx_state->currentGraphicsState->fg = pico_private::fgcolor(c);
+		gfx_state->currentGraphicsState->bg = pico_private::bgcolor(c);
 	}
 
 	void cls(colour_t c) {
-		colour_t p = currentGraphicsState->palette_map[c];
-		memset(backbuffer, p, buffer_size_x * buffer_size_y);
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		colour_t p = gs->palette_map[c];
+		memset(gfx_state->backbuffer, p, gfx_state->buffer_size_x * gfx_state->buffer_size_y);
+		pico_private::charge_fill(gfx_state->buffer_size_x * gfx_state->buffer_size_y);
 
-		currentGraphicsState->text_x = 0;
-		currentGraphicsState->text_y = 0;
+		gs->text_x = 0;
+		gs->text_y = 0;
 	}
 
 	void cls() {
@@ -411,7 +467,7 @@ namespace pico_api {
 	}
 
 	uint8_t fget(int n) {
-		return spriteflags[n & 0xff];
+		return gfx_state->spriteflags[n & 0xff];
 	}
 
 	bool fget(int n, int bit) {
@@ -419,7 +475,7 @@ namespace pico_api {
 	}
 
 	void fset(int n, uint8_t val) {
-		spriteflags[n & 0xff] = val;
+		gfx_state->spriteflags[n & 0xff] = val;
 	}
 
 	void fset(int n, int bit, bool val) {
@@ -442,47 +498,49 @@ namespace pico_api {
 
 		int spr_x = (n % 16) * 8;
 		int spr_y = (n / 16) * 8;
-		pico_private::blitter(spritebuffer, x, y, spr_x, spr_y, w * 8, h * 8, flip_x, flip_y);
+		pico_private::blitter(gfx_state->spritebuffer, x, y, spr_x, spr_y, w * 8, h * 8, flip_x,
+		                      flip_y);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::blitter(spritebuffer, dx, dy, sx, sy, sw, sh);
+		pico_private::blitter(gfx_state->spritebuffer, dx, dy, sx, sy, sw, sh);
 	}
 
 	void sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh);
+		pico_private::stretch_blitter(gfx_state->spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh);
 	}
 
 	void
 	sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh, bool flip_x, bool flip_y) {
 		pico_private::apply_camera(dx, dy);
-		pico_private::stretch_blitter(spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh, flip_x, flip_y);
+		pico_private::stretch_blitter(gfx_state->spritebuffer, sx, sy, sw, sh, dx, dy, dw, dh,
+		                              flip_x, flip_y);
 	}
 
 	colour_t sget(int x, int y) {
 		y &= 0x7f;
 		x &= 0x7f;
-		return spritebuffer[y * 128 + x];
+		return gfx_state->spritebuffer[y * 128 + x];
 	}
 
 	void sset(int x, int y) {
-		sset(x, y, currentGraphicsState->fg);
+		sset(x, y, gfx_state->currentGraphicsState->fg);
 	}
 
 	void sset(int x, int y, colour_t c) {
 		y &= 0x7f;
 		x &= 0x7f;
-		spritebuffer[y * 128 + x] = c;
+		gfx_state->spritebuffer[y * 128 + x] = c;
 	}
 
 	void pset(int x, int y) {
-		pset(x, y, currentGraphicsState->fg);
+		pset(x, y, gfx_state->currentGraphicsState->fg);
 	}
 
 	void pset(int x, int y, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx_state->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		color(c);
@@ -494,15 +552,15 @@ namespace pico_api {
 		pico_private::apply_camera(x, y);
 		x &= 0x7f;
 		y &= 0x7f;
-		return backbuffer[y * buffer_size_x + x];
+		return gfx_state->backbuffer[y * gfx_state->buffer_size_x + x];
 	}
 
 	void rect(int x0, int y0, int x1, int y1) {
-		rect(x0, y0, x1, y1, currentGraphicsState->fg);
+		rect(x0, y0, x1, y1, gfx_state->currentGraphicsState->fg);
 	}
 
 	void rect(int x0, int y0, int x1, int y1, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx_state->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(x0, y0);
@@ -517,12 +575,13 @@ namespace pico_api {
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1) {
-		rectfill(x0, y0, x1, y1, currentGraphicsState->fg);
+		rectfill(x0, y0, x1, y1, gfx_state->currentGraphicsState->fg);
 	}
 
 	void rectfill(int x0, int y0, int x1, int y1, uint16_t c, uint16_t p) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
 		using namespace pico_private;
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gs->pattern_with_colour) {
 			fillp(p, false);
 		}
 
@@ -533,12 +592,15 @@ namespace pico_api {
 		pico_private::normalise_coords(y0, y1);
 
 		pico_private::clip_rect(x0, y0, x1, y1);
-		colour_t* pix = backbuffer + y0 * buffer_size_x;
-		colour_t p1 = currentGraphicsState->palette_map[fgcolor(c)];
-		colour_t p2 = currentGraphicsState->palette_map[bgcolor(c)];
+		if (x1 >= x0) {
+			pico_private::charge_fill((x1 - x0 + 1) * (y1 - y0 + 1));
+		}
+		colour_t* pix = gfx_state->backbuffer + y0 * gfx_state->buffer_size_x;
+		colour_t p1 = gs->palette_map[fgcolor(c)];
+		colour_t p2 = gs->palette_map[bgcolor(c)];
 
-		uint16_t pat = currentGraphicsState->pattern;
-		bool pattr = currentGraphicsState->pattern_transparent;
+		uint16_t pat = gs->pattern;
+		bool pattr = gs->pattern_transparent;
 
 		if (pattr) {
 			for (int y = y0; y <= y1; y++) {
@@ -547,24 +609,24 @@ namespace pico_api {
 						pix[x] = p1;
 					}
 				}
-				pix += buffer_size_x;
+				pix += gfx_state->buffer_size_x;
 			}
 		} else {
 			for (int y = y0; y <= y1; y++) {
 				for (int x = x0; x <= x1; x++) {
 					pix[x] = ((pat >> ((3 - (x & 0x3)) + (3 - (y & 0x3)) * 4)) & 1) ? p2 : p1;
 				}
-				pix += buffer_size_x;
+				pix += gfx_state->buffer_size_x;
 			}
 		}
 	}
 
 	void circ(int x, int y, int r) {
-		circ(x, y, r, currentGraphicsState->fg);
+		circ(x, y, r, gfx_state->currentGraphicsState->fg);
 	}
 
 	void circ(int xm, int ym, int r, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx_state->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(xm, ym);
@@ -586,11 +648,11 @@ namespace pico_api {
 	}
 
 	void circfill(int x, int y, int r) {
-		circfill(x, y, r, currentGraphicsState->fg);
+		circfill(x, y, r, gfx_state->currentGraphicsState->fg);
 	}
 
 	void circfill(int xm, int ym, int r, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		if (gfx_state->currentGraphicsState->pattern_with_colour) {
 			fillp(pat, false);
 		}
 		pico_private::apply_camera(xm, ym);
@@ -616,20 +678,22 @@ namespace pico_api {
 	}
 
 	void line(int x, int y) {
-		line(currentGraphicsState->line_x, currentGraphicsState->line_y, x, y,
-		     currentGraphicsState->fg);
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		line(gs->line_x, gs->line_y, x, y,
+		     gs->fg);
 	}
 
 	void line(int x0, int y0, int x1, int y1) {
-		line(x0, y0, x1, y1, currentGraphicsState->fg);
+		line(x0, y0, x1, y1, gfx_state->currentGraphicsState->fg);
 	}
 
 	void line(int x0, int y0, int x1, int y1, uint16_t c, uint16_t pat) {
-		if (currentGraphicsState->pattern_with_colour) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		if (gs->pattern_with_colour) {
 			fillp(pat, false);
 		}
-		currentGraphicsState->line_x = x1;
-		currentGraphicsState->line_y = y1;
+		gs->line_x = x1;
+		gs->line_y = y1;
 		pico_private::apply_camera(x0, y0);
 		pico_private::apply_camera(x1, y1);
 		color(c);
@@ -679,23 +743,23 @@ namespace pico_api {
 	uint8_t mget(int x, int y) {
 		x &= 0x7f;
 		y &= 0x3f;
-		return mapbuffer[y * 128 + x];
+		return gfx_state->mapbuffer[y * 128 + x];
 	}
 
 	void mset(int x, int y, uint8_t v) {
 		x &= 0x7f;
 		y &= 0x3f;
-		mapbuffer[y * 128 + x] = v;
+		gfx_state->mapbuffer[y * 128 + x] = v;
 	}
 
 	void pal(colour_t c0, colour_t c1, int p) {
 		if (p) {
-			if (!currentGraphicsState->extendedPalette) {
+			if (!gfx_state->currentGraphicsState->extendedPalette) {
 				c1 = (c1 & 0xf) | ((c1 & 0xf0) >> 3);
 			}
 			GFX_MapPaletteIndex(c0, c1);
 		} else {
-			currentGraphicsState->palette_map[c0 & 0xf] = c1 & 0xf;
+			gfx_state->currentGraphicsState->palette_map[c0 & 0xf] = c1 & 0xf;
 		}
 	}
 
@@ -709,7 +773,7 @@ namespace pico_api {
 	}
 
 	void palt(colour_t col, bool t) {
-		currentGraphicsState->transparent[col] = t;
+		gfx_state->currentGraphicsState->transparent[col] = t;
 	}
 
 	void palt() {
@@ -717,74 +781,79 @@ namespace pico_api {
 	}
 
 	void cursor(int x, int y) {
-		currentGraphicsState->text_x = x;
-		currentGraphicsState->text_y = y;
+		gfx_state->currentGraphicsState->text_x = x;
+		gfx_state->currentGraphicsState->text_y = y;
 	}
 
 	void cursor(int x, int y, uint16_t c) {
 		color(c);
-		currentGraphicsState->text_x = x;
-		currentGraphicsState->text_y = y;
+		gfx_state->currentGraphicsState->text_x = x;
+		gfx_state->currentGraphicsState->text_y = y;
 	}
 
 	void print(std::string str) {
-		print(str, currentGraphicsState->text_x, currentGraphicsState->text_y);
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		print(str, gs->text_x, gs->text_y);
 	}
 
 	void print(std::string str, int x, int y) {
-		print(str, x, y, currentGraphicsState->fg);
+		print(str, x, y, gfx_state->currentGraphicsState->fg);
 	}
 
 	int print(std::string str, int x, int y, uint16_t c) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
 		pico_private::apply_camera(x, y);
 		color(c);
 
-		colour_t old = currentGraphicsState->palette_map[7];
-		bool oldt = currentGraphicsState->transparent[0];
+		colour_t old = gs->palette_map[7];
+		bool oldt = gs->transparent[0];
 
-		currentGraphicsState->palette_map[7] = currentGraphicsState->fg;
-		currentGraphicsState->transparent[0] = true;
+		gs->palette_map[7] = gs->fg;
+		gs->transparent[0] = true;
 
-		currentGraphicsState->text_x = x;
+		gs->text_x = x;
 
 		for (size_t n = 0; n < str.length(); n++) {
 			uint8_t ch = str[n];
 			if (ch >= 0x10 && ch < 0x80) {
 				int index = ch - 0x10;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8, 4, 5);
+				pico_private::blitter(gfx_state->fontbuffer, x, y, (index % 16) * 8,
+				                      (index / 16) * 8, 4, 5);
 				x += 4;
 			} else if (ch >= 0x80) {
 				int index = ch - 0x80;
-				pico_private::blitter(fontbuffer, x, y, (index % 16) * 8, (index / 16) * 8 + 56, 8,
-				                      5);
+				pico_private::blitter(gfx_state->fontbuffer, x, y, (index % 16) * 8,
+				                      (index / 16) * 8 + 56, 8, 5);
 				x += 8;
 			} else if (ch == '\n') {
-				x = currentGraphicsState->text_x;
+				x = gs->text_x;
 				y += 6;
 			}
 		}
 
-		currentGraphicsState->text_x = 0;
-		currentGraphicsState->text_y = y + 6;
+		gs->text_x = 0;
+		gs->text_y = y + 6;
 
-		currentGraphicsState->palette_map[7] = old;
-		currentGraphicsState->transparent[0] = oldt;
+		gs->palette_map[7] = old;
+		gs->transparent[0] = oldt;
 
-		currentGraphicsState->fg = c & 0xf;
+		gs->fg = c & 0xf;
 		return x;
 	}
 
 	void clip(int x, int y, int w, int h) {
+		GraphicsState* gs = gfx_state->currentGraphicsState;
 		using namespace pico_private;
 
-		currentGraphicsState->clip_x1 = utils::limit(x, 0, buffer_size_x);
-		currentGraphicsState->clip_y1 = utils::limit(y, 0, buffer_size_y);
-		currentGraphicsState->clip_x2 = utils::limit(x + w, 0, buffer_size_x);
-		currentGraphicsState->clip_y2 = utils::limit(y + h, 0, buffer_size_y);
+		gs->clip_x1 = utils::limit(x, 0, gfx_state->buffer_size_x);
+		gs->clip_y1 = utils::limit(y, 0, gfx_state->buffer_size_y);
+		gs->clip_x2 = utils::limit(x + w, 0, gfx_state->buffer_size_x);
+		gs->clip_y2 = utils::limit(y + h, 0, gfx_state->buffer_size_y);
 	}
 
 	void clip() {
-		clip(0, 0, currentGraphicsState->max_clip_x, currentGraphicsState->max_clip_y);
+		GraphicsState* gs = gfx_state->currentGraphicsState;
+		clip(0, 0, gs->max_clip_x, gs->max_clip_y);
 	}
 
 	void camera() {
@@ -792,8 +861,8 @@ namespace pico_api {
 	}
 
 	void camera(int x, int y) {
-		currentGraphicsState->camera_x = x;
-		currentGraphicsState->camera_y = y;
+		gfx_state->currentGraphicsState->camera_x = x;
+		gfx_state->currentGraphicsState->camera_y = y;
 	}
 
 	void fillp() {
@@ -801,12 +870,12 @@ namespace pico_api {
 	}
 
 	void fillp(int pattern, bool transparent) {
-		currentGraphicsState->pattern = pattern;
-		currentGraphicsState->pattern_transparent = transparent;
+		gfx_state->currentGraphicsState->pattern = pattern;
+		gfx_state->currentGraphicsState->pattern_transparent = transparent;
 	}
 
 	uint8_t gfx_peek(uint16_t a) {
-		auto cg = currentGraphicsState;
+		auto cg = gfx_state->currentGraphicsState;
 		if (a >= 0x5f00 && a <= 0x5f0f) {  // pal
 			if (cg->extendedPalette) {
 				return cg->palette_map[a - 0x5f00];
@@ -875,7 +944,7 @@ namespace pico_api {
 	}
 
 	void gfx_poke(uint16_t a, uint8_t v) {
-		auto cg = currentGraphicsState;
+		auto cg = gfx_state->currentGraphicsState;
 
 		if (a >= 0x5f00 && a <= 0x5f0f) {
 			pico_api::pal(a - 0x5f00, v);
@@ -967,27 +1036,28 @@ namespace pico_api {
 namespace pico_apix {
 
 	void xpal(bool enable) {
-		currentGraphicsState->extendedPalette = enable;
+		gfx_state->currentGraphicsState->extendedPalette = enable;
 	}
 
 	void gfxstate(int index) {
-		if (extendedGraphicsStates.find(index) == extendedGraphicsStates.end()) {
-			currentGraphicsState = &extendedGraphicsStates[index];
-			GraphicsState* gs = currentGraphicsState;
+		auto& states = gfx_state->extendedGraphicsStates;
+		if (states.find(index) == states.end()) {
+			gfx_state->currentGraphicsState = &states[index];
+			GraphicsState* gs = gfx_state->currentGraphicsState;
 			pico_private::restore_transparency();
 			pico_private::restore_palette();
-			gs->max_clip_x = buffer_size_x;
-			gs->max_clip_y = buffer_size_y;
+			gs->max_clip_x = gfx_state->buffer_size_x;
+			gs->max_clip_y = gfx_state->buffer_size_y;
 			pico_api::clip();
 		} else {
-			currentGraphicsState = &extendedGraphicsStates[index];
-			GraphicsState* gs = currentGraphicsState;
-			gs->clip_x1 = utils::limit(gs->clip_x1, 0, buffer_size_x);
-			gs->clip_y1 = utils::limit(gs->clip_y1, 0, buffer_size_y);
-			gs->clip_x2 = utils::limit(gs->clip_x2, 0, buffer_size_x);
-			gs->clip_y2 = utils::limit(gs->clip_y2, 0, buffer_size_y);
-			gs->max_clip_x = utils::limit(gs->max_clip_x, 0, buffer_size_x);
-			gs->max_clip_y = utils::limit(gs->max_clip_y, 0, buffer_size_y);
+			gfx_state->currentGraphicsState = &states[index];
+			GraphicsState* gs = gfx_state->currentGraphicsState;
+			gs->clip_x1 = utils::limit(gs->clip_x1, 0, gfx_state->buffer_size_x);
+			gs->clip_y1 = utils::limit(gs->clip_y1, 0, gfx_state->buffer_size_y);
+			gs->clip_x2 = utils::limit(gs->clip_x2, 0, gfx_state->buffer_size_x);
+			gs->clip_y2 = utils::limit(gs->clip_y2, 0, gfx_state->buffer_size_y);
+			gs->max_clip_x = utils::limit(gs->max_clip_x, 0, gfx_state->buffer_size_x);
+			gs->max_clip_y = utils::limit(gs->max_clip_y, 0, gfx_state->buffer_size_y);
 		}
 	}
 
@@ -997,40 +1067,45 @@ namespace pico_apix {
 				str[n] = 25;
 			}
 		}
-		return std::make_pair(pico_api::print(str, x, y, c), currentGraphicsState->text_y);
+		int width = pico_api::print(str, x, y, c);
+		return std::make_pair(width, gfx_state->currentGraphicsState->text_y);
 	}
 }  // namespace pico_apix
 
 namespace pico_control {
 
 	void gfx_init() {
-		extendedGraphicsStates.clear();
+		gfx_state->extendedGraphicsStates.clear();
 		pico_apix::gfxstate(0);
 	}
 
 	void set_backbuffer(pico_api::colour_t* buffer, int width, int height, int stride) {
-		backbuffer = buffer;
-		buffer_size_x = width;
-		buffer_size_y = height;
-		buffer_stride = stride;
-		currentGraphicsState->max_clip_x = width;
-		currentGraphicsState->max_clip_y = height;
+		gfx_state->backbuffer = buffer;
+		gfx_state->buffer_size_x = width;
+		gfx_state->buffer_size_y = height;
+		gfx_state->buffer_stride = stride;
+		gfx_state->currentGraphicsState->max_clip_x = width;
+		gfx_state->currentGraphicsState->max_clip_y = height;
 	}
 
 	void set_spritebuffer(pico_api::colour_t* buffer) {
-		spritebuffer = buffer;
+		gfx_state->spritebuffer = buffer;
 	}
 
 	void set_spriteflags(uint8_t* buffer) {
-		spriteflags = buffer;
+		gfx_state->spriteflags = buffer;
 	}
 
 	void set_mapbuffer(uint8_t* buffer) {
-		mapbuffer = buffer;
+		gfx_state->mapbuffer = buffer;
 	}
 
 	void set_fontbuffer(pico_api::colour_t* buffer) {
-		fontbuffer = buffer;
+		gfx_state->fontbuffer = buffer;
+	}
+
+	uint64_t gfx_cpu_cycles() {
+		return gfx_state->cpuCost / 16;
 	}
 
 }  // namespace pico_control
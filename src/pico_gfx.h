@@ -95,6 +95,8 @@ namespace pico_control {
 	void set_spriteflags(uint8_t* buffer);
 	void set_mapbuffer(uint8_t* buffer);
 	void set_fontbuffer(pico_api::colour_t* buffer);
+	// virtual cpu cycles spent drawing since the instance was created
+	uint64_t gfx_cpu_cycles();
 }  // namespace pico_control
 
 #endif /* PICO_GFX_H */
@@ -0,0 +1,65 @@
+#include "pico_instance.h"
+
+#include "hal_audio.h"
+#include "hal_core.h"
+#include "log.h"
+#include "pico_script.h"
+
+static thread_local pico_control::Instance* currentInstance = nullptr;
+
+namespace pico_control {
+
+	Instance::Instance() {
+		TraceFunction();
+		m_cart = pico_private::cart_create_state();
+		m_core = pico_private::core_create_state();
+		m_gfx = pico_private::gfx_create_state();
+		m_audio = pico_private::audio_create_state();
+		m_script = pico_private::script_create_state();
+		m_channels = AUDIO_CreateChannels();
+		m_palette = GFX_CreatePalette();
+	}
+
+	Instance::~Instance() {
+		TraceFunction();
+		{
+			InstanceScope scope(*this);
+			pico_script::unload_scripting();
+		}
+		AUDIO_DestroyChannels(m_channels);
+		GFX_DestroyPalette(m_palette);
+		pico_private::script_destroy_state(m_script);
+		pico_private::audio_destroy_state(m_audio);
+		pico_private::gfx_destroy_state(m_gfx);
+		pico_private::core_destroy_state(m_core);
+		pico_private::cart_destroy_state(m_cart);
+	}
+
+	void bind_instance(Instance* instance) {
+		currentInstance = instance;
+		pico_private::cart_bind_state(instance ? instance->m_cart : nullptr);
+		pico_private::core_bind_state(instance ? instance->m_core : nullptr);
+		pico_private::gfx_bind_state(instance ? instance->m_gfx : nullptr);
+		pico_private::audio_bind_state(instance ? instance->m_audio : nullptr);
+		pico_private::script_bind_state(instance ? instance->m_script : nullptr);
+		AUDIO_BindChannels(instance ? instance->m_channels : nullptr);
+		GFX_BindPalette(instance ? instance->m_palette : nullptr);
+	}
+
+	Instance* current_instance() {
+		return currentInstance;
+	}
+
+	void set_audio_output(Instance* instance) {
+		AUDIO_SetOutputChannels(instance ? instance->m_channels : nullptr);
+	}
+
+	InstanceScope::InstanceScope(Instance& instance) : m_previous(currentInstance) {
+		bind_instance(&instance);
+	}
+
+	InstanceScope::~InstanceScope() {
+		bind_instance(m_previous);
+	}
+
+}  // namespace pico_control
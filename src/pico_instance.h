@@ -0,0 +1,89 @@
+#ifndef PICO_INSTANCE_H
+#define PICO_INSTANCE_H
+
+struct AudioChannels;
+struct GfxPalette;
+
+namespace pico_private {
+	// each module owns the definition of its state. the state used by the module is the one
+	// bound to the calling thread.
+	struct CartState;
+	struct CoreState;
+	struct GfxState;
+	struct AudioState;
+	struct ScriptState;
+
+	CartState* cart_create_state();
+	void cart_destroy_state(CartState* s);
+	void cart_bind_state(CartState* s);
+
+	CoreState* core_create_state();
+	void core_destroy_state(CoreState* s);
+	void core_bind_state(CoreState* s);
+
+	GfxState* gfx_create_state();
+	void gfx_destroy_state(GfxState* s);
+	void gfx_bind_state(GfxState* s);
+
+	AudioState* audio_create_state();
+	void audio_destroy_state(AudioState* s);
+	void audio_bind_state(AudioState* s);
+
+	ScriptState* script_create_state();
+	void script_destroy_state(ScriptState* s);
+	void script_bind_state(ScriptState* s);
+}  // namespace pico_private
+
+namespace pico_control {
+
+	// everything needed to run one cart: lua state, ram, graphics state, screen palette, audio
+	// channels and the loaded cart. the pico_api / pico_control functions operate on the
+	// instance bound to the calling thread, so separate instances can run concurrently on
+	// separate threads. an instance must only be bound to one thread at a time.
+	// deliberately shared by all instances, and only changed from the main thread:
+	// - options set from the command line, such as set_sfx_wavs() and allow_cart_plugins()
+	// - the hal_core window, renderer and zoom, there is one display per process
+	// - the native plugin registry, a plugin library is loaded once into the process
+	// - the wav cache, which is safe to use from any thread
+	// instances running the same cart can share it with pico_cart::setCart(cart) followed by
+	// pico_control::restartCart() instead of each loading it.
+	class Instance {
+	   public:
+		Instance();
+		~Instance();
+		Instance(const Instance&) = delete;
+		Instance& operator=(const Instance&) = delete;
+
+	   private:
+		friend void bind_instance(Instance* instance);
+		friend void set_audio_output(Instance* instance);
+
+		pico_private::CartState* m_cart;
+		pico_private::CoreState* m_core;
+		pico_private::GfxState* m_gfx;
+		pico_private::AudioState* m_audio;
+		pico_private::ScriptState* m_script;
+		AudioChannels* m_channels;
+		GfxPalette* m_palette;
+	};
+
+	void bind_instance(Instance* instance);
+	Instance* current_instance();
+	// the instance whose audio channels are played on the audio device, nullptr for none
+	void set_audio_output(Instance* instance);
+
+	// binds an instance to the calling thread for the lifetime of the scope
+	class InstanceScope {
+	   public:
+		explicit InstanceScope(Instance& instance);
+		~InstanceScope();
+		InstanceScope(const InstanceScope&) = delete;
+		InstanceScope& operator=(const InstanceScope&) = delete;
+
+	   private:
+		Instance* m_previous;
+	};
+
+}  // namespace pico_control
+
+#endif /* PICO_INSTANCE_H */
@@ -0,0 +1,308 @@
+#include "pico_plugin.h"
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <vector>
+
+#include "log.h"
+#include "pico_core.h"
+#include "pico_gfx.h"
+#include "pico_script.h"
+#include "tac08_plugin.h"
+#include "utils.h"
+#include "z8lua/lauxlib.h"
+#include "z8lua/lua.h"
+
+#if defined(_WIN32)
+static const char* PLUGIN_EXT = ".dll";
+#elif defined(__APPLE__)
+static const char* PLUGIN_EXT = ".dylib";
+#else
+static const char* PLUGIN_EXT = ".so";
+#endif
+
+// the only place plugins named by carts are loaded from, relative to the working directory
+static const char* CART_PLUGIN_DIR = "plugins/";
+
+// libraries are loaded once per process and never unloaded, lua states hold pointers to their
+// functions.
+static std::mutex pluginsMutex;
+static std::map<std::string, tac08_plugin_register_fn> loadedPlugins;
+static std::vector<std::string> commandLinePlugins;
+// carts run native code through #plugin only when the user has allowed it
+static bool cartPluginsAllowed = false;
+
+// lua state functions are being registered into, only valid during tac08_plugin_register.
+static thread_local lua_State* registerState = nullptr;
+
+struct NativeFunction {
+	tac08_function func;
+	void* userdata;
+};
+
+namespace pico_private {
+
+	static int call_native(lua_State* ls) {
+		auto nf = (NativeFunction*)lua_touserdata(ls, lua_upvalueindex(1));
+
+		tac08_fix32 args[TAC08_PLUGIN_MAX_ARGS] = {0};
+		int argc = std::min(lua_gettop(ls), TAC08_PLUGIN_MAX_ARGS);
+		for (int n = 0; n < argc; n++) {
+			args[n] = lua_tonumber(ls, n + 1).bits();
+		}
+
+		tac08_fix32 results[TAC08_PLUGIN_MAX_RESULTS];
+		int nresults = nf->func(nf->userdata, argc, args, results);
+		nresults = utils::limit(nresults, 0, TAC08_PLUGIN_MAX_RESULTS);
+		for (int n = 0; n < nresults; n++) {
+			lua_pushnumber(ls, z8::fix32::frombits(results[n]));
+		}
+		return nresults;
+	}
+
+	static void api_register_function(const char* name, tac08_function func, void* userdata) {
+		lua_State* ls = registerState;
+		if (!ls || !name || !func) {
+			logr << LogLevel::err << "plugin register_function called outside of registration";
+			return;
+		}
+		lua_getglobal(ls, "__tac08__");
+		auto nf = (NativeFunction*)lua_newuserdata(ls, sizeof(NativeFunction));
+		nf->func = func;
+		nf->userdata = userdata;
+		lua_pushcclosure(ls, call_native, 1);
+		lua_setfield(ls, -2, name);
+		lua_pop(ls, 1);
+	}
+
+	static void api_log(const char* msg) {
+		logr << LogLevel::info << "plugin: " << msg;
+	}
+
+	static void api_cls(uint8_t col) {
+		pico_api::cls(col);
+	}
+
+	static void api_pset(int x, int y, uint16_t col) {
+		pico_api::pset(x, y, col);
+	}
+
+	static uint8_t api_pget(int x, int y) {
+		return pico_api::pget(x, y);
+	}
+
+	static void api_line(int x0, int y0, int x1, int y1, uint16_t col) {
+		pico_api::line(x0, y0, x1, y1, col);
+	}
+
+	static void api_rect(int x0, int y0, int x1, int y1, uint16_t col) {
+		pico_api::rect(x0, y0, x1, y1, col);
+	}
+
+	static void api_rectfill(int x0, int y0, int x1, int y1, uint16_t col) {
+		pico_api::rectfill(x0, y0, x1, y1, col);
+	}
+
+	static void api_circ(int x, int y, int r, uint16_t col) {
+		pico_api::circ(x, y, r, col);
+	}
+
+	static void api_circfill(int x, int y, int r, uint16_t col) {
+		pico_api::circfill(x, y, r, col);
+	}
+
+	static void api_spr(int n, int x, int y, int w, int h, int flip_x, int flip_y) {
+		pico_api::spr(n, x, y, w, h, flip_x != 0, flip_y != 0);
+	}
+
+	static void api_sspr(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh) {
+		pico_api::sspr(sx, sy, sw, sh, dx, dy, dw, dh);
+	}
+
+	static uint8_t api_sget(int x, int y) {
+		return pico_api::sget(x, y);
+	}
+
+	static void api_sset(int x, int y, uint8_t col) {
+		pico_api::sset(x, y, col);
+	}
+
+	static uint8_t api_mget(int x, int y) {
+		return pico_api::mget(x, y);
+	}
+
+	static void api_mset(int x, int y, uint8_t v) {
+		pico_api::mset(x, y, v);
+	}
+
+	static uint8_t api_fget(int n) {
+		return pico_api::fget(n);
+	}
+
+	static void api_fset(int n, uint8_t v) {
+		pico_api::fset(n, v);
+	}
+
+	static uint8_t api_peek(uint16_t addr) {
+		return pico_api::peek(addr);
+	}
+
+	static void api_poke(uint16_t addr, uint8_t v) {
+		pico_api::poke(addr, v);
+	}
+
+	static void api_memcpy(uint16_t dest, uint16_t src, uint16_t len) {
+		pico_api::memory_cpy(dest, src, len);
+	}
+
+	static void api_memset(uint16_t dest, uint8_t v, uint16_t len) {
+		pico_api::memory_set(dest, v, len);
+	}
+
+	static int api_btn(int n, int player) {
+		return pico_api::btn(n, player);
+	}
+
+	static int api_btnp(int n, int player) {
+		return pico_api::btnp(n, player);
+	}
+
+	static const tac08_api plugin_api = {
+	    TAC08_PLUGIN_API_VERSION,
+	    sizeof(tac08_api),
+	    api_register_function,
+	    api_log,
+	    api_cls,
+	    api_pset,
+	    api_pget,
+	    api_line,
+	    api_rect,
+	    api_rectfill,
+	    api_circ,
+	    api_circfill,
+	    api_spr,
+	    api_sspr,
+	    api_sget,
+	    api_sset,
+	    api_mget,
+	    api_mset,
+	    api_fget,
+	    api_fset,
+	    api_peek,
+	    api_poke,
+	    api_memcpy,
+	    api_memset,
+	    api_btn,
+	    api_btnp,
+	};
+
+	static std::string plugin_filename(const std::string& path) {
+		auto name = path::getFilename(path);
+		if (name.find('.') == std::string::npos) {
+			return path + PLUGIN_EXT;
+		}
+		return path;
+	}
+
+	static tac08_plugin_register_fn load_plugin(std::string path) {
+		path = plugin_filename(path);
+
+		std::lock_guard<std::mutex> lock(pluginsMutex);
+		auto i = loadedPlugins.find(path);
+		if (i != loadedPlugins.end()) {
+			return i->second;
+		}
+
+#if defined(_WIN32)
+		HMODULE lib = LoadLibraryA(path.c_str());
+		if (!lib) {
+			throw pico_script::error(std::string("failed to load plugin: ") + path);
+		}
+		auto version =
+		    (tac08_plugin_api_version_fn)GetProcAddress(lib, "tac08_plugin_api_version");
+		auto reg = (tac08_plugin_register_fn)GetProcAddress(lib, "tac08_plugin_register");
+#else
+		void* lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+		if (!lib) {
+			throw pico_script::error(std::string("failed to load plugin: ") + dlerror());
+		}
+		auto version = (tac08_plugin_api_version_fn)dlsym(lib, "tac08_plugin_api_version");
+		auto reg = (tac08_plugin_register_fn)dlsym(lib, "tac08_plugin_register");
+#endif
+
+		// the library is closed again when it cannot be used
+		auto reject = [&](const std::string& msg) {
+#if defined(_WIN32)
+			FreeLibrary(lib);
+#else
+			dlclose(lib);
+#endif
+			throw pico_script::error(msg);
+		};
+		if (!version || !reg) {
+			reject(path + " is not a tac08 plugin");
+		}
+		int required = version();
+		if (required > TAC08_PLUGIN_API_VERSION) {
+			reject(path + " requires plugin api version " + std::to_string(required));
+		}
+
+		logr << "loaded plugin: " << path;
+		loadedPlugins[path] = reg;
+		return reg;
+	}
+
+}  // namespace pico_private
+
+namespace pico_plugin {
+
+	void add_plugin(const std::string& path) {
+		std::lock_guard<std::mutex> lock(pluginsMutex);
+		commandLinePlugins.push_back(path);
+	}
+
+	void allow_cart_plugins(bool allow) {
+		std::lock_guard<std::mutex> lock(pluginsMutex);
+		cartPluginsAllowed = allow;
+	}
+
+	void register_plugins(lua_State* ls, const pico_cart::Cart& cart) {
+		std::vector<std::string> paths;
+		bool allowed;
+		{
+			std::lock_guard<std::mutex> lock(pluginsMutex);
+			paths = commandLinePlugins;
+			allowed = cartPluginsAllowed;
+		}
+		for (auto& name : cart.plugins) {
+			if (!allowed) {
+				logr << LogLevel::err << "ignoring #plugin " << name
+				     << ", start tac08 with --allow-cart-plugins to load it";
+			} else if (name.empty() || name.find_first_of("/\\:") != std::string::npos ||
+			           name.find("..") != std::string::npos) {
+				logr << LogLevel::err << "ignoring #plugin " << name
+				     << ", it must be the name of a library in " << CART_PLUGIN_DIR;
+			} else {
+				paths.push_back(CART_PLUGIN_DIR + name);
+			}
+		}
+
+		for (auto& path : paths) {
+			auto reg = pico_private::load_plugin(path);
+			registerState = ls;
+			int res = reg(&pico_private::plugin_api);
+			registerState = nullptr;
+			if (res != 0) {
+				throw pico_script::error(path + " failed to register: " + std::to_string(res));
+			}
+		}
+	}
+
+}  // namespace pico_plugin
@@ -0,0 +1,25 @@
+#ifndef PICO_PLUGIN_H
+#define PICO_PLUGIN_H
+
+#include <string>
+
+#include "pico_cart.h"
+
+struct lua_State;
+
+namespace pico_plugin {
+
+	// plugin loaded for every cart, from the command line
+	void add_plugin(const std::string& path);
+
+	// lets carts load the plugins they name with #plugin, which are otherwise ignored
+	void allow_cart_plugins(bool allow);
+
+	// loads the command line plugins and, if allowed, those named by the cart from the plugins
+	// directory, then lets each register its functions into the __tac08__ table of ls. throws
+	// pico_script::error if a plugin fails to load.
+	void register_plugins(lua_State* ls, const pico_cart::Cart& cart);
+
+}  // namespace pico_plugin
+
+#endif /* PICO_PLUGIN_H */
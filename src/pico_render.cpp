@@ -0,0 +1,201 @@
+#include "pico_render.h"
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "hal_audio.h"
+#include "hal_wav.h"
+#include "log.h"
+#include "pico_audio.h"
+#include "pico_cart.h"
+#include "pico_synth.h"
+
+namespace {
+	const int SFX_SIZE = 68;
+	const int NUM_SFX = 64;
+	const int NUM_PATTERNS = 64;
+	const int RENDER_BLOCK = 1024;
+	// sfx and songs that never end are cut off here
+	const size_t MAX_SECONDS = 60 * 10;
+
+	struct AudioData {
+		uint8_t music[NUM_PATTERNS * 4];
+		uint8_t sfx[NUM_SFX * SFX_SIZE];
+	};
+
+	struct Track {
+		enum Kind { SFX, PATTERN, SONG };
+		Kind kind;
+		int index;
+		std::string filename;
+	};
+}  // namespace
+
+static bool sfx_empty(const AudioData& data, int n) {
+	const uint8_t* notes = data.sfx + n * SFX_SIZE;
+	for (int i = 0; i < 32; i++) {
+		if ((notes[i * 2 + 1] >> 1) & 7) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool pattern_empty(const AudioData& data, int n) {
+	const uint8_t* p = data.music + n * 4;
+	for (int c = 0; c < 4; c++) {
+		if (!(p[c] & 0x40) && !sfx_empty(data, p[c] & 0x3f)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// a song starts at the first pattern, or after an empty pattern or one that stops the music
+static bool song_start(const AudioData& data, int n) {
+	if (pattern_empty(data, n)) {
+		return false;
+	}
+	return n == 0 || pattern_empty(data, n - 1) || (data.music[(n - 1) * 4 + 2] & 0x80);
+}
+
+// renders blocks from the bound channels into samples until done() returns true
+template <typename Done>
+static void render_until(AudioChannels* channels, std::vector<int16_t>& samples, Done done) {
+	int16_t block[RENDER_BLOCK * 2];
+	while (samples.size() < (size_t)AUDIO_Frequency() * MAX_SECONDS * 2) {
+		AUDIO_RenderChannels(channels, block, RENDER_BLOCK);
+		samples.insert(samples.end(), block, block + RENDER_BLOCK * 2);
+		if (done()) {
+			break;
+		}
+	}
+	// the last block runs past the end of the sound
+	size_t end = samples.size();
+	while (end > 0 && samples[end - 1] == 0) {
+		end--;
+	}
+	samples.resize(end + (end & 1));
+}
+
+static void render_sfx(AudioChannels* channels, const AudioData& data, int n,
+                       std::vector<int16_t>& samples) {
+	pico_synth::SfxVoice voice;
+	voice.start(data.sfx, n, 0, 32);
+	AUDIO_PlaySource(&voice, 0);
+	int lastNote = 0;
+	bool released = false;
+	render_until(channels, samples, [&] {
+		// a looping sfx goes round its loop twice and then plays to its end
+		int note = voice.note();
+		if (!released && note >= 0 && note < lastNote) {
+			AUDIO_StopLoop(0);
+			released = true;
+		}
+		lastNote = note;
+		return !AUDIO_isPlaying(0);
+	});
+	AUDIO_Stop(0);
+	AUDIO_Flush();
+}
+
+static void render_music(AudioChannels* channels, const AudioData& data, int pattern,
+                         int patternLimit, std::vector<int16_t>& samples) {
+	pico_synth::MusicPlayer music;
+	music.setMemory(data.music, data.sfx);
+	music.setPatternLimit(patternLimit);
+	AUDIO_SetSequencer(&music);
+	music.play(pattern, 0, 0);
+	render_until(channels, samples, [&] { return music.status().pattern < 0; });
+	AUDIO_SetSequencer(nullptr);
+}
+
+static std::string track_name(const char* kind, int n) {
+	char name[32];
+	snprintf(name, sizeof(name), "%s_%02d.wav", kind, n);
+	return name;
+}
+
+namespace pico_render {
+
+	int render_audio(const std::string& cartname, const std::string& dir) {
+		TraceFunction();
+		pico_cart::load(cartname);
+		const pico_cart::Cart& cart = pico_cart::getCart();
+
+		AudioData data;
+		memset(&data, 0, sizeof(data));
+		pico_control::parse_music(cart.section("__music__"), data.music);
+		pico_control::parse_sfx(cart.section("__sfx__"), data.sfx);
+		pico_synth::init();
+
+		std::string path = dir;
+		if (!path.empty() && path.back() != '/' && path.back() != '\\') {
+			path += '/';
+		}
+		std::vector<Track> tracks;
+		for (int n = 0; n < NUM_SFX; n++) {
+			if (!sfx_empty(data, n)) {
+				tracks.push_back({Track::SFX, n, path + track_name("sfx", n)});
+			}
+		}
+		for (int n = 0; n < NUM_PATTERNS; n++) {
+			if (!pattern_empty(data, n)) {
+				tracks.push_back({Track::PATTERN, n, path + track_name("pattern", n)});
+			}
+			if (song_start(data, n)) {
+				tracks.push_back({Track::SONG, n, path + track_name("song", n)});
+			}
+		}
+
+		// each track is rendered on its own channels, so the tracks are independent and any
+		// worker can take the next one
+		std::atomic<size_t> next{0};
+		std::atomic<int> failed{0};
+		auto worker = [&] {
+			AudioChannels* channels = AUDIO_CreateChannels(true);
+			AUDIO_BindChannels(channels);
+			std::vector<int16_t> samples;
+			for (size_t i = next++; i < tracks.size(); i = next++) {
+				const Track& track = tracks[i];
+				samples.clear();
+				switch (track.kind) {
+					case Track::SFX:
+						render_sfx(channels, data, track.index, samples);
+						break;
+					case Track::PATTERN:
+						render_music(channels, data, track.index, 1, samples);
+						break;
+					case Track::SONG:
+						render_music(channels, data, track.index, NUM_PATTERNS, samples);
+						break;
+				}
+				if (hal_wav::save(track.filename, samples.data(), samples.size() / 2, 2,
+				                  AUDIO_Frequency())) {
+					logr << "rendered: " << track.filename << " "
+					     << (double)samples.size() / 2 / AUDIO_Frequency() << "s";
+				} else {
+					logr << LogLevel::err << "failed to write: " << track.filename;
+					failed++;
+				}
+			}
+			AUDIO_DestroyChannels(channels);
+		};
+
+		int threads = std::max(1u, std::min(std::thread::hardware_concurrency(), 16u));
+		std::vector<std::thread> workers;
+		for (int n = 1; n < threads; n++) {
+			workers.emplace_back(worker);
+		}
+		worker();
+		for (auto& t : workers) {
+			t.join();
+		}
+		return failed;
+	}
+
+}  // namespace pico_render
@@ -0,0 +1,16 @@
+#ifndef PICO_RENDER_H
+#define PICO_RENDER_H
+
+#include <string>
+
+namespace pico_render {
+
+	// renders every sfx, music pattern and song of a cart to wav files in dir (sfx_<n>.wav,
+	// pattern_<n>.wav, song_<n>.wav) through the mixer without the audio device, as fast as it
+	// can on worker threads. the cart's code is not run. returns the number of files that could
+	// not be written.
+	int render_audio(const std::string& cartname, const std::string& dir);
+
+}  // namespace pico_render
+
+#endif /* PICO_RENDER_H */
@@ -2,12 +2,18 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <cstdlib>
 #include <cstring>
 #include <deque>
 #include <functional>
+#include <iomanip>
 #include <iostream>
-#include <set>
+#include <map>
+#include <unordered_map>
+#include <vector>
 
+#include "config.h"
 #include "firmware.lua"
 #include "hal_audio.h"
 #include "hal_core.h"
@@ -16,20 +22,89 @@
 #include "pico_audio.h"
 #include "pico_cart.h"
 #include "pico_core.h"
+#include "pico_instance.h"
+#include "pico_plugin.h"
+#include "timeline.h"
+#include "utils.h"
 #include "z8lua/lauxlib.h"
+#include "z8lua/lstate.h"
 #include "z8lua/lua.h"
 #include "z8lua/lualib.h"
 
-static lua_State* lstate = nullptr;
+// cart top level code and _init run inside a coroutine so that flip() (and long running init
+// code) can yield back to the frame loop.
+enum class BootState { Main, Init, Done };
 
 typedef std::function<void()> deferredAPICall_t;
-static std::deque<deferredAPICall_t> deferredAPICalls;
 
-static bool hook_funcs = false;
+struct MemProfSite {
+	std::string func;
+	uint64_t bytes = 0;
+	uint64_t count = 0;
+	int64_t live = 0;
+};
+
+// chunk: 0 = cart source, 1 = firmware / other chunks. line is 1 based.
+typedef std::pair<int, int> MemProfKey;
+
+namespace pico_private {
+	struct ScriptState {
+		lua_State* lstate = nullptr;
+		lua_State* cart_thread = nullptr;
+		BootState boot_state = BootState::Done;
+		std::deque<deferredAPICall_t> deferredAPICalls;
+		bool hook_funcs = false;
+
+		// counted by count_hook, which every lua thread runs
+		uint64_t instructions = 0;
+		// while booting the cart thread yields when instructions reaches this, 0 = never
+		uint64_t yield_at = 0;
+		// the c functions lua code can yield through
+		lua_CFunction pcall = nullptr;
+		lua_CFunction xpcall = nullptr;
+
+		int memprof_rate = 0;  // 0 = disabled, otherwise sample every nth allocation
+		uint32_t memprof_counter = 0;
+		uint64_t memprof_samples = 0;
+		lua_State* memprof_thread = nullptr;  // thread currently being run by pico_script
+		std::map<MemProfKey, MemProfSite> memprof_sites;
+		std::unordered_map<void*, std::pair<MemProfKey, size_t>> memprof_blocks;
+
+		// breakpoints on lines of the "main" chunk, one bit per line. the line hook tests this
+		// before touching the debug api so lines without a breakpoint cost a shift and a mask.
+		std::vector<uint64_t> debug_breakpoints;
+		int debug_breakpoint_count = 0;
+		// line -> condition of a conditional breakpoint. the source is kept so the condition can
+		// be compiled again in the state of a reloaded cart.
+		struct DebugCondition {
+			std::string source;
+			int ref;  // registry ref of the compiled condition
+		};
+		std::map<int, DebugCondition> debug_conditions;
+		bool debug_singlestep = false;
+		int break_line_number = -1;
+	};
+
+	ScriptState* script_create_state() {
+		return new ScriptState();
+	}
+
+	void script_destroy_state(ScriptState* s) {
+		delete s;
+	}
+}  // namespace pico_private
+
+static thread_local pico_private::ScriptState* script_state = nullptr;
 
-static void throw_error(int err) {
+namespace pico_private {
+	void script_bind_state(ScriptState* s) {
+		script_state = s;
+	}
+}  // namespace pico_private
+
+static void throw_error(int err, lua_State* ls = script_state->lstate) {
 	if (err) {
-		std::string msg = lua_tostring(lstate, -1);
+		std::string msg = lua_tostring(ls, -1);
 		logr << LogLevel::err << msg;
 		auto errlnstart = msg.find(":");
 		auto errlnend = msg.find(":", errlnstart + 1);
@@ -41,7 +116,7 @@ static void throw_error(int err) {
 		ss << li.filename << ":" << li.localLineNum << ":" << li.sourceLine << msg.substr(errlnend);
 
 		pico_script::error e(ss.str());
-		lua_pop(lstate, 1);
+		lua_pop(ls, 1);
 		throw e;
 	}
 }
@@ -69,23 +144,214 @@ static void dump_func(lua_State* ls, const char* funcname) {
 
 static void register_cfuncs(lua_State* ls);
 
-static void init_scripting() {
-	lstate = luaL_newstate();
-	luaL_openlibs(lstate);
-	luaopen_debug(lstate);
-	luaopen_string(lstate);
+// ------------------------------------------------------------------
+// Allocation profiler
+// every nth allocation made by the lua heap is attributed to the lua
+// line that caused it. C frames (api calls, coresume etc) are skipped
+// so the cost is charged to the calling lua line.
+// ------------------------------------------------------------------
+
+using pico_private::ScriptState;
+
+static MemProfKey memprof_find_site(ScriptState& st, std::string& func) {
+	lua_Debug ar;
+	for (int level = 0; lua_getstack(st.memprof_thread, level, &ar); level++) {
+		lua_getinfo(st.memprof_thread, "Sln", &ar);
+		if (ar.currentline >= 0) {
+			func = ar.name ? ar.name : "?";
+			int chunk = (ar.source && strcmp(ar.source, "main") == 0) ? 0 : 1;
+			return MemProfKey(chunk, ar.currentline);
+		}
+	}
+	func = "[native]";
+	return MemProfKey(1, 0);
+}
+
+static void memprof_free(ScriptState& st, void* ptr) {
+	auto i = st.memprof_blocks.find(ptr);
+	if (i != st.memprof_blocks.end()) {
+		st.memprof_sites[i->second.first].live -= i->second.second;
+		st.memprof_blocks.erase(i);
+	}
+}
+
+// a sampled block that is resized stays owned by the site that created it.
+static void memprof_move(ScriptState& st, void* ptr, void* newptr, size_t nsize) {
+	auto i = st.memprof_blocks.find(ptr);
+	if (i != st.memprof_blocks.end()) {
+		MemProfKey key = i->second.first;
+		memprof_free(st, ptr);
+		st.memprof_sites[key].live += nsize;
+		st.memprof_blocks[newptr] = std::make_pair(key, nsize);
+	}
+}
+
+// ud is the ScriptState owning the lua state
+static void* script_alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+	ScriptState& st = *(ScriptState*)ud;
+	if (st.memprof_rate == 0 || st.memprof_thread == nullptr) {
+		if (nsize == 0) {
+			free(ptr);
+			return nullptr;
+		}
+		return realloc(ptr, nsize);
+	}
 
-	hook_funcs = false;
+	// when ptr is null osize holds the type of object being created, not a size.
+	bool growing = nsize > 0 && (ptr == nullptr || nsize > osize);
+	bool sampled = growing && (++st.memprof_counter % st.memprof_rate) == 0;
+
+	if (nsize == 0) {
+		memprof_free(st, ptr);
+		free(ptr);
+		return nullptr;
+	}
+
+	// the call stack must be walked before the realloc as the lua stack itself may be the block
+	// being moved.
+	std::string func;
+	MemProfKey key;
+	if (sampled) {
+		key = memprof_find_site(st, func);
+	}
+
+	void* newptr = realloc(ptr, nsize);
+	if (newptr) {
+		if (ptr) {
+			memprof_move(st, ptr, newptr, nsize);
+		}
+		if (sampled) {
+			size_t grown = nsize - (ptr ? osize : 0);
+			MemProfSite& site = st.memprof_sites[key];
+			if (site.func.empty()) {
+				site.func = func;
+			}
+			site.bytes += grown;
+			site.count++;
+			st.memprof_samples++;
+
+			if (st.memprof_blocks.find(newptr) == st.memprof_blocks.end()) {
+				site.live += nsize;
+				st.memprof_blocks[newptr] = std::make_pair(key, nsize);
+			}
+		}
+	}
+	return newptr;
+}
+
+static void memprof_reset() {
+	script_state->memprof_counter = 0;
+	script_state->memprof_samples = 0;
+	script_state->memprof_sites.clear();
+	script_state->memprof_blocks.clear();
+}
+
+static std::string memprof_report(size_t maxSites) {
+	const ScriptState& st = *script_state;
+	std::stringstream ss;
+	if (st.memprof_rate == 0) {
+		ss << "memory profiler not enabled\n";
+		return ss.str();
+	}
+
+	std::vector<std::pair<MemProfKey, MemProfSite>> sorted(st.memprof_sites.begin(),
+	                                                       st.memprof_sites.end());
+	std::sort(sorted.begin(), sorted.end(),
+	          [](const std::pair<MemProfKey, MemProfSite>& a,
+	             const std::pair<MemProfKey, MemProfSite>& b) {
+		          return a.second.bytes > b.second.bytes;
+	          });
+
+	ss << "memory profile: 1 in " << st.memprof_rate << " allocations sampled, "
+	   << st.memprof_samples << " samples\n";
+	ss << std::setw(10) << "bytes" << std::setw(10) << "allocs" << std::setw(10) << "live"
+	   << "  site\n";
+
+	const pico_cart::Cart& cart = pico_cart::getCart();
+	for (size_t n = 0; n < sorted.size() && n < maxSites; n++) {
+		const MemProfKey& key = sorted[n].first;
+		const MemProfSite& site = sorted[n].second;
+
+		ss << std::setw(10) << site.bytes * st.memprof_rate << std::setw(10)
+		   << site.count * st.memprof_rate << std::setw(10) << site.live * st.memprof_rate << "  ";
+
+		if (key.first == 0 && key.second >= 1 && size_t(key.second) <= cart.source.size()) {
+			auto li = pico_cart::getLineInfo(cart, key.second - 1);
+			ss << li.filename << ":" << li.localLineNum << " " << site.func << "(): "
+			   << utils::trimboth(li.sourceLine) << "\n";
+		} else if (key.second > 0) {
+			ss << "firmware:" << key.second << " " << site.func << "()\n";
+		} else {
+			ss << site.func << "\n";
+		}
+	}
+	return ss.str();
+}
+
+// true if ls is the cart thread and it can yield from the function at level of its stack. it
+// cannot while lua code is being run by a c function other than pcall, such as a sort comparator
+// or a metamethod called from the api.
+static bool cart_thread_can_yield(lua_State* ls, int level) {
+	if (ls != script_state->cart_thread) {
+		return false;
+	}
+	lua_Debug ar;
+	for (; lua_getstack(ls, level, &ar); level++) {
+		lua_getinfo(ls, "Sf", &ar);
+		lua_CFunction f = lua_tocfunction(ls, -1);
+		lua_pop(ls, 1);
+		if (strcmp(ar.what, "C") == 0 && f != script_state->pcall && f != script_state->xpcall) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// coroutines inherit the hook of the thread that creates them, so setting it on the main state
+// counts every instruction the cart runs.
+static void count_hook(lua_State* ls, lua_Debug* ar) {
+	script_state->instructions += lua_gethookcount(ls);
+	// only the cart thread itself yields, not coroutines it has created
+	if (script_state->yield_at != 0 && script_state->instructions >= script_state->yield_at &&
+	    cart_thread_can_yield(ls, 0)) {
+		lua_yield(ls, 0);
+	}
+}
+
+static int script_panic(lua_State* ls) {
+	logr << LogLevel::err << "unprotected error in call to Lua API: " << lua_tostring(ls, -1);
+	return 0;
+}
+
+static void init_scripting(const pico_cart::Cart& cart) {
+	script_state->lstate = lua_newstate(script_alloc, script_state);
+	lua_atpanic(script_state->lstate, script_panic);
+	lua_sethook(script_state->lstate, count_hook, LUA_MASKCOUNT, config::CPU_HOOK_INSTRUCTIONS);
+	script_state->instructions = 0;
+	script_state->yield_at = 0;
+	script_state->memprof_thread = script_state->lstate;
+	memprof_reset();
+	luaL_openlibs(script_state->lstate);
+	luaopen_debug(script_state->lstate);
+	luaopen_string(script_state->lstate);
+	lua_getglobal(script_state->lstate, "pcall");
+	script_state->pcall = lua_tocfunction(script_state->lstate, -1);
+	lua_getglobal(script_state->lstate, "xpcall");
+	script_state->xpcall = lua_tocfunction(script_state->lstate, -1);
+	lua_pop(script_state->lstate, 2);
+
+	script_state->hook_funcs = false;
 
 	DEBUG_Trace(false);
 
 	std::string fw = pico_cart::convert_emojis(firmware);
 
-	throw_error(luaL_loadbuffer(lstate, fw.c_str(), fw.size(), "firmware"));
-	throw_error(lua_pcall(lstate, 0, 0, 0));
+	throw_error(luaL_loadbuffer(script_state->lstate, fw.c_str(), fw.size(), "firmware"));
+	throw_error(lua_pcall(script_state->lstate, 0, 0, 0));
 
-	register_cfuncs(lstate);
-	luaL_dostring(lstate, "__tac08__.make_api_list()");
+	register_cfuncs(script_state->lstate);
+	pico_plugin::register_plugins(script_state->lstate, cart);
+	luaL_dostring(script_state->lstate, "__tac08__.make_api_list()");
 }
 
 // ------------------------------------------------------------------
@@ -96,14 +362,14 @@ static int impl_load(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto s = luaL_checkstring(ls, 1);
 	if (s) {
-		deferredAPICalls.push_back([=]() { pico_api::load(s); });
+		script_state->deferredAPICalls.push_back([=]() { pico_api::load(s); });
 	}
 	return 0;
 }
 
 static int impl_run(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
-	deferredAPICalls.push_back([]() { pico_api::reloadcart(); });
+	script_state->deferredAPICalls.push_back([]() { pico_api::reloadcart(); });
 	return 0;
 }
 
@@ -613,6 +879,44 @@ static int impl_time(lua_State* ls) {
 	return 1;
 }
 
+// yields the cart coroutine back to the frame loop, the rest of the frame is presented and
+// execution continues from here on the next frame. no-op outside of the cart coroutine.
+static int impl_flip(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	// level 0 is flip itself
+	if (cart_thread_can_yield(ls, 1)) {
+		return lua_yield(ls, 0);
+	}
+	return 0;
+}
+
+// coresume (co, ...) - coroutine.resume, which it wraps. the count hook only charges whole
+// steps, so the instructions a resume ran since the last one are charged when it yields or
+// finishes and short coroutines are counted exactly.
+static int impl_coresume(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	lua_State* co = lua_tothread(ls, 1);
+	luaL_argcheck(ls, co, 1, "coroutine expected");
+	lua_Debug ar;
+	bool fresh = co != ls && lua_status(co) == LUA_OK && lua_getstack(co, 0, &ar) == 0 &&
+	             lua_gettop(co) > 0;
+	bool counted = (fresh || lua_status(co) == LUA_YIELD) && (lua_gethookmask(co) & LUA_MASKCOUNT);
+	if (counted) {
+		// restarts the step, keeping a line hook the debugger has set
+		lua_sethook(co, lua_gethook(co), lua_gethookmask(co), lua_gethookcount(co));
+	}
+
+	lua_pushvalue(ls, lua_upvalueindex(1));
+	lua_insert(ls, 1);
+	lua_call(ls, lua_gettop(ls) - 1, LUA_MULTRET);
+
+	if (counted) {
+		// the hook count is only public as the step size, what is left of the step is internal
+		script_state->instructions += lua_gethookcount(co) - co->hookcount;
+	}
+	return lua_gettop(ls);
+}
+
 static int impl_color(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto c = luaL_optnumber(ls, 1, 0).toInt();
@@ -712,7 +1016,7 @@ static int impl_memset(lua_State* ls) {
 
 static int impl_ord(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
-	const char* msg = luaL_checkstring(lstate, 1);
+	const char* msg = luaL_checkstring(script_state->lstate, 1);
 	if (msg && strlen(msg)) {
 		lua_pushnumber(ls, (uint)msg[0]);
 		return 1;
@@ -773,7 +1077,8 @@ static int implx_wrstr(lua_State* ls) {
 static int implx_wavload(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto name = luaL_checkstring(ls, 1);
-	int id = pico_apix::wavload(name);
+	bool stream = lua_toboolean(ls, 2);
+	int id = pico_apix::wavload(name, stream);
 	if (id < 0)
 		lua_pushnil(ls);
 	else
@@ -819,6 +1124,55 @@ static int implx_wavplaying(lua_State* ls) {
 	return 1;
 }
 
+static int implx_chanvolume(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto chan = luaL_checknumber(ls, 1).toInt();
+	float volume = luaL_checknumber(ls, 2).bits() / 65536.0f;
+	float pan = luaL_optnumber(ls, 3, 0).bits() / 65536.0f;
+	AUDIO_SetVolume(chan, volume, pan);
+	return 0;
+}
+
+static int implx_pcmplay(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto chan = luaL_checknumber(ls, 1).toInt();
+	// rates above 32767 wrap to negative numbers, so the integer part is read unsigned
+	int rate = (uint32_t)luaL_optnumber(ls, 2, 5512).bits() >> 16;
+	pico_apix::pcmplay(chan, rate);
+	return 0;
+}
+
+static int implx_pcmstop(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	pico_apix::pcmstop();
+	return 0;
+}
+
+// pcmpush(str, [bits]) or pcmpush(addr, len, [bits]), returns the number of samples queued
+static int implx_pcmpush(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	int queued;
+	if (lua_type(ls, 1) == LUA_TSTRING) {
+		size_t len;
+		auto data = lua_tolstring(ls, 1, &len);
+		auto bits = luaL_optnumber(ls, 2, 8).toInt();
+		queued = pico_apix::pcmpush((const uint8_t*)data, (int)len, bits);
+	} else {
+		uint16_t addr = luaL_checknumber(ls, 1).toInt();
+		auto len = luaL_checknumber(ls, 2).toInt();
+		auto bits = luaL_optnumber(ls, 3, 8).toInt();
+		queued = pico_apix::pcmpush(addr, len, bits);
+	}
+	lua_pushnumber(ls, queued);
+	return 1;
+}
+
+static int implx_pcmfree(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	lua_pushnumber(ls, pico_apix::pcmfree());
+	return 1;
+}
+
 static int implx_setpal(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto i = luaL_checknumber(ls, 1).toInt();
@@ -890,6 +1244,13 @@ static int implx_showmenu(lua_State* ls) {
 	return 0;
 }
 
+static int implx_idle(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto enable = lua_toboolean(ls, 1);
+	pico_apix::idle(enable);
+	return 0;
+}
+
 static int implx_touchmask(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	uint8_t m = INP_GetTouchMask();
@@ -1021,27 +1382,114 @@ static int implx_dbg_getsrclines(lua_State* ls) {
 	return 1;
 }
 
-static std::set<int> debug_breakpoints;
-static bool debug_singlestep = false;
-static int break_line_number = -1;
+static inline bool dbg_is_breakpoint(int line) {
+	size_t word = size_t(line) >> 6;
+	return line >= 0 && word < script_state->debug_breakpoints.size() &&
+	       ((script_state->debug_breakpoints[word] >> (line & 63)) & 1);
+}
 
-static void dbg_hookfunc(lua_State* ls, lua_Debug* ar) {
-	//	logr << "dbg_hookfunc " << ar->currentline << ":"
-	//<< pico_apix::dbg_getsrc("main", ar->currentline).first;
+static void dbg_set_breakpoint(int line, bool enabled) {
+	size_t word = size_t(line) >> 6;
+	uint64_t bit = uint64_t(1) << (line & 63);
+	if (enabled) {
+		if (word >= script_state->debug_breakpoints.size()) {
+			script_state->debug_breakpoints.resize(word + 1, 0);
+		}
+		if (!(script_state->debug_breakpoints[word] & bit)) {
+			script_state->debug_breakpoints[word] |= bit;
+			script_state->debug_breakpoint_count++;
+		}
+	} else if (dbg_is_breakpoint(line)) {
+		script_state->debug_breakpoints[word] &= ~bit;
+		script_state->debug_breakpoint_count--;
+	}
+}
+
+static void dbg_clear_condition(lua_State* ls, int line) {
+	auto c = script_state->debug_conditions.find(line);
+	if (c != script_state->debug_conditions.end()) {
+		luaL_unref(ls, LUA_REGISTRYINDEX, c->second.ref);
+		script_state->debug_conditions.erase(c);
+	}
+}
+
+// compiles a breakpoint condition and pushes it, or pushes the error and returns false
+static bool dbg_compile_condition(lua_State* ls, const std::string& cond) {
+	std::string src = "return " + cond;
+	return luaL_loadbuffer(ls, src.c_str(), src.size(), "=breakpoint") == LUA_OK;
+}
 
-	break_line_number = -1;
+// compiles the conditions kept from the previous state in the new one. a breakpoint whose
+// condition no longer compiles is removed.
+static void dbg_recompile_conditions(lua_State* ls) {
+	auto& conditions = script_state->debug_conditions;
+	for (auto c = conditions.begin(); c != conditions.end();) {
+		if (dbg_compile_condition(ls, c->second.source)) {
+			c->second.ref = luaL_ref(ls, LUA_REGISTRYINDEX);
+			++c;
+		} else {
+			logr << LogLevel::err << "breakpoint on line " << c->first
+			     << " removed, condition: " << lua_tostring(ls, -1);
+			lua_pop(ls, 1);
+			dbg_set_breakpoint(c->first, false);
+			c = conditions.erase(c);
+		}
+	}
+}
+
+// evaluates the condition for the breakpoint at the current line of the hooked frame. the
+// condition sees the frame's locals, falling back to globals. a condition that errors breaks.
+static bool dbg_check_condition(lua_State* ls, lua_Debug* ar) {
+	auto c = script_state->debug_conditions.find(ar->currentline);
+	if (c == script_state->debug_conditions.end()) {
+		return true;
+	}
 
-	lua_Debug info;
-	lua_getstack(ls, 0, &info);
-	lua_getinfo(ls, "S", &info);
+	lua_rawgeti(ls, LUA_REGISTRYINDEX, c->second.ref);
 
-	if (info.source && strcmp(info.source, "main") != 0) {
+	lua_newtable(ls);
+	const char* name;
+	for (int n = 1; (name = lua_getlocal(ls, ar, n)) != nullptr; n++) {
+		if (name[0] == '(') {  // internal temporaries
+			lua_pop(ls, 1);
+			continue;
+		}
+		lua_setfield(ls, -2, name);
+	}
+	lua_newtable(ls);
+	lua_pushglobaltable(ls);
+	lua_setfield(ls, -2, "__index");
+	lua_setmetatable(ls, -2);
+	lua_setupvalue(ls, -2, 1);  // _ENV
+
+	bool hit = true;
+	if (lua_pcall(ls, 0, 1, 0) == LUA_OK) {
+		hit = lua_toboolean(ls, -1);
+	} else {
+		logr << LogLevel::err << "breakpoint condition on line " << ar->currentline << ": "
+		     << lua_tostring(ls, -1);
+	}
+	lua_pop(ls, 1);
+	return hit;
+}
+
+static void dbg_hookfunc(lua_State* ls, lua_Debug* ar) {
+	if (ar->event == LUA_HOOKCOUNT) {
+		count_hook(ls, ar);
+		return;
+	}
+	if (!script_state->debug_singlestep && !dbg_is_breakpoint(ar->currentline)) {
+		return;
+	}
+
+	lua_getinfo(ls, "S", ar);
+	if (ar->source && strcmp(ar->source, "main") != 0) {
 		return;
 	}
 
-	if (debug_breakpoints.count(ar->currentline) || debug_singlestep) {
-		debug_singlestep = false;
-		break_line_number = ar->currentline;
+	if (script_state->debug_singlestep || dbg_check_condition(ls, ar)) {
+		script_state->debug_singlestep = false;
+		script_state->break_line_number = ar->currentline;
 		luaL_dostring(ls, "__tac08__.dbg.locals = __tac08__.dbg.dumplocals(3)");
 		lua_yield(ls, 0);
 	}
@@ -1052,7 +1500,8 @@ static int implx_dbg_cocreate(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	luaL_checktype(ls, 1, LUA_TFUNCTION);
 	lua_State* co = lua_newthread(ls);
-	lua_sethook(co, dbg_hookfunc, LUA_MASKLINE, 0);
+	// the line hook is added by dbg_coresume when needed
+	lua_sethook(co, count_hook, LUA_MASKCOUNT, config::CPU_HOOK_INSTRUCTIONS);
 	lua_pushvalue(ls, 1); /* move function to top */
 	lua_xmove(ls, co, 1); /* move function from L to NL */
 
@@ -1079,7 +1528,16 @@ static int implx_dbg_coresume(lua_State* ls) {
 	lua_State* co = lua_tothread(ls, -2);
 	std::string mode = lua_tostring(ls, -1);
 
-	debug_singlestep = (mode == "step");
+	script_state->debug_singlestep = (mode == "step");
+	script_state->break_line_number = -1;
+
+	// only pay for a line hook while there is something to stop on
+	if (script_state->debug_singlestep || script_state->debug_breakpoint_count) {
+		lua_sethook(co, dbg_hookfunc, LUA_MASKLINE | LUA_MASKCOUNT,
+		            config::CPU_HOOK_INSTRUCTIONS);
+	} else {
+		lua_sethook(co, count_hook, LUA_MASKCOUNT, config::CPU_HOOK_INSTRUCTIONS);
+	}
 
 	int status = lua_status(co);
 	if (status == LUA_OK || status == LUA_YIELD) {
@@ -1093,7 +1551,7 @@ static int implx_dbg_coresume(lua_State* ls) {
 
 		case LUA_YIELD:
 			lua_pushstring(ls, "break");
-			lua_pushnumber(ls, break_line_number);
+			lua_pushnumber(ls, script_state->break_line_number);
 			return 2;
 
 		default:
@@ -1112,25 +1570,56 @@ static int implx_dbg_coresume(lua_State* ls) {
 	return 0;
 }
 
-// dbg_bpline (line, enabled)
+// dbg_bpline (line, enabled, [condition]) -> true | nil, error_str
+// condition is a lua expression evaluated each time the line is reached, the break only
+// happens when it is true.
 static int implx_dbg_bpline(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	int line = luaL_checknumber(ls, 1).toInt();
 	bool enabled = lua_toboolean(ls, 2);
+	const char* cond = luaL_optstring(ls, 3, nullptr);
 
-	if (enabled) {
-		debug_breakpoints.insert(line);
-	} else {
-		debug_breakpoints.erase(line);
+	// compiled before the old condition is dropped, a bad one leaves the breakpoint as it was
+	bool conditional = enabled && cond && *cond;
+	if (conditional && !dbg_compile_condition(ls, cond)) {
+		lua_pushnil(ls);
+		lua_insert(ls, -2);
+		return 2;
 	}
-	return 0;
+	dbg_clear_condition(ls, line);
+	if (conditional) {
+		int ref = luaL_ref(ls, LUA_REGISTRYINDEX);
+		script_state->debug_conditions[line] = {cond, ref};
+	}
+	dbg_set_breakpoint(line, enabled);
+
+	lua_pushboolean(ls, 1);
+	return 1;
 }
 
 static int implx_dbg_hooks(lua_State* ls) {
-	hook_funcs = true;
+	script_state->hook_funcs = true;
+	return 0;
+}
+
+// memprof(rate) - sample every nth lua allocation, 0 disables. resets collected samples.
+static int implx_memprof(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto rate = luaL_optnumber(ls, 1, 1).toInt();
+	script_state->memprof_rate = std::max(rate, 0);
+	memprof_reset();
 	return 0;
 }
 
+// memprof_report([max_sites]) -> report string, sites sorted by bytes allocated
+static int implx_memprof_report(lua_State* ls) {
+	DEBUG_DUMP_FUNCTION
+	auto maxSites = luaL_optnumber(ls, 1, 32).toInt();
+	auto report = memprof_report(std::max(maxSites, 0));
+	lua_pushstring(ls, report.c_str());
+	return 1;
+}
+
 static int implx_getkey(lua_State* ls) {
 	DEBUG_DUMP_FUNCTION
 	auto s = pico_apix::getkey();
@@ -1210,7 +1699,8 @@ static const luaL_Reg pico8_api[] = {{"load", impl_load},         {"run", impl_r
                                      {"stat", impl_stat},         {"music", impl_music},
                                      {"sfx", impl_sfx},           {"memcpy", impl_memcpy},
                                      {"memset", impl_memset},     {"ord", impl_ord},
-                                     {"chr", impl_chr},           {NULL, NULL}};
+                                     {"chr", impl_chr},           {"flip", impl_flip},
+                                     {NULL, NULL}};
 
 static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"rdclip", implx_rdclip},
@@ -1221,6 +1711,11 @@ static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"wavstop", implx_wavstop},
                                      {"wavstoploop", implx_wavstoploop},
                                      {"wavplaying", implx_wavplaying},
+                                     {"chanvolume", implx_chanvolume},
+                                     {"pcmplay", implx_pcmplay},
+                                     {"pcmstop", implx_pcmstop},
+                                     {"pcmpush", implx_pcmpush},
+                                     {"pcmfree", implx_pcmfree},
                                      {"setpal", implx_setpal},
                                      {"selpal", implx_selpal},
                                      {"resetpal", implx_resetpal},
@@ -1229,6 +1724,7 @@ static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"xpal", implx_xpal},
                                      {"cursor", implx_cursor},
                                      {"showmenu", implx_showmenu},
+                                     {"idle", implx_idle},
                                      {"touchmask", implx_touchmask},
                                      {"touchstate", implx_touchstate},
                                      {"touchavail", implx_touchavail},
@@ -1249,6 +1745,8 @@ static const luaL_Reg tac08_api[] = {{"wrclip", implx_wrclip},
                                      {"dbg_coresume", implx_dbg_coresume},
                                      {"dbg_bpline", implx_dbg_bpline},
                                      {"dbg_hooks", implx_dbg_hooks},
+                                     {"memprof", implx_memprof},
+                                     {"memprof_report", implx_memprof_report},
                                      {"getkey", implx_getkey},
                                      {"printx", implx_printx},
                                      {"cwd", implx_cwd},
@@ -1260,6 +1758,11 @@ static void register_cfuncs(lua_State* ls) {
 	lua_pushglobaltable(ls);
 	luaL_setfuncs(ls, pico8_api, 0);
 
+	// the firmware's coresume is coroutine.resume
+	lua_getglobal(ls, "coresume");
+	lua_pushcclosure(ls, impl_coresume, 1);
+	lua_setglobal(ls, "coresume");
+
 	lua_getglobal(ls, "__tac08__");
 	luaL_setfuncs(ls, tac08_api, 0);
 }
@@ -1282,43 +1785,70 @@ namespace pico_script {
 	void load(const pico_cart::Cart& cart) {
 		TraceFunction();
 		unload_scripting();
-		init_scripting();
+		init_scripting(cart);
+		dbg_recompile_conditions(script_state->lstate);
 
 		std::string code;
 
 		for (size_t i = 0; i < cart.source.size(); i++) {
 			code += cart.source[i].line + "\n";
 		}
-		throw_error(luaL_loadbuffer(lstate, code.c_str(), code.size(), "main"));
-		throw_error(lua_pcall(lstate, 0, 0, 0));
+		throw_error(luaL_loadbuffer(script_state->lstate, code.c_str(), code.size(), "main"));
+
+		// the main chunk is not run here, boot() runs it from the frame loop.
+		script_state->cart_thread = lua_newthread(script_state->lstate);
+		lua_setfield(script_state->lstate, LUA_REGISTRYINDEX, "__tac08__cart_thread");
+		lua_xmove(script_state->lstate, script_state->cart_thread, 1);
+		script_state->boot_state = BootState::Main;
 	}
 
 	void unload_scripting() {
-		if (lstate) {
-			lua_close(lstate);
-			lstate = nullptr;
+		script_state->cart_thread = nullptr;
+		script_state->boot_state = BootState::Done;
+		if (script_state->lstate) {
+			if (script_state->memprof_rate) {
+				logr << LogLevel::perf << memprof_report(32);
+			}
+			script_state->memprof_thread = nullptr;
+			// compiled conditions live in the registry of this state, load() compiles them again
+			for (auto& c : script_state->debug_conditions) {
+				c.second.ref = LUA_NOREF;
+			}
+			lua_close(script_state->lstate);
+			script_state->lstate = nullptr;
+		}
+		script_state->deferredAPICalls.clear();
+	}
+
+	uint64_t instructions() {
+		return script_state->instructions;
+	}
+
+	void gc_step() {
+		timeline::Scope scope("gc");
+		if (script_state->lstate) {
+			lua_gc(script_state->lstate, LUA_GCSTEP, 0);
 		}
-		deferredAPICalls.clear();
 	}
 
 	bool symbolExist(const char* s) {
-		lua_getglobal(lstate, s);
-		bool exist = !lua_isnil(lstate, -1);
-		lua_pop(lstate, 1);
+		lua_getglobal(script_state->lstate, s);
+		bool exist = !lua_isnil(script_state->lstate, -1);
+		lua_pop(script_state->lstate, 1);
 		return exist;
 	}
 
 	bool simpleCall(std::string function, bool optional) {
-		lua_getglobal(lstate, function.c_str());
+		lua_getglobal(script_state->lstate, function.c_str());
 
-		if (!lua_isfunction(lstate, -1)) {
+		if (!lua_isfunction(script_state->lstate, -1)) {
 			if (optional) {
-				lua_pop(lstate, 1);
+				lua_pop(script_state->lstate, 1);
 				return false;
 			} else
 				throw pico_script::error(function + " not found");
 		}
-		throw_error(lua_pcall(lstate, 0, 0, 0));
+		throw_error(lua_pcall(script_state->lstate, 0, 0, 0));
 		return true;
 	}
 
@@ -1329,37 +1859,101 @@ namespace pico_script {
 	    {"_draw", "__tac08__dbg_draw"},
 	};
 
+	static void run_deferred(bool& restarted) {
+		while (!script_state->deferredAPICalls.empty()) {
+			deferredAPICall_t apicall = script_state->deferredAPICalls.front();
+			script_state->deferredAPICalls.pop_front();
+			apicall();
+			restarted = true;
+		}
+	}
+
 	bool run(std::string function, bool optional, bool& restarted) {
 		if (restarted) {
 			return true;
 		}
 
-		if (hook_funcs) {
+		if (script_state->hook_funcs) {
 			auto f = function_hooks.find(function);
 			if (f != function_hooks.end()) {
 				function = f->second;
 			}
 		}
 
+		timeline::Scope scope(function.c_str());
 		auto ret = simpleCall(function, optional);
+		run_deferred(restarted);
+		return ret;
+	}
 
-		while (!deferredAPICalls.empty()) {
-			deferredAPICall_t apicall = deferredAPICalls.front();
-			deferredAPICalls.pop_front();
-			apicall();
-			restarted = true;
+	// returns true if the function on the cart thread ran to completion, false if it yielded.
+	static bool resume_cart_thread() {
+		if (config::BOOT_INSTRUCTION_BUDGET > 0) {
+			script_state->yield_at = script_state->instructions + config::BOOT_INSTRUCTION_BUDGET;
 		}
-		return ret;
+
+		script_state->memprof_thread = script_state->cart_thread;
+		int status = lua_resume(script_state->cart_thread, script_state->lstate, 0);
+		script_state->memprof_thread = script_state->lstate;
+		script_state->yield_at = 0;
+
+		if (status == LUA_YIELD) {
+			return false;
+		}
+		if (status != LUA_OK) {
+			script_state->boot_state = BootState::Done;
+			throw_error(status, script_state->cart_thread);
+		}
+		lua_settop(script_state->cart_thread, 0);
+		return true;
+	}
+
+	bool boot(bool& restarted) {
+		if (restarted) {
+			return false;
+		}
+		timeline::Scope scope("boot");
+
+		if (script_state->boot_state == BootState::Main) {
+			bool done = resume_cart_thread();
+			run_deferred(restarted);
+			if (!done || restarted) {
+				return false;
+			}
+
+			std::string init = "_init";
+			if (script_state->hook_funcs) {
+				init = function_hooks[init];
+			}
+			lua_getglobal(script_state->cart_thread, init.c_str());
+			if (lua_isfunction(script_state->cart_thread, -1)) {
+				script_state->boot_state = BootState::Init;
+			} else {
+				lua_pop(script_state->cart_thread, 1);
+				script_state->boot_state = BootState::Done;
+			}
+		}
+
+		if (script_state->boot_state == BootState::Init) {
+			bool done = resume_cart_thread();
+			run_deferred(restarted);
+			if (!done || restarted) {
+				return false;
+			}
+			script_state->boot_state = BootState::Done;
+		}
+
+		return true;
 	}
 
 	// returns true when menu finished
 	bool do_menu() {
-		lua_getglobal(lstate, "__tac08__");
-		lua_getfield(lstate, -1, "do_menu");
-		lua_remove(lstate, -2);
-		throw_error(lua_pcall(lstate, 0, 1, 0));
-		bool res = lua_toboolean(lstate, -1);
-		lua_pop(lstate, 1);
+		lua_getglobal(script_state->lstate, "__tac08__");
+		lua_getfield(script_state->lstate, -1, "do_menu");
+		lua_remove(script_state->lstate, -2);
+		throw_error(lua_pcall(script_state->lstate, 0, 1, 0));
+		bool res = lua_toboolean(script_state->lstate, -1);
+		lua_pop(script_state->lstate, 1);
 
 		return res;
 	}
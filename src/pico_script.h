@@ -15,8 +15,15 @@ namespace pico_script {
 
 	void load(const pico_cart::Cart& cart);
 	bool symbolExist(const char* s);
+	// runs the cart top level code then _init. returns true once both have completed, false if
+	// the cart yielded with flip() (or used its instruction budget) and must be resumed next frame.
+	bool boot(bool& restarted);
 	bool run(std::string function, bool optional, bool& restarted);
 	bool do_menu();
+	// a step of the incremental garbage collector, run between frames so its cost can be timed
+	void gc_step();
+	// lua vm instructions run since the cart was loaded, in steps of config::CPU_HOOK_INSTRUCTIONS
+	uint64_t instructions();
 	void unload_scripting();
 	void tron();
 	void troff();
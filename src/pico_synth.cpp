@@ -0,0 +1,648 @@
+#include "pico_synth.h"
+
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+
+#include "config.h"
+
+namespace pico_private {
+
+	const int SFX_SIZE = 68;
+	const int SFX_NOTES = 32;
+
+	// the mixing rate and the length of one tick of sfx speed at it (pico-8 runs its synth at
+	// 22050hz), set by init() as the device is opened before any sound is made
+	static float sampleRate = config::AUDIO_FREQ;
+	static int samplesPerTick = 183;
+
+	// pitch 0 (C-0), pitch 33 is A-2 (440hz)
+	const float BASE_FREQ = 65.40639f;
+
+	// note parameters (effects, volume) are recalculated every CONTROL_SAMPLES samples
+	const int CONTROL_SAMPLES = 32;
+	const int RENDER_BLOCK = 256;
+	// samples taken for the gain to move between silence and full volume, avoids clicks
+	const float GAIN_RAMP_SAMPLES = 64.0f;
+	const float VIBRATO_HZ = 7.5f;
+
+	enum Waveform {
+		WAVE_TRIANGLE,
+		WAVE_TILTED_SAW,
+		WAVE_SAW,
+		WAVE_SQUARE,
+		WAVE_PULSE,
+		WAVE_ORGAN,
+		WAVE_NOISE,
+		WAVE_PHASER,
+	};
+
+	enum Effect {
+		FX_NONE,
+		FX_SLIDE,
+		FX_VIBRATO,
+		FX_DROP,
+		FX_FADE_IN,
+		FX_FADE_OUT,
+		FX_ARP_FAST,
+		FX_ARP_SLOW,
+	};
+
+	// waveforms 0-5 are played from wavetables, one table per octave of pitch containing only
+	// the harmonics below nyquist for the top of that octave. noise is generated and the phaser
+	// is two detuned triangles.
+	const int NUM_TABLE_WAVEFORMS = 6;
+	const int NUM_OCTAVES = 8;
+	const int TABLE_SIZE = 256;
+	const int TABLE_MASK = TABLE_SIZE - 1;
+	const int MAX_HARMONICS = TABLE_SIZE / 2 - 1;
+	const int DFT_SIZE = 2048;
+	const double PI = 3.14159265358979323846;
+
+	static float wavetables[NUM_TABLE_WAVEFORMS][NUM_OCTAVES][TABLE_SIZE];
+	static std::once_flag wavetablesBuilt;
+
+	// one cycle of the (aliased) waveform, t in [0, 1)
+	static float waveform_shape(int waveform, float t) {
+		switch (waveform) {
+			case WAVE_TRIANGLE:
+				return 0.5f * (std::fabs(4.0f * t - 2.0f) - 1.0f);
+			case WAVE_TILTED_SAW: {
+				const float a = 0.875f;
+				float r = t < a ? 2.0f * t / a - 1.0f : 2.0f * (1.0f - t) / (1.0f - a) - 1.0f;
+				return 0.5f * r;
+			}
+			case WAVE_SAW:
+				return 0.653f * (t < 0.5f ? t : t - 1.0f);
+			case WAVE_SQUARE:
+				return t < 0.5f ? 0.25f : -0.25f;
+			case WAVE_PULSE:
+				return t < 1.0f / 3.0f ? 0.25f : -0.25f;
+			case WAVE_ORGAN:
+				return (t < 0.5f ? 3.0f - std::fabs(24.0f * t - 6.0f)
+				                 : 1.0f - std::fabs(16.0f * t - 12.0f)) /
+				       9.0f;
+		}
+		return 0;
+	}
+
+	static void build_wavetables() {
+		static float sintab[DFT_SIZE];
+		for (int n = 0; n < DFT_SIZE; n++) {
+			sintab[n] = (float)std::sin(2.0 * PI * n / DFT_SIZE);
+		}
+		auto sin_at = [](int n) { return sintab[n & (DFT_SIZE - 1)]; };
+		auto cos_at = [](int n) { return sintab[(n + DFT_SIZE / 4) & (DFT_SIZE - 1)]; };
+
+		static float shape[DFT_SIZE];
+		float a[MAX_HARMONICS + 1];
+		float b[MAX_HARMONICS + 1];
+		for (int w = 0; w < NUM_TABLE_WAVEFORMS; w++) {
+			for (int n = 0; n < DFT_SIZE; n++) {
+				shape[n] = waveform_shape(w, (float)n / DFT_SIZE);
+			}
+			// fourier series of the shape, dc is dropped
+			for (int h = 1; h <= MAX_HARMONICS; h++) {
+				float sa = 0, sb = 0;
+				for (int n = 0; n < DFT_SIZE; n++) {
+					sa += shape[n] * cos_at(h * n);
+					sb += shape[n] * sin_at(h * n);
+				}
+				a[h] = sa * 2.0f / DFT_SIZE;
+				b[h] = sb * 2.0f / DFT_SIZE;
+			}
+			for (int oct = 0; oct < NUM_OCTAVES; oct++) {
+				float maxfreq = BASE_FREQ * (float)(2 << oct);
+				int harmonics = (int)(sampleRate / 2 / maxfreq);
+				harmonics = std::max(1, std::min(harmonics, MAX_HARMONICS));
+				for (int n = 0; n < TABLE_SIZE; n++) {
+					float s = 0;
+					int step = n * (DFT_SIZE / TABLE_SIZE);
+					for (int h = 1; h <= harmonics; h++) {
+						s += a[h] * cos_at(h * step) + b[h] * sin_at(h * step);
+					}
+					wavetables[w][oct][n] = s;
+				}
+			}
+		}
+	}
+
+	static inline float table_lookup(const float* table, float phase) {
+		float pos = phase * TABLE_SIZE;
+		int i = (int)pos;
+		float frac = pos - i;
+		float s0 = table[i & TABLE_MASK];
+		float s1 = table[(i + 1) & TABLE_MASK];
+		return s0 + (s1 - s0) * frac;
+	}
+
+	// -1..1..-1 over one cycle
+	static inline float lfo_triangle(float x) {
+		return 1.0f - 4.0f * std::fabs(x - std::floor(x) - 0.5f);
+	}
+
+	static inline float lerp(float a, float b, float t) {
+		return a + (b - a) * t;
+	}
+
+}  // namespace pico_private
+
+using namespace pico_private;
+
+namespace pico_synth {
+
+	void init() {
+		std::call_once(wavetablesBuilt, [] {
+			sampleRate = (float)AUDIO_Frequency();
+			samplesPerTick = (int)std::lround(183.0 * AUDIO_Frequency() / 22050);
+			build_wavetables();
+		});
+	}
+
+	void SfxPlayer::start(const uint8_t* sfxdata,
+	                      int sfx,
+	                      int offset,
+	                      int length,
+	                      SfxPlayer* instrument) {
+		m_sfxdata = sfxdata;
+		m_sfx = sfx;
+		m_instrument = instrument;
+		m_endNote = std::max(0, std::min(offset + length, SFX_NOTES));
+		m_released = false;
+		m_time = 0;
+		m_phase = 0;
+		m_phase2 = 0;
+		m_gain = 0;
+		m_noise = 0;
+
+		m_playing = offset >= 0 && offset < SFX_NOTES && sfx >= 0 && sfx < 64;
+		if (m_playing) {
+			// the first note slides from itself
+			m_current = readNote(offset);
+			m_playing = beginNote(offset);
+		}
+	}
+
+	void SfxPlayer::stop() {
+		m_playing = false;
+	}
+
+	void SfxPlayer::release() {
+		m_released = true;
+	}
+
+	const uint8_t* SfxPlayer::sfxHeader() const {
+		return m_sfxdata + m_sfx * SFX_SIZE + SFX_NOTES * 2;
+	}
+
+	SfxPlayer::Note SfxPlayer::readNote(int n) const {
+		const uint8_t* p = m_sfxdata + m_sfx * SFX_SIZE + (n & (SFX_NOTES - 1)) * 2;
+		Note note;
+		note.pitch = p[0] & 0x3f;
+		note.waveform = (p[0] >> 6) | ((p[1] & 1) << 2);
+		note.volume = (p[1] >> 1) & 7;
+		note.effect = (p[1] >> 4) & 7;
+		note.custom = (p[1] & 0x80) != 0;
+		return note;
+	}
+
+	bool SfxPlayer::beginNote(int n) {
+		const uint8_t* header = sfxHeader();
+		int loopStart = header[2];
+		int loopEnd = header[3];
+		int endNote = m_endNote;
+		if (loopEnd > loopStart) {
+			if (!m_released && n >= loopEnd) {
+				n = loopStart;
+			}
+		} else if (loopEnd == 0 && loopStart > 0) {
+			// no loop end, loop start is the length of the sfx
+			endNote = std::min(endNote, loopStart);
+		}
+		if (n >= endNote) {
+			return false;
+		}
+
+		Note note = readNote(n);
+		bool legato = note.effect == FX_SLIDE && m_current.custom && note.custom &&
+		              m_current.waveform == note.waveform;
+		m_prevPitch = (float)m_current.pitch;
+		m_prevVolume = m_current.volume / 7.0f;
+		m_current = note;
+		m_note = n;
+		m_speed = std::max(1, (int)header[1]);
+		m_notePos = 0;
+		m_noteLength = m_speed * samplesPerTick;
+
+		if (note.custom && m_instrument && !legato) {
+			m_instrument->start(m_sfxdata, note.waveform, 0, SFX_NOTES, nullptr);
+		}
+		return true;
+	}
+
+	void SfxPlayer::oscillate(float* out, int count, float pitch, float volume) {
+		float freq = BASE_FREQ * std::pow(2.0f, pitch / 12.0f);
+		float inc = freq / sampleRate;
+		int octave = std::max(0, std::min((int)(pitch / 12.0f), NUM_OCTAVES - 1));
+		const float gainStep = 1.0f / GAIN_RAMP_SAMPLES;
+
+		auto next_gain = [&]() {
+			m_gain += std::max(-gainStep, std::min(volume - m_gain, gainStep));
+			return m_gain;
+		};
+
+		switch (m_current.waveform) {
+			case WAVE_NOISE: {
+				// white noise through a one pole low pass tracking the pitch, scaled to keep
+				// the level roughly constant
+				float k = std::min(1.0f, freq * 8.0f / sampleRate);
+				float level = 0.35f / std::sqrt(k / (2.0f - k));
+				for (int n = 0; n < count; n++) {
+					m_seed = m_seed * 1664525u + 1013904223u;
+					float white = (float)(m_seed >> 16) / 32768.0f - 1.0f;
+					m_noise += (white - m_noise) * k;
+					float s = std::max(-0.5f, std::min(m_noise * level, 0.5f));
+					out[n] += s * next_gain();
+				}
+				break;
+			}
+			case WAVE_PHASER: {
+				const float* table = wavetables[WAVE_TRIANGLE][octave];
+				float inc2 = inc * (1.0f + 1.0f / 128.0f);
+				for (int n = 0; n < count; n++) {
+					float s = 0.5f * (table_lookup(table, m_phase) + table_lookup(table, m_phase2));
+					out[n] += s * next_gain();
+					m_phase += inc;
+					m_phase -= (int)m_phase;
+					m_phase2 += inc2;
+					m_phase2 -= (int)m_phase2;
+				}
+				break;
+			}
+			default: {
+				const float* table = wavetables[m_current.waveform][octave];
+				for (int n = 0; n < count; n++) {
+					out[n] += table_lookup(table, m_phase) * next_gain();
+					m_phase += inc;
+					m_phase -= (int)m_phase;
+				}
+				break;
+			}
+		}
+	}
+
+	int SfxPlayer::render(float* out, int count, float transpose, float volume) {
+		int done = 0;
+		while (m_playing && done < count) {
+			if (m_notePos >= m_noteLength && !beginNote(m_note + 1)) {
+				m_playing = false;
+				break;
+			}
+
+			int n = std::min(std::min(count - done, CONTROL_SAMPLES), m_noteLength - m_notePos);
+			float t = (float)m_notePos / m_noteLength;
+			float pitch = (float)m_current.pitch;
+			float vol = m_current.volume / 7.0f;
+
+			switch (m_current.effect) {
+				case FX_SLIDE:
+					pitch = lerp(m_prevPitch, pitch, t);
+					vol = lerp(m_prevVolume, vol, t);
+					break;
+				case FX_VIBRATO:
+					pitch += 0.5f * lfo_triangle(m_time * VIBRATO_HZ / sampleRate);
+					break;
+				case FX_DROP:
+					pitch += 12.0f * std::log2(std::max(1.0f - t, 0.001f));
+					break;
+				case FX_FADE_IN:
+					vol *= t;
+					break;
+				case FX_FADE_OUT:
+					vol *= 1.0f - t;
+					break;
+				case FX_ARP_FAST:
+				case FX_ARP_SLOW: {
+					// steps through the group of 4 notes containing this one, twice as fast
+					// for sfx speeds of 8 and below
+					int ticks = m_current.effect == FX_ARP_FAST ? 4 : 8;
+					if (m_speed <= 8) {
+						ticks /= 2;
+					}
+					int step = (m_time / (ticks * samplesPerTick)) & 3;
+					pitch = (float)readNote((m_note & ~3) + step).pitch;
+					break;
+				}
+			}
+
+			pitch += transpose;
+			vol *= volume;
+
+			if (m_current.custom && m_instrument) {
+				// the instrument sfx plays C-2 at the pitch of the note
+				if (m_instrument->isPlaying()) {
+					m_instrument->render(out + done, n, pitch - 24.0f, vol);
+				}
+			} else {
+				oscillate(out + done, n, pitch, vol);
+			}
+
+			m_notePos += n;
+			m_time += n;
+			done += n;
+		}
+		return done;
+	}
+
+	// renders a player as 16 bit samples, returns the number of samples rendered
+	static int render_player(SfxPlayer& player, int16_t* buffer, int count, float volume) {
+		float mix[RENDER_BLOCK];
+		int done = 0;
+		while (done < count) {
+			int n = std::min(count - done, RENDER_BLOCK);
+			std::fill(mix, mix + n, 0.0f);
+			int rendered = player.render(mix, n, 0, volume);
+			for (int i = 0; i < rendered; i++) {
+				float s = std::max(-1.0f, std::min(mix[i], 1.0f));
+				buffer[done + i] = (int16_t)(s * 32767.0f);
+			}
+			done += rendered;
+			if (rendered < n) {
+				break;
+			}
+		}
+		return done;
+	}
+
+	void SfxVoice::start(const uint8_t* sfxdata, int sfx, int offset, int length) {
+		m_instrument.stop();
+		m_player.start(sfxdata, sfx, offset, length, &m_instrument);
+		publish();
+	}
+
+	int SfxVoice::render(int16_t* buffer, int count) {
+		int rendered = render_player(m_player, buffer, count, 1.0f);
+		publish();
+		return rendered;
+	}
+
+	void SfxVoice::release() {
+		m_player.release();
+	}
+
+	void SfxVoice::publish() {
+		m_status = m_player.isPlaying() ? (m_player.sfx() | (m_player.note() << 8)) : -1;
+	}
+
+	int SfxVoice::sfx() const {
+		int status = m_status;
+		return status < 0 ? -1 : status & 0xff;
+	}
+
+	int SfxVoice::note() const {
+		int status = m_status;
+		return status < 0 ? -1 : status >> 8;
+	}
+
+	MusicPlayer::MusicPlayer() {
+		publish();
+	}
+
+	void MusicPlayer::setMemory(const uint8_t* musicdata, const uint8_t* sfxdata) {
+		m_musicdata = musicdata;
+		m_sfxdata = sfxdata;
+		// drop any play() made before
+		m_appliedSeq = (uint32_t)m_command.load(std::memory_order_acquire);
+		stopMusic();
+		publish();
+	}
+
+	void MusicPlayer::play(int pattern, int fadems, int channelmask) {
+		m_commandSeq++;
+		uint64_t cmd = m_commandSeq;
+		cmd |= (uint64_t)(std::max(-1, std::min(pattern, 63)) + 1) << 32;
+		cmd |= (uint64_t)std::max(0, std::min(fadems, 0xffff)) << 40;
+		cmd |= (uint64_t)(channelmask & 0xff) << 56;
+		m_command.store(cmd, std::memory_order_release);
+	}
+
+	void MusicPlayer::applyCommand() {
+		uint64_t cmd = m_command.load(std::memory_order_acquire);
+		if ((uint32_t)cmd == m_appliedSeq) {
+			return;
+		}
+		m_appliedSeq = (uint32_t)cmd;
+		int pattern = (int)((cmd >> 32) & 0xff) - 1;
+		int fadems = (int)((cmd >> 40) & 0xffff);
+		float fadeSamples = fadems * sampleRate / 1000.0f;
+
+		if (pattern < 0) {
+			if (fadems > 0 && m_pattern >= 0) {
+				m_fadeStep = -1.0f / fadeSamples;
+			} else {
+				stopMusic();
+			}
+			return;
+		}
+
+		m_patternCount = 0;
+		if (fadems > 0) {
+			m_volume = 0;
+			m_fadeStep = 1.0f / fadeSamples;
+		} else {
+			m_volume = 1.0f;
+			m_fadeStep = 0;
+		}
+		if (!startPattern(pattern)) {
+			stopMusic();
+		}
+	}
+
+	bool MusicPlayer::startPattern(int pattern) {
+		const uint8_t* p = m_musicdata + pattern * 4;
+		int length = 0;
+		int fallbackLength = 0;
+		for (int c = 0; c < MUSIC_CHANNELS; c++) {
+			int sfx = p[c] & 0x7f;
+			m_instruments[c].stop();
+			if (sfx > 63) {
+				// channel disabled
+				m_players[c].stop();
+				continue;
+			}
+			m_players[c].start(m_sfxdata, sfx, 0, SFX_NOTES, &m_instruments[c]);
+
+			// the pattern lasts as long as the leftmost channel that does not loop, or the
+			// leftmost channel if they all loop
+			const uint8_t* header = m_sfxdata + sfx * SFX_SIZE + SFX_NOTES * 2;
+			int speed = std::max(1, (int)header[1]);
+			int loopStart = header[2];
+			int loopEnd = header[3];
+			int notes = (loopEnd == 0 && loopStart > 0) ? loopStart : SFX_NOTES;
+			int samples = speed * notes * samplesPerTick;
+			if (length == 0 && loopEnd <= loopStart) {
+				length = samples;
+			}
+			if (fallbackLength == 0) {
+				fallbackLength = speed * SFX_NOTES * samplesPerTick;
+			}
+		}
+		if (fallbackLength == 0) {
+			// empty pattern
+			return false;
+		}
+		m_pattern = pattern;
+		m_patternCount++;
+		m_pos = 0;
+		m_length = length ? length : fallbackLength;
+		return true;
+	}
+
+	void MusicPlayer::nextPattern() {
+		const uint8_t* p = m_musicdata + m_pattern * 4;
+		int next = m_pattern + 1;
+		if (p[2] & 0x80 || (m_patternLimit > 0 && m_patternCount >= m_patternLimit)) {
+			next = -1;
+		} else if (p[1] & 0x80 && m_patternLimit > 0) {
+			next = -1;
+		} else if (p[1] & 0x80) {
+			// back to the closest loop start, or the first pattern
+			next = 0;
+			for (int n = m_pattern; n >= 0; n--) {
+				if (m_musicdata[n * 4] & 0x80) {
+					next = n;
+					break;
+				}
+			}
+		}
+		if (next < 0 || next > 63 || !startPattern(next)) {
+			stopMusic();
+		}
+	}
+
+	void MusicPlayer::stopMusic() {
+		m_pattern = -1;
+		m_fadeStep = 0;
+		for (int c = 0; c < MUSIC_CHANNELS; c++) {
+			m_players[c].stop();
+			m_instruments[c].stop();
+		}
+	}
+
+	int MusicPlayer::step(int count) {
+		applyCommand();
+		if (m_pattern >= 0 && m_fadeStep < 0 && m_volume <= 0) {
+			stopMusic();
+		}
+		if (m_pattern >= 0 && m_pos >= m_length) {
+			nextPattern();
+		}
+		if (m_pattern < 0) {
+			publish();
+			return count;
+		}
+
+		int n = std::min(count, m_length - m_pos);
+		m_runVolume = m_volume;
+		m_volume = std::max(0.0f, std::min(m_volume + m_fadeStep * n, 1.0f));
+		m_pos += n;
+		publish();
+		return n;
+	}
+
+	bool MusicPlayer::render(int chan, int16_t* buffer, int count) {
+		if (m_pattern < 0 || chan >= MUSIC_CHANNELS || !m_players[chan].isPlaying()) {
+			return false;
+		}
+		int rendered = render_player(m_players[chan], buffer, count, m_runVolume);
+		std::fill(buffer + rendered, buffer + count, 0);
+		return true;
+	}
+
+	void MusicPlayer::publish() {
+		uint32_t version = m_version.load(std::memory_order_relaxed);
+		m_version.store(version + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+
+		bool playing = m_pattern >= 0;
+		m_statusPattern.store(m_pattern, std::memory_order_relaxed);
+		m_statusCount.store(m_patternCount, std::memory_order_relaxed);
+		m_statusTicks.store(playing ? m_pos / samplesPerTick : 0, std::memory_order_relaxed);
+		for (int c = 0; c < MUSIC_CHANNELS; c++) {
+			bool active = playing && m_players[c].isPlaying();
+			m_statusSfx[c].store(active ? m_players[c].sfx() : -1, std::memory_order_relaxed);
+			m_statusNote[c].store(active ? m_players[c].note() : -1, std::memory_order_relaxed);
+		}
+
+		m_version.store(version + 2, std::memory_order_release);
+	}
+
+	MusicStatus MusicPlayer::status() const {
+		MusicStatus s;
+		uint32_t before, after;
+		do {
+			before = m_version.load(std::memory_order_acquire);
+			s.pattern = m_statusPattern.load(std::memory_order_relaxed);
+			s.patternCount = m_statusCount.load(std::memory_order_relaxed);
+			s.ticks = m_statusTicks.load(std::memory_order_relaxed);
+			for (int c = 0; c < MUSIC_CHANNELS; c++) {
+				s.sfx[c] = m_statusSfx[c].load(std::memory_order_relaxed);
+				s.note[c] = m_statusNote[c].load(std::memory_order_relaxed);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			after = m_version.load(std::memory_order_relaxed);
+		} while (before != after || (before & 1));
+		return s;
+	}
+
+	void PcmStream::reset(int rate) {
+		m_head.store(0, std::memory_order_relaxed);
+		m_tail.store(0, std::memory_order_relaxed);
+		m_step = (uint32_t)(((uint64_t)std::max(rate, 1) << 16) / AUDIO_Frequency());
+		m_phase = 1 << 16;
+		m_prev = m_next = 0;
+	}
+
+	int PcmStream::space() const {
+		return config::PCM_BUFFER_SIZE -
+		       (m_tail.load(std::memory_order_relaxed) - m_head.load(std::memory_order_acquire));
+	}
+
+	int PcmStream::push(const uint8_t* data, int count, int bits) {
+		const uint32_t mask = config::PCM_BUFFER_SIZE - 1;
+		uint32_t tail = m_tail.load(std::memory_order_relaxed);
+		int n = std::min(count, space());
+		for (int i = 0; i < n; i++) {
+			m_queue[(tail + i) & mask] = bits == 16 ? (int16_t)(data[i * 2] | data[i * 2 + 1] << 8)
+			                                        : (int16_t)((data[i] - 128) << 8);
+		}
+		m_tail.store(tail + n, std::memory_order_release);
+		return n;
+	}
+
+	int PcmStream::render(int16_t* buffer, int count) {
+		const uint32_t mask = config::PCM_BUFFER_SIZE - 1;
+		const uint32_t ONE = 1 << 16;
+		uint32_t head = m_head.load(std::memory_order_relaxed);
+		uint32_t tail = m_tail.load(std::memory_order_acquire);
+		for (int n = 0; n < count; n++) {
+			while (m_phase >= ONE && head != tail) {
+				m_prev = m_next;
+				m_next = m_queue[head++ & mask];
+				m_phase -= ONE;
+			}
+			if (m_phase >= ONE) {
+				// the cart has not kept up, carry on from silence once it does
+				m_prev = m_next = 0;
+				std::fill(buffer + n, buffer + count, 0);
+				break;
+			}
+			buffer[n] = (int16_t)(m_prev + (((int64_t)(m_next - m_prev) * m_phase) >> 16));
+			m_phase += m_step;
+		}
+		m_head.store(head, std::memory_order_release);
+		// plays until it is stopped
+		return count;
+	}
+
+}  // namespace pico_synth
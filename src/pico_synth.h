@@ -0,0 +1,187 @@
+#ifndef PICO_SYNTH_H
+#define PICO_SYNTH_H
+
+#include <stdint.h>
+#include <atomic>
+
+#include "config.h"
+#include "hal_audio.h"
+
+namespace pico_synth {
+
+	// builds the wavetables, must be called before any voice is rendered.
+	void init();
+
+	// one sfx being played, either the sfx started on a channel or the sfx used as the custom
+	// instrument of one of its notes. notes and sfx settings are read from sfx memory as they
+	// are reached, so pokes to sfx memory are heard.
+	class SfxPlayer {
+	   public:
+		void start(const uint8_t* sfxdata, int sfx, int offset, int length, SfxPlayer* instrument);
+		void stop();
+		void release();
+		bool isPlaying() const {
+			return m_playing;
+		}
+		int sfx() const {
+			return m_sfx;
+		}
+		int note() const {
+			return m_note;
+		}
+
+		// mixes count samples into out, transposed by transpose semitones and scaled by volume.
+		// returns the number of samples rendered, less than count once the sfx has finished.
+		int render(float* out, int count, float transpose, float volume);
+
+	   private:
+		struct Note {
+			int pitch;
+			int waveform;
+			int volume;
+			int effect;
+			bool custom;
+		};
+
+		const uint8_t* sfxHeader() const;
+		Note readNote(int n) const;
+		bool beginNote(int n);
+		void oscillate(float* out, int count, float pitch, float volume);
+
+		const uint8_t* m_sfxdata = nullptr;
+		SfxPlayer* m_instrument = nullptr;
+		int m_sfx = -1;
+		int m_note = 0;
+		int m_endNote = 32;
+		bool m_released = false;
+		bool m_playing = false;
+
+		Note m_current = Note();
+		float m_prevPitch = 0;
+		float m_prevVolume = 0;
+		int m_notePos = 0;
+		int m_noteLength = 0;
+		int m_speed = 1;
+		uint32_t m_time = 0;
+
+		float m_phase = 0;
+		float m_phase2 = 0;
+		float m_gain = 0;
+		float m_noise = 0;
+		uint32_t m_seed = 1;
+	};
+
+	// channel source playing an sfx from the 0x3200 sfx memory
+	class SfxVoice : public AudioSource {
+	   public:
+		void start(const uint8_t* sfxdata, int sfx, int offset, int length);
+		int render(int16_t* buffer, int count) override;
+		void release() override;
+
+		// position as of the last render, safe to call from any thread. -1 once finished.
+		int sfx() const;
+		int note() const;
+
+	   private:
+		void publish();
+
+		SfxPlayer m_player;
+		SfxPlayer m_instrument;
+		std::atomic<int> m_status{-1};
+	};
+
+	// samples generated by the cart, queued by the owning thread and taken by the audio thread
+	// without locking. played at their own rate, silence while the queue is empty.
+	class PcmStream : public AudioSource {
+	   public:
+		// empties the queue and sets the rate the samples are played at. must not be called while
+		// the stream is playing.
+		void reset(int rate);
+		// queues 8 bit unsigned or 16 bit signed little endian samples. returns the number
+		// queued, fewer than count once the queue is full.
+		int push(const uint8_t* data, int count, int bits);
+		// samples that can be queued before it is full
+		int space() const;
+		int render(int16_t* buffer, int count) override;
+
+	   private:
+		int16_t m_queue[config::PCM_BUFFER_SIZE];
+		std::atomic<uint32_t> m_head{0};
+		std::atomic<uint32_t> m_tail{0};
+
+		// audio thread, the output is interpolated between the last two samples taken
+		uint32_t m_step = 0;  // 16.16 samples taken per sample rendered
+		uint32_t m_phase = 0;
+		int16_t m_prev = 0;
+		int16_t m_next = 0;
+	};
+
+	const int MUSIC_CHANNELS = config::AUDIO_CHANNELS;
+
+	struct MusicStatus {
+		int pattern = -1;  // -1 when music is not playing
+		int patternCount = 0;
+		int ticks = 0;  // ticks played on the current pattern
+		int sfx[MUSIC_CHANNELS];
+		int note[MUSIC_CHANNELS];
+	};
+
+	// music() sequencer. runs on the audio thread, patterns are read from the 0x3100 music memory
+	// as they are reached and change on the sample the previous pattern ends.
+	class MusicPlayer : public AudioSequencer {
+	   public:
+		MusicPlayer();
+		// must not be called while the player is the sequencer of the output channels
+		void setMemory(const uint8_t* musicdata, const uint8_t* sfxdata);
+		// for offline rendering, the music stops after this many patterns and where it would
+		// loop back. 0, the default, for no limit. same restriction as setMemory().
+		void setPatternLimit(int patterns) {
+			m_patternLimit = patterns;
+		}
+		// called by the thread the player belongs to, started on the audio thread at the next
+		// step. pattern -1 stops the music.
+		void play(int pattern, int fadems, int channelmask);
+		// lock free snapshot of the playback position, safe to call from any thread
+		MusicStatus status() const;
+
+		int step(int count) override;
+		bool render(int chan, int16_t* buffer, int count) override;
+
+	   private:
+		void applyCommand();
+		bool startPattern(int pattern);
+		void nextPattern();
+		void stopMusic();
+		void publish();
+
+		const uint8_t* m_musicdata = nullptr;
+		const uint8_t* m_sfxdata = nullptr;
+
+		// latest play() packed with its sequence number, written by the owning thread
+		std::atomic<uint64_t> m_command{0};
+		uint32_t m_commandSeq = 0;
+		uint32_t m_appliedSeq = 0;
+
+		SfxPlayer m_players[MUSIC_CHANNELS];
+		SfxPlayer m_instruments[MUSIC_CHANNELS];
+		int m_pattern = -1;
+		int m_patternCount = 0;
+		int m_patternLimit = 0;
+		int m_pos = 0;
+		int m_length = 0;
+		float m_volume = 1.0f;
+		float m_fadeStep = 0;
+		float m_runVolume = 1.0f;
+
+		// seqlock, odd while the audio thread is writing the snapshot
+		std::atomic<uint32_t> m_version{0};
+		std::atomic<int> m_statusPattern{-1};
+		std::atomic<int> m_statusCount{0};
+		std::atomic<int> m_statusTicks{0};
+		std::atomic<int> m_statusSfx[MUSIC_CHANNELS];
+		std::atomic<int> m_statusNote[MUSIC_CHANNELS];
+	};
+
+}  // namespace pico_synth
+
+#endif /* PICO_SYNTH_H */
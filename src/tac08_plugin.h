@@ -0,0 +1,98 @@
+#ifndef TAC08_PLUGIN_H
+#define TAC08_PLUGIN_H
+
+/*
+ * tac08 native plugin interface.
+ *
+ * a plugin is a shared library (.so / .dylib / .dll) exporting:
+ *
+ *   TAC08_PLUGIN_EXPORT int tac08_plugin_api_version(void);
+ *       returns TAC08_PLUGIN_API_VERSION the plugin was built against.
+ *
+ *   TAC08_PLUGIN_EXPORT int tac08_plugin_register(const tac08_api* api);
+ *       called each time a cart's lua state is created. register functions with
+ *       api->register_function, they are added to the __tac08__ table. return 0 on success.
+ *
+ * plugins may be loaded by a cart with a "#plugin name" line or with the --plugin command line
+ * option. functions are called on the thread running the cart, and the api functions act on
+ * that cart.
+ *
+ * new entries are only ever added to the end of tac08_api, a plugin built against an older
+ * version of this header works with a newer tac08.
+ */
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TAC08_PLUGIN_API_VERSION 1
+
+#if defined(_WIN32)
+#define TAC08_PLUGIN_EXPORT __declspec(dllexport)
+#else
+#define TAC08_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif
+
+/* pico-8 number: 16.16 fixed point */
+typedef int32_t tac08_fix32;
+
+#define TAC08_FIX32(i) ((tac08_fix32)((i) * 65536))
+#define TAC08_FIX32_INT(f) ((int)((f) >> 16))
+
+#define TAC08_PLUGIN_MAX_ARGS 16
+#define TAC08_PLUGIN_MAX_RESULTS 8
+
+/* native function callable from lua. missing arguments are 0. write up to
+ * TAC08_PLUGIN_MAX_RESULTS values to results and return how many were written. */
+typedef int (*tac08_function)(void* userdata,
+                              int argc,
+                              const tac08_fix32* argv,
+                              tac08_fix32* results);
+
+typedef struct tac08_api {
+	uint32_t version; /* TAC08_PLUGIN_API_VERSION of the host */
+	uint32_t size;    /* sizeof(tac08_api) of the host */
+
+	/* registration */
+	void (*register_function)(const char* name, tac08_function func, void* userdata);
+	void (*log)(const char* msg);
+
+	/* drawing, colours are the integer part of the colour argument of the lua functions */
+	void (*cls)(uint8_t col);
+	void (*pset)(int x, int y, uint16_t col);
+	uint8_t (*pget)(int x, int y);
+	void (*line)(int x0, int y0, int x1, int y1, uint16_t col);
+	void (*rect)(int x0, int y0, int x1, int y1, uint16_t col);
+	void (*rectfill)(int x0, int y0, int x1, int y1, uint16_t col);
+	void (*circ)(int x, int y, int r, uint16_t col);
+	void (*circfill)(int x, int y, int r, uint16_t col);
+	void (*spr)(int n, int x, int y, int w, int h, int flip_x, int flip_y);
+	void (*sspr)(int sx, int sy, int sw, int sh, int dx, int dy, int dw, int dh);
+	uint8_t (*sget)(int x, int y);
+	void (*sset)(int x, int y, uint8_t col);
+	uint8_t (*mget)(int x, int y);
+	void (*mset)(int x, int y, uint8_t v);
+	uint8_t (*fget)(int n);
+	void (*fset)(int n, uint8_t v);
+
+	/* memory */
+	uint8_t (*peek)(uint16_t addr);
+	void (*poke)(uint16_t addr, uint8_t v);
+	void (*memcpy)(uint16_t dest, uint16_t src, uint16_t len);
+	void (*memset)(uint16_t dest, uint8_t v, uint16_t len);
+
+	/* input */
+	int (*btn)(int n, int player);
+	int (*btnp)(int n, int player);
+} tac08_api;
+
+typedef int (*tac08_plugin_api_version_fn)(void);
+typedef int (*tac08_plugin_register_fn)(const tac08_api* api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TAC08_PLUGIN_H */
@@ -0,0 +1,198 @@
+#include "timeline.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "log.h"
+
+namespace {
+	// events kept per thread in a recording, later ones are dropped
+	const uint32_t EVENTS_PER_THREAD = 32768;
+
+	struct Event {
+		char name[24];
+		int32_t arg;
+		uint64_t start;
+		uint64_t end;
+	};
+
+	// written only by its thread. the recording it holds events for is set before the count is
+	// reset, and the count is published after each event, so the writer reads complete events.
+	struct Buffer {
+		std::string name;
+		int tid = 0;
+		std::atomic<uint32_t> gen{0};
+		std::atomic<uint32_t> count{0};
+		std::atomic<uint32_t> dropped{0};
+		std::vector<Event> events;
+	};
+
+	std::mutex buffersLock;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+
+	thread_local Buffer* localBuffer = nullptr;
+	thread_local const char* localName = nullptr;
+
+	// the recording, only used by the frame loop thread
+	std::string path;
+	uint32_t first = 0;
+	uint32_t last = 0;
+	bool armed = false;
+	uint64_t startNs = 0;
+
+	Buffer* add_buffer() {
+		std::lock_guard<std::mutex> lock(buffersLock);
+		std::unique_ptr<Buffer> b(new Buffer);
+		b->tid = (int)buffers.size() + 1;
+		b->name = localName ? localName : "thread " + std::to_string(b->tid);
+		b->events.resize(EVENTS_PER_THREAD);
+		buffers.push_back(std::move(b));
+		return buffers.back().get();
+	}
+
+	void write_name(FILE* file, const char* name) {
+		for (const char* c = name; *c; c++) {
+			if (*c == '"' || *c == '\\') {
+				fputc('\\', file);
+			}
+			if ((unsigned char)*c >= 32) {
+				fputc(*c, file);
+			}
+		}
+	}
+
+	void write() {
+		timeline::impl::recording.store(false, std::memory_order_relaxed);
+		uint32_t gen = timeline::impl::generation.load(std::memory_order_relaxed);
+
+		FILE* file = fopen(path.c_str(), "w");
+		if (!file) {
+			logr << LogLevel::err << "could not write timeline: " << path;
+			return;
+		}
+		fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+		fprintf(file,
+		        "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,"
+		        "\"args\":{\"name\":\"tac08\"}}");
+
+		uint32_t written = 0;
+		uint32_t dropped = 0;
+		std::lock_guard<std::mutex> lock(buffersLock);
+		for (auto& b : buffers) {
+			if (b->gen.load(std::memory_order_acquire) != gen) {
+				continue;
+			}
+			fprintf(file,
+			        ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+			        "\"args\":{\"name\":\"",
+			        b->tid);
+			write_name(file, b->name.c_str());
+			fprintf(file, "\"}}");
+
+			uint32_t count = b->count.load(std::memory_order_acquire);
+			for (uint32_t n = 0; n < count; n++) {
+				const Event& e = b->events[n];
+				if (e.start < startNs) {
+					// began before the recording did
+					continue;
+				}
+				fprintf(file, ",\n{\"name\":\"");
+				write_name(file, e.name);
+				fprintf(file, "\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d",
+				        (e.start - startNs) / 1000.0, (e.end - e.start) / 1000.0, b->tid);
+				if (e.arg >= 0) {
+					fprintf(file, ",\"args\":{\"n\":%d}", e.arg);
+				}
+				fprintf(file, "}");
+				written++;
+			}
+			dropped += b->dropped.load(std::memory_order_relaxed);
+		}
+		fprintf(file, "\n]}\n");
+		fclose(file);
+
+		logr << "timeline written: " << path << " frames " << first << "-" << last << " "
+		     << written << " events";
+		if (dropped > 0) {
+			logr << LogLevel::err << "timeline: " << dropped << " events dropped, buffers full";
+		}
+	}
+}  // namespace
+
+namespace timeline {
+	namespace impl {
+		std::atomic<bool> recording{false};
+		std::atomic<uint32_t> generation{0};
+
+		uint64_t now_ns() {
+			using namespace std::chrono;
+			return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+		}
+
+		void add(const char* name, int32_t arg, uint64_t start, uint64_t end, uint32_t gen) {
+			if (gen != generation.load(std::memory_order_acquire)) {
+				// an earlier recording
+				return;
+			}
+			Buffer* b = localBuffer;
+			if (!b) {
+				b = localBuffer = add_buffer();
+			}
+			if (b->gen.load(std::memory_order_relaxed) != gen) {
+				b->count.store(0, std::memory_order_relaxed);
+				b->dropped.store(0, std::memory_order_relaxed);
+				b->gen.store(gen, std::memory_order_release);
+			}
+
+			uint32_t n = b->count.load(std::memory_order_relaxed);
+			if (n >= b->events.size()) {
+				b->dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+			Event& e = b->events[n];
+			strncpy(e.name, name, sizeof(e.name) - 1);
+			e.name[sizeof(e.name) - 1] = 0;
+			e.arg = arg;
+			e.start = start;
+			e.end = end;
+			b->count.store(n + 1, std::memory_order_release);
+		}
+	}  // namespace impl
+
+	void record(const std::string& file, uint32_t from, uint32_t to) {
+		impl::recording.store(false, std::memory_order_relaxed);
+		path = file;
+		first = from;
+		last = std::max(from, to);
+		armed = true;
+		logr << "timeline: recording frames " << first << "-" << last << " to " << path;
+	}
+
+	void frame(uint32_t n) {
+		if (recording() && n > last) {
+			write();
+		} else if (armed && n >= first) {
+			armed = false;
+			impl::generation.fetch_add(1, std::memory_order_release);
+			startNs = impl::now_ns();
+			impl::recording.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	void finish() {
+		if (recording()) {
+			write();
+		}
+	}
+
+	void thread_name(const char* name) {
+		if (!localName) {
+			localName = name;
+		}
+	}
+}  // namespace timeline
@@ -0,0 +1,62 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// a timeline of what each thread was doing over a range of frames, written as chrome trace event
+// json (chrome://tracing, ui.perfetto.dev). every thread records into its own buffer, so recording
+// an event takes no locks.
+namespace timeline {
+	namespace impl {
+		extern std::atomic<bool> recording;
+		extern std::atomic<uint32_t> generation;
+		uint64_t now_ns();
+		void add(const char* name, int32_t arg, uint64_t start, uint64_t end, uint32_t gen);
+	}  // namespace impl
+
+	// records frames first to last (counting from 1) and writes them to path once the last one
+	// has finished. replaces any recording not yet written.
+	void record(const std::string& path, uint32_t first, uint32_t last);
+	// called as each frame starts, starts and ends the recording
+	void frame(uint32_t n);
+	// writes a recording that is still going, when the frame loop ends
+	void finish();
+
+	inline bool recording() {
+		return impl::recording.load(std::memory_order_relaxed);
+	}
+
+	// the name shown for the calling thread, the first name given is kept
+	void thread_name(const char* name);
+
+	// an event from construction to destruction. names longer than 23 characters are cut short,
+	// arg is shown with the event if it is not negative.
+	class Scope {
+	   public:
+		explicit Scope(const char* name, int32_t arg = -1) {
+			if (recording()) {
+				this->name = name;
+				this->arg = arg;
+				gen = impl::generation.load(std::memory_order_acquire);
+				start = impl::now_ns();
+			}
+		}
+		~Scope() {
+			if (name) {
+				impl::add(name, arg, start, impl::now_ns(), gen);
+			}
+		}
+		Scope(const Scope&) = delete;
+		Scope& operator=(const Scope&) = delete;
+
+	   private:
+		const char* name = nullptr;
+		int32_t arg = -1;
+		uint32_t gen = 0;
+		uint64_t start = 0;
+	};
+}  // namespace timeline
+
+#endif /* TIMELINE_H */
@@ -113,4 +113,22 @@ namespace utils {
 		}
 	}
 
+	uint64_t hash(const void* data, size_t size, uint64_t seed) {
+		const uint64_t MUL = 0x9e3779b97f4a7c15ull;
+		const uint8_t* p = (const uint8_t*)data;
+		uint64_t h = seed ^ (size * MUL);
+		// a word at a time, a change to any one word always changes the hash
+		for (; size >= 8; size -= 8, p += 8) {
+			uint64_t w;
+			memcpy(&w, p, 8);
+			h = (h ^ w) * MUL;
+			h ^= h >> 32;
+		}
+		for (; size > 0; size--, p++) {
+			h = (h ^ *p) * MUL;
+			h ^= h >> 32;
+		}
+		return h;
+	}
+
 }  // namespace utils
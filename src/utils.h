@@ -1,6 +1,7 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <string>
 #include <vector>
 
@@ -45,6 +46,9 @@ namespace utils {
 	                 std::vector<std::string>& output,
 	                 const char* sep_chars);
 
+	// a quick 64 bit hash for telling whether data has changed, not for tables or security
+	uint64_t hash(const void* data, size_t size, uint64_t seed = 0);
+
 }  // namespace utils
 
 #define STRINGIFY(x) #x